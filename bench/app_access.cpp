@@ -0,0 +1,110 @@
+#include <iostream>
+#include <iomanip>
+#include <thread>
+#include "../dot.h"
+#include "bench.h"
+
+// Measures how access to the global AppContainer scales with threads.  getInstance() copies
+// a shared_ptr, so every call writes the same reference count, and so does a default
+// ContainerAware.  instance() and a ContainerAware given the unowned() handle don't write
+// shared memory at all, and neither does a CompactContainerAware borrowing the app
+// container.  Each case runs on 1 to N threads at once and reports the time per call per
+// thread.
+//
+// Usage: dot_bench_app_access [--threads=1,2,4,...] [--iterations=5000000]
+
+class Probe {
+public:
+    int value;
+};
+
+class Injected {
+public:
+    Injected() {
+        DOT_INJECT(Probe, probe);
+    }
+
+    std::shared_ptr<Probe> probe;
+};
+
+template<typename Function>
+static double perThread(unsigned threads, uint64_t iterations, Function function) {
+    std::vector<std::thread> workers;
+    std::vector<double> nanos(threads);
+    std::atomic<unsigned> ready(0);
+    for (unsigned thread = 0; thread < threads; thread++) {
+        workers.push_back(std::thread([&, thread]() {
+            ready++;
+            while (ready.load() < threads) {
+            }
+
+            uint64_t start = Bench::now();
+            for (uint64_t i = 0; i < iterations; i++) {
+                function();
+            }
+
+            nanos[thread] = static_cast<double>(Bench::now() - start) / iterations;
+        }));
+    }
+
+    for (auto &worker : workers) {
+        worker.join();
+    }
+
+    return *std::max_element(nanos.begin(), nanos.end());
+}
+
+int main(int argc, char **argv) {
+    uint64_t iterations = Bench::arg(argc, argv, "iterations", 5000000ULL);
+    std::vector<unsigned> counts;
+    std::string list = Bench::arg(argc, argv, "threads", std::string());
+    if (list.empty()) {
+        unsigned cores = std::max(1u, std::thread::hardware_concurrency());
+        for (unsigned threads = 1; threads < cores; threads *= 2) {
+            counts.push_back(threads);
+        }
+
+        counts.push_back(cores);
+    } else {
+        std::stringstream stream(list);
+        std::string value;
+        while (std::getline(stream, value, ',')) {
+            counts.push_back(static_cast<unsigned>(std::max(1UL, std::strtoul(value.c_str(), nullptr, 10))));
+        }
+    }
+
+    Dot::AppContainer::instance().registerService(new Probe());
+
+    std::cout << std::setw(8) << "threads" << std::setw(16) << "getInstance()" << std::setw(14) << "instance()"
+              << std::setw(18) << "ContainerAware()" << std::setw(18) << "...Aware(unowned)" << std::setw(18)
+              << "Compact...Aware()" << std::setw(14)
+              << "DOT_INJECT" << "   (ns/call/thread)"
+              << std::endl;
+    for (unsigned threads : counts) {
+        std::cout << std::setw(8) << threads << std::fixed << std::setprecision(1);
+        std::cout << std::setw(16) << perThread(threads, iterations, []() {
+            Bench::doNotOptimize(Dot::AppContainer::getInstance());
+        });
+        std::cout << std::setw(14) << perThread(threads, iterations, []() {
+            Bench::doNotOptimize(&Dot::AppContainer::instance());
+        });
+        std::cout << std::setw(18) << perThread(threads, iterations, []() {
+            Dot::ContainerAware aware;
+            Bench::doNotOptimize(aware);
+        });
+        std::cout << std::setw(18) << perThread(threads, iterations, []() {
+            Dot::ContainerAware aware(Dot::AppContainer::unowned());
+            Bench::doNotOptimize(aware);
+        });
+        std::cout << std::setw(18) << perThread(threads, iterations, []() {
+            Dot::CompactContainerAware aware;
+            Bench::doNotOptimize(aware);
+        });
+        std::cout << std::setw(14) << perThread(threads, iterations / 10, []() {
+            Injected injected;
+            Bench::doNotOptimize(injected);
+        }) << std::endl;
+    }
+
+    return 0;
+}
@@ -0,0 +1,115 @@
+#ifndef DOT_BENCH_H
+#define DOT_BENCH_H
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <vector>
+#include <cstdlib>
+#include <fstream>
+#include <string>
+#include <unistd.h>
+
+/**
+ * Small helpers shared by the benchmark programs.
+ */
+namespace Bench {
+
+/**
+ * Returns a monotonic timestamp in nanoseconds.
+ */
+inline uint64_t now() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/**
+ * Returns the resident set size of the process in bytes, or 0 if it cannot be read.
+ */
+inline size_t residentBytes() {
+    std::ifstream statm("/proc/self/statm");
+    size_t pages = 0;
+    size_t resident = 0;
+    if (!(statm >> pages >> resident)) {
+        return 0;
+    }
+
+    return resident * static_cast<size_t>(sysconf(_SC_PAGESIZE));
+}
+
+/**
+ * Returns the private dirty memory of the process in bytes: pages it has written since they
+ * were last shared, such as copy-on-write pages after fork().  Returns 0 if it cannot be read.
+ */
+inline size_t privateDirtyBytes() {
+    std::ifstream smaps("/proc/self/smaps_rollup");
+    if (!smaps) {
+        smaps.open("/proc/self/smaps");
+    }
+
+    size_t total = 0;
+    std::string line;
+    while (std::getline(smaps, line)) {
+        if (line.compare(0, 14, "Private_Dirty:") == 0) {
+            total += std::strtoull(line.c_str() + 14, nullptr, 10) * 1024;
+        }
+    }
+
+    return total;
+}
+
+/**
+ * Returns the value of a "--name=value" argument, or the fallback if it isn't present.
+ */
+inline std::string arg(int argc, char **argv, const std::string &name, const std::string &fallback) {
+    std::string prefix = "--" + name + "=";
+    for (int i = 1; i < argc; i++) {
+        std::string value(argv[i]);
+        if (value.compare(0, prefix.size(), prefix) == 0) {
+            return value.substr(prefix.size());
+        }
+    }
+
+    return fallback;
+}
+
+inline uint64_t arg(int argc, char **argv, const std::string &name, uint64_t fallback) {
+    std::string value = arg(argc, argv, name, std::string());
+    return value.empty() ? fallback : std::strtoull(value.c_str(), nullptr, 10);
+}
+
+/**
+ * Runs the function the given number of times per repetition and returns the median time per
+ * call in nanoseconds.  One untimed repetition is run first as a warmup.
+ */
+template<typename Function>
+inline double nanosPerOp(uint64_t iterations, Function function, int repetitions = 5) {
+    for (uint64_t i = 0; i < iterations; i++) {
+        function();
+    }
+
+    std::vector<double> samples;
+    for (int repetition = 0; repetition < repetitions; repetition++) {
+        uint64_t start = now();
+        for (uint64_t i = 0; i < iterations; i++) {
+            function();
+        }
+
+        samples.push_back(static_cast<double>(now() - start) / iterations);
+    }
+
+    std::sort(samples.begin(), samples.end());
+    return samples[samples.size() / 2];
+}
+
+/**
+ * Keeps the compiler from optimizing away a value.
+ */
+template<typename Type>
+inline void doNotOptimize(const Type &value) {
+    asm volatile("" : : "r,m"(value) : "memory");
+}
+
+}
+
+#endif //DOT_BENCH_H
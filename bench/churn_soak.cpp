@@ -0,0 +1,68 @@
+#include <algorithm>
+#include <iostream>
+#include <iomanip>
+#include "../dot.h"
+#include "bench.h"
+
+// Soak test for high-churn registration: a sliding window of per-session services is
+// registered and unregistered for a large number of cycles, reporting throughput and
+// resident memory at regular intervals.
+//
+// Usage: dot_soak [--cycles=100000000] [--sessions=4096] [--mode=churn|ordered] [--reports=20]
+
+class Session {
+public:
+    Session(uint64_t id) :
+            id(id) {
+
+    }
+
+    uint64_t id;
+    char payload[48];
+};
+
+int main(int argc, char **argv) {
+    uint64_t cycles = Bench::arg(argc, argv, "cycles", 100000000ULL);
+    uint64_t sessions = Bench::arg(argc, argv, "sessions", 4096ULL);
+    uint64_t reports = Bench::arg(argc, argv, "reports", 20ULL);
+    std::string modeName = Bench::arg(argc, argv, "mode", std::string("churn"));
+
+    Dot::RegistryMode mode = modeName == "ordered" ? Dot::RegistryMode::Ordered : Dot::RegistryMode::Churn;
+    auto container = std::make_shared<Dot::Container>(mode);
+    uint64_t interval = std::max<uint64_t>(1, cycles / std::max<uint64_t>(1, reports));
+
+    std::cout << "mode=" << modeName << " cycles=" << cycles << " sessions=" << sessions << std::endl;
+    std::cout << std::setw(14) << "cycles" << std::setw(16) << "ops/sec" << std::setw(14) << "rss_kb"
+              << std::setw(10) << "live" << std::endl;
+
+    // Fill the window, then each cycle retires the oldest session and registers a new one.
+    // Session ids are spread out so the registry sees a steadily moving key space.
+    for (uint64_t i = 0; i < sessions; i++) {
+        container->registerService(new Session(i), static_cast<int>(i));
+    }
+
+    uint64_t start = Bench::now();
+    uint64_t last = start;
+    for (uint64_t cycle = 1; cycle <= cycles; cycle++) {
+        uint64_t retired = cycle - 1;
+        uint64_t added = retired + sessions;
+        container->unregisterService<Session>(static_cast<int>(retired));
+        container->registerService(new Session(added), static_cast<int>(added));
+
+        if (cycle % interval == 0 || cycle == cycles) {
+            uint64_t now = Bench::now();
+            double rate = (cycle % interval == 0 ? interval : cycle % interval) * 1e9 / (now - last);
+            last = now;
+
+            std::cout << std::setw(14) << cycle << std::setw(16) << std::fixed << std::setprecision(0) << rate
+                      << std::setw(14) << Bench::residentBytes() / 1024 << std::setw(10) << container->size()
+                      << std::endl;
+        }
+    }
+
+    double seconds = (Bench::now() - start) / 1e9;
+    std::cout << "total: " << std::fixed << std::setprecision(2) << seconds << "s, "
+              << std::setprecision(0) << cycles / seconds << " cycles/sec" << std::endl;
+
+    return 0;
+}
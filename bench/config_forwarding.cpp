@@ -0,0 +1,121 @@
+#include <iostream>
+#include <iomanip>
+#include "../dot.h"
+#include "bench.h"
+
+// Measures what a large config costs on the way into a service.  The config holds a table of
+// --bytes (1 MB by default); each case generates or registers a service from it and reports
+// the time per call and the number of times the table was copied.  Cases that pass the config
+// as an rvalue build a fresh one per call, so "build" gives the cost of that alone.
+//
+// Usage: dot_bench_config [--bytes=1048576] [--iterations=2000]
+
+class TableConfig {
+public:
+    TableConfig(size_t bytes) :
+            table(bytes, 1) {
+
+    }
+
+    TableConfig(const TableConfig &other) :
+            table(other.table) {
+        copies++;
+    }
+
+    TableConfig(TableConfig &&other) = default;
+
+    std::vector<char> table;
+
+    /** Copies of the table, whether of the whole config or by a factory. */
+    static uint64_t copies;
+};
+
+uint64_t TableConfig::copies = 0;
+
+template<int N>
+class Router {
+public:
+    Router(std::vector<char> table) :
+            table(std::move(table)) {
+
+    }
+
+    std::vector<char> table;
+};
+
+// Takes the config by const reference, so the table is copied into the service.
+class CopyingFactory : public Dot::Factory<Router<0>, TableConfig> {
+public:
+    using Dot::Factory<Router<0>, TableConfig>::generate;
+
+    virtual Router<0> *generate(const TableConfig &config) {
+        TableConfig::copies++;
+        return new Router<0>(config.table);
+    }
+};
+
+class MovingFactory : public Dot::MoveFactory<Router<1>, TableConfig> {
+public:
+    using Dot::MoveFactory<Router<1>, TableConfig>::generate;
+
+    virtual Router<1> *generate(TableConfig &&config) {
+        return new Router<1>(std::move(config.table));
+    }
+};
+
+template<typename Function>
+static void report(const char *name, uint64_t iterations, Function function) {
+    uint64_t copies = TableConfig::copies;
+    double nanos = Bench::nanosPerOp(iterations, function);
+    double perCall = static_cast<double>(TableConfig::copies - copies) / (iterations * 6);
+    std::cout << std::left << std::setw(32) << name << std::right << std::fixed << std::setprecision(0)
+              << std::setw(14) << nanos << std::setprecision(2) << std::setw(10) << perCall << std::endl;
+}
+
+int main(int argc, char **argv) {
+    uint64_t bytes = Bench::arg(argc, argv, "bytes", 1048576ULL);
+    uint64_t iterations = Bench::arg(argc, argv, "iterations", 2000ULL);
+
+    auto container = std::make_shared<Dot::Container>();
+    container->registerFactory<CopyingFactory>();
+    container->registerFactory<MovingFactory>();
+    TableConfig kept(bytes);
+
+    std::cout << "config=" << bytes << " B" << std::endl;
+    std::cout << std::left << std::setw(32) << "case" << std::right << std::setw(14) << "ns/op" << std::setw(10)
+              << "copies" << std::endl;
+
+    report("build", iterations, [&]() {
+        Bench::doNotOptimize(TableConfig(bytes));
+    });
+
+    report("generate/copying/lvalue", iterations, [&]() {
+        Bench::doNotOptimize(container->generate<Router<0>>(kept));
+    });
+
+    report("generate/copying/rvalue", iterations, [&]() {
+        Bench::doNotOptimize(container->generate<Router<0>>(TableConfig(bytes)));
+    });
+
+    report("generate/moving/lvalue", iterations, [&]() {
+        Bench::doNotOptimize(container->generate<Router<1>>(kept));
+    });
+
+    report("generate/moving/rvalue", iterations, [&]() {
+        Bench::doNotOptimize(container->generate<Router<1>>(TableConfig(bytes)));
+    });
+
+    report("generateUnique/moving/rvalue", iterations, [&]() {
+        Bench::doNotOptimize(container->generateUnique<Router<1>>(TableConfig(bytes)));
+    });
+
+    report("register/copying/rvalue", iterations, [&]() {
+        container->registerService<Router<0>>(TableConfig(bytes), 0, true);
+    });
+
+    report("register/moving/rvalue", iterations, [&]() {
+        container->registerService<Router<1>>(TableConfig(bytes), 0, true);
+    });
+
+    return 0;
+}
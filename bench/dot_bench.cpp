@@ -0,0 +1,488 @@
+#include <iostream>
+#include <iomanip>
+#include <thread>
+#include <condition_variable>
+#include "../dot.h"
+#include "bench.h"
+
+// Microbenchmarks for the container operations and the injection macros.  Every case is run for each thread count,
+// with all threads working on the same container; each figure is the median over several
+// timed repetitions (after an untimed warmup) of the wall time per operation per thread.
+//
+// Usage: dot_bench [--threads=1,2,4] [--iterations=200000] [--repetitions=7] [--filter=get/]
+//                  [--json=results.json] [--baseline=results.json] [--tolerance=10]
+//
+// With --json the results are also written as JSON ("-" for stdout).  With --baseline the
+// results are compared against a JSON file written by an earlier run, and the program exits
+// with status 1 if any case got slower by more than the tolerance (in percent).
+
+template<int N>
+class Small {
+public:
+    int value;
+};
+
+class SmallCounted : public Dot::RefCounted {
+public:
+    int value;
+};
+
+struct Limits {
+    int connections;
+    int requests;
+    double rate;
+};
+
+class SmallConfig {
+public:
+    int value;
+};
+
+class SmallFactory : public Dot::Factory<Small<1>, SmallConfig> {
+public:
+    using Dot::Factory<Small<1>, SmallConfig>::generate;
+
+    virtual Small<1> *generate(const SmallConfig &config) {
+        return new Small<1> { config.value };
+    }
+};
+
+// Recycles objects through a per-thread free list, the way a pooled factory would.
+class PooledFactory : public Dot::Factory<Small<4>, SmallConfig> {
+public:
+    using Dot::Factory<Small<4>, SmallConfig>::generate;
+
+    virtual Small<4> *generate(const SmallConfig &config) {
+        auto &pool = free();
+        if (pool.empty()) {
+            return new Small<4> { config.value };
+        }
+
+        Small<4> *object = pool.back();
+        pool.pop_back();
+        object->value = config.value;
+        return object;
+    }
+
+    virtual void destroy(Small<4> *object) {
+        free().push_back(object);
+    }
+
+private:
+    static std::vector<Small<4> *> &free() {
+        static thread_local std::vector<Small<4> *> pool;
+        return pool;
+    }
+};
+
+class Injected {
+public:
+    Injected(const std::shared_ptr<Dot::Container> &container) {
+        DOT_INJECT_FROM(Small<0>, small, container);
+    }
+
+    Injected() {
+        DOT_INJECT(Small<0>, small);
+    }
+
+    std::shared_ptr<Small<0>> small;
+};
+
+struct Result {
+    std::string name;
+    unsigned threads;
+    double nanos;
+    double minNanos;
+};
+
+/**
+ * Releases all benchmark threads of a repetition at once.
+ */
+class StartGate {
+public:
+    void wait() {
+        std::unique_lock<std::mutex> locker(_mutex);
+        _condition.wait(locker, [this]() {
+            return _open;
+        });
+    }
+
+    void open() {
+        std::lock_guard<std::mutex> locker(_mutex);
+        _open = true;
+        _condition.notify_all();
+    }
+
+private:
+    std::mutex _mutex;
+    std::condition_variable _condition;
+    bool _open = false;
+};
+
+/**
+ * A benchmark case.  setup() runs once per thread count, then each repetition calls
+ * batch(thread, iterations) on every thread and times the slowest.  A batch returns the time
+ * it spent on the measured operation, so cases can leave their own preparation untimed.
+ */
+struct Case {
+    std::string name;
+    std::function<void(unsigned threads)> setup;
+    std::function<uint64_t(unsigned thread, uint64_t iterations)> batch;
+};
+
+/**
+ * Times a loop over the given operation.
+ */
+template<typename Function>
+static uint64_t timed(uint64_t iterations, Function function) {
+    uint64_t start = Bench::now();
+    for (uint64_t i = 0; i < iterations; i++) {
+        function(i);
+    }
+
+    return Bench::now() - start;
+}
+
+static Result run(const Case &benchmark, unsigned threads, uint64_t iterations, int repetitions) {
+    benchmark.setup(threads);
+
+    std::vector<double> samples;
+    for (int repetition = 0; repetition <= repetitions; repetition++) {
+        std::vector<uint64_t> nanos(threads);
+        std::vector<std::thread> workers;
+        StartGate gate;
+        for (unsigned thread = 0; thread < threads; thread++) {
+            workers.push_back(std::thread([&, thread]() {
+                gate.wait();
+                nanos[thread] = benchmark.batch(thread, iterations);
+            }));
+        }
+
+        gate.open();
+        for (auto &worker : workers) {
+            worker.join();
+        }
+
+        // The first repetition is a warmup.
+        if (repetition > 0) {
+            samples.push_back(static_cast<double>(*std::max_element(nanos.begin(), nanos.end())) / iterations);
+        }
+    }
+
+    std::sort(samples.begin(), samples.end());
+    return Result { benchmark.name, threads, samples[samples.size() / 2], samples.front() };
+}
+
+static std::vector<Case> cases() {
+    std::vector<Case> cases;
+    auto root = std::make_shared<std::shared_ptr<Dot::Container>>();
+    auto scopes = std::make_shared<std::vector<std::shared_ptr<Dot::Container>>>();
+    auto request = std::make_shared<std::shared_ptr<Dot::Container>>();
+    const int requestServices = 64;
+
+    auto fresh = [root, scopes, request, requestServices](unsigned /* threads */) {
+        scopes->clear();
+        *root = std::make_shared<Dot::Container>();
+        (*root)->registerService(new Small<0> { 1 });
+        (*root)->registerService(new SmallCounted());
+        (*root)->registerFactory<SmallFactory>();
+        (*root)->registerFactory<Dot::BasicFactory<Small<2>>>();
+        (*root)->registerFactory<Small<3>, SmallConfig>([](const SmallConfig &config) {
+            return new Small<3> { config.value };
+        });
+        (*root)->registerFactory<PooledFactory>();
+        (*root)->registerValue(std::chrono::milliseconds(250));
+        (*root)->registerValue(Limits { 10, 100, 0.5 });
+
+        // A populated request scope, for the fan-out cases.
+        *request = (*root)->getScope();
+        for (int i = 0; i < requestServices; i++) {
+            (*request)->registerService(new Small<0> { i }, i);
+        }
+    };
+
+    cases.push_back(Case { "get/hit", fresh, [root](unsigned /* thread */, uint64_t iterations) {
+        return timed(iterations, [&](uint64_t /* i */) {
+            Bench::doNotOptimize((*root)->get<Small<0>>());
+        });
+    }});
+
+    cases.push_back(Case { "get/hit/intrusive", fresh, [root](unsigned /* thread */, uint64_t iterations) {
+        return timed(iterations, [&](uint64_t /* i */) {
+            Bench::doNotOptimize((*root)->get<SmallCounted>());
+        });
+    }});
+
+    cases.push_back(Case { "value/get", fresh, [root](unsigned /* thread */, uint64_t iterations) {
+        return timed(iterations, [&](uint64_t /* i */) {
+            Bench::doNotOptimize((*root)->getValue<std::chrono::milliseconds>());
+        });
+    }});
+
+    cases.push_back(Case { "value/handle", fresh, [root](unsigned /* thread */, uint64_t iterations) {
+        auto timeout = (*root)->valueHandle<std::chrono::milliseconds>();
+        return timed(iterations, [&](uint64_t /* i */) {
+            Bench::doNotOptimize(timeout.get());
+        });
+    }});
+
+    cases.push_back(Case { "value/handle/seqlock", fresh, [root](unsigned /* thread */, uint64_t iterations) {
+        auto limits = (*root)->valueHandle<Limits>();
+        return timed(iterations, [&](uint64_t /* i */) {
+            Bench::doNotOptimize(limits.get());
+        });
+    }});
+
+    cases.push_back(Case { "value/set", fresh, [root](unsigned /* thread */, uint64_t iterations) {
+        auto timeout = (*root)->valueHandle<std::chrono::milliseconds>();
+        return timed(iterations, [&](uint64_t i) {
+            timeout.set(std::chrono::milliseconds(i));
+        });
+    }});
+
+    cases.push_back(Case { "get/miss", fresh, [root](unsigned /* thread */, uint64_t iterations) {
+        return timed(iterations / 10, [&](uint64_t /* i */) {
+            try {
+                (*root)->get<Small<9>>();
+            } catch (const Dot::ContainerException &) {
+            }
+        }) * 10;
+    }});
+
+    cases.push_back(Case { "inject/from", fresh, [root](unsigned /* thread */, uint64_t iterations) {
+        return timed(iterations, [&](uint64_t /* i */) {
+            Bench::doNotOptimize(Injected(*root));
+        });
+    }});
+
+    cases.push_back(Case { "inject/app", [fresh](unsigned threads) {
+        fresh(threads);
+        Dot::AppContainer::getInstance()->registerService(new Small<0> { 1 }, 0, true);
+    }, [](unsigned /* thread */, uint64_t iterations) {
+        return timed(iterations, [&](uint64_t /* i */) {
+            Bench::doNotOptimize(Injected());
+        });
+    }});
+
+    for (int depth : { 1, 2, 4, 8, 16, 32, 64 }) {
+        auto leaf = std::make_shared<std::shared_ptr<Dot::Container>>();
+        cases.push_back(Case { "get/depth/" + std::to_string(depth), [fresh, root, leaf, depth](unsigned threads) {
+            fresh(threads);
+            *leaf = *root;
+            for (int i = 0; i < depth; i++) {
+                *leaf = (*leaf)->getScope();
+            }
+        }, [leaf](unsigned /* thread */, uint64_t iterations) {
+            return timed(iterations, [&](uint64_t /* i */) {
+                Bench::doNotOptimize((*leaf)->get<Small<0>>());
+            });
+        }});
+    }
+
+    // Registration cases register a batch of ids per thread and unregister them again
+    // untimed, so every repetition starts from the same state.
+    auto unregister = [root](unsigned thread, uint64_t iterations) {
+        for (uint64_t i = 0; i < iterations; i++) {
+            (*root)->unregisterService<Small<1>>(static_cast<int>(thread * iterations + i));
+        }
+    };
+
+    cases.push_back(Case { "register/direct", fresh, [root, unregister](unsigned thread, uint64_t iterations) {
+        uint64_t nanos = timed(iterations, [&](uint64_t i) {
+            (*root)->registerService(new Small<1> { 1 }, static_cast<int>(thread * iterations + i));
+        });
+
+        unregister(thread, iterations);
+        return nanos;
+    }});
+
+    cases.push_back(Case { "register/factory", fresh, [root, unregister](unsigned thread, uint64_t iterations) {
+        uint64_t nanos = timed(iterations, [&](uint64_t i) {
+            (*root)->registerService<Small<1>>(SmallConfig { 1 }, static_cast<int>(thread * iterations + i));
+        });
+
+        unregister(thread, iterations);
+        return nanos;
+    }});
+
+    cases.push_back(Case { "unregister", fresh, [root](unsigned thread, uint64_t iterations) {
+        for (uint64_t i = 0; i < iterations; i++) {
+            (*root)->registerService(new Small<1> { 1 }, static_cast<int>(thread * iterations + i));
+        }
+
+        return timed(iterations, [&](uint64_t i) {
+            (*root)->unregisterService<Small<1>>(static_cast<int>(thread * iterations + i));
+        });
+    }});
+
+    cases.push_back(Case { "generate/factory", fresh, [root](unsigned /* thread */, uint64_t iterations) {
+        return timed(iterations, [&](uint64_t /* i */) {
+            Bench::doNotOptimize((*root)->generate<Small<1>>(SmallConfig { 1 }));
+        });
+    }});
+
+    cases.push_back(Case { "generate/basic", fresh, [root](unsigned /* thread */, uint64_t iterations) {
+        return timed(iterations, [&](uint64_t /* i */) {
+            Bench::doNotOptimize((*root)->generate<Small<2>>(Dot::EmptyConfig()));
+        });
+    }});
+
+    cases.push_back(Case { "generate/lambda", fresh, [root](unsigned /* thread */, uint64_t iterations) {
+        return timed(iterations, [&](uint64_t /* i */) {
+            Bench::doNotOptimize((*root)->generate<Small<3>>(SmallConfig { 1 }));
+        });
+    }});
+
+    cases.push_back(Case { "generate/unique", fresh, [root](unsigned /* thread */, uint64_t iterations) {
+        return timed(iterations, [&](uint64_t /* i */) {
+            Bench::doNotOptimize((*root)->generateUnique<Small<1>>(SmallConfig { 1 }));
+        });
+    }});
+
+    cases.push_back(Case { "generate/unique/pooled", fresh, [root](unsigned /* thread */, uint64_t iterations) {
+        return timed(iterations, [&](uint64_t /* i */) {
+            Bench::doNotOptimize((*root)->generateUnique<Small<4>>(SmallConfig { 1 }));
+        });
+    }});
+
+    cases.push_back(Case { "scope/create+destroy", fresh, [root](unsigned /* thread */, uint64_t iterations) {
+        return timed(iterations, [&](uint64_t /* i */) {
+            Bench::doNotOptimize((*root)->getScope());
+        });
+    }});
+
+    // Both give a sub-task the request's services with one of them overridden.
+    cases.push_back(Case { "scope/fork", fresh, [request](unsigned /* thread */, uint64_t iterations) {
+        return timed(iterations, [&](uint64_t i) {
+            auto task = (*request)->fork();
+            task->registerService(new Small<0> { static_cast<int>(i) }, 0, true);
+            Bench::doNotOptimize(task);
+        });
+    }});
+
+    cases.push_back(Case { "scope/repopulate", fresh, [root, requestServices](unsigned /* thread */, uint64_t iterations) {
+        return timed(iterations, [&](uint64_t i) {
+            auto task = (*root)->getScope();
+            for (int id = 0; id < requestServices; id++) {
+                task->registerService(new Small<0> { id }, id);
+            }
+
+            task->registerService(new Small<0> { static_cast<int>(i) }, 0, true);
+            Bench::doNotOptimize(task);
+        });
+    }});
+
+    return cases;
+}
+
+static void writeJson(std::ostream &out, const std::vector<Result> &results) {
+    out << "{" << std::endl << "  \"results\": [" << std::endl;
+    for (size_t i = 0; i < results.size(); i++) {
+        const Result &result = results[i];
+        out << "    {\"name\": \"" << result.name << "\", \"threads\": " << result.threads << std::fixed
+            << std::setprecision(2) << ", \"ns_per_op\": " << result.nanos << ", \"min_ns_per_op\": "
+            << result.minNanos << "}" << (i + 1 < results.size() ? "," : "") << std::endl;
+    }
+
+    out << "  ]" << std::endl << "}" << std::endl;
+}
+
+/**
+ * Reads the results back from a file written by writeJson (one result per line).
+ */
+static std::vector<Result> readJson(const std::string &path) {
+    std::vector<Result> results;
+    std::ifstream in(path.c_str());
+    std::string line;
+    while (std::getline(in, line)) {
+        size_t name = line.find("\"name\": \"");
+        size_t threads = line.find("\"threads\": ");
+        size_t nanos = line.find("\"ns_per_op\": ");
+        if (name == std::string::npos || threads == std::string::npos || nanos == std::string::npos) {
+            continue;
+        }
+
+        name += 9;
+        Result result;
+        result.name = line.substr(name, line.find('"', name) - name);
+        result.threads = static_cast<unsigned>(std::strtoul(line.c_str() + threads + 11, nullptr, 10));
+        result.nanos = std::strtod(line.c_str() + nanos + 13, nullptr);
+        result.minNanos = result.nanos;
+        results.push_back(result);
+    }
+
+    return results;
+}
+
+static std::vector<unsigned> parseList(const std::string &list) {
+    std::vector<unsigned> values;
+    std::stringstream stream(list);
+    std::string value;
+    while (std::getline(stream, value, ',')) {
+        if (!value.empty()) {
+            values.push_back(static_cast<unsigned>(std::max(1UL, std::strtoul(value.c_str(), nullptr, 10))));
+        }
+    }
+
+    return values;
+}
+
+int main(int argc, char **argv) {
+    std::vector<unsigned> threadCounts = parseList(Bench::arg(argc, argv, "threads", std::string("1")));
+    uint64_t iterations = Bench::arg(argc, argv, "iterations", 200000ULL);
+    int repetitions = static_cast<int>(Bench::arg(argc, argv, "repetitions", 7ULL));
+    std::string filter = Bench::arg(argc, argv, "filter", std::string());
+    std::string json = Bench::arg(argc, argv, "json", std::string());
+    std::string baselinePath = Bench::arg(argc, argv, "baseline", std::string());
+    double tolerance = static_cast<double>(Bench::arg(argc, argv, "tolerance", 10ULL));
+
+    std::vector<Result> baseline;
+    if (!baselinePath.empty()) {
+        baseline = readJson(baselinePath);
+        if (baseline.empty()) {
+            std::cerr << "No results in baseline " << baselinePath << std::endl;
+            return 2;
+        }
+    }
+
+    std::cout << std::left << std::setw(24) << "case" << std::right << std::setw(8) << "threads" << std::setw(12)
+              << "ns/op" << std::setw(12) << "min ns/op" << (baseline.empty() ? "" : "    baseline    change")
+              << std::endl;
+
+    std::vector<Result> results;
+    bool regressed = false;
+    for (const auto &benchmark : cases()) {
+        if (!filter.empty() && benchmark.name.find(filter) == std::string::npos) {
+            continue;
+        }
+
+        for (unsigned threads : threadCounts) {
+            Result result = run(benchmark, threads, iterations, repetitions);
+            results.push_back(result);
+
+            std::cout << std::left << std::setw(24) << result.name << std::right << std::setw(8) << threads
+                      << std::fixed << std::setprecision(1) << std::setw(12) << result.nanos << std::setw(12)
+                      << result.minNanos;
+            for (const auto &previous : baseline) {
+                if (previous.name == result.name && previous.threads == threads && previous.nanos > 0) {
+                    double change = (result.nanos - previous.nanos) * 100.0 / previous.nanos;
+                    bool slower = change > tolerance;
+                    regressed = regressed || slower;
+                    std::cout << std::setw(12) << previous.nanos << std::showpos << std::setw(9) << change << "%"
+                              << std::noshowpos << (slower ? "  REGRESSION" : "");
+                }
+            }
+
+            std::cout << std::endl;
+        }
+    }
+
+    if (json == "-") {
+        writeJson(std::cout, results);
+    } else if (!json.empty()) {
+        std::ofstream out(json.c_str());
+        writeJson(out, results);
+    }
+
+    return regressed ? 1 : 0;
+}
@@ -0,0 +1,106 @@
+#include <iostream>
+#include <iomanip>
+#include <sys/wait.h>
+#include "../dot.h"
+#include "bench.h"
+
+// Measures how much of a prefork server's container each worker copies.  The parent fills a
+// container with services, then forks workers that each resolve every service a number of
+// times.  Each worker reports how much memory it dirtied while resolving: memory it no longer
+// shares with the parent and the other workers.  This is run for get() on a regular container,
+// for get() on a frozen one and for getRef() on a frozen one.
+//
+// Usage: dot_bench_fork [--workers=32] [--services=100000] [--rounds=3]
+
+class Handler {
+public:
+    uint64_t requests;
+    char state[56];
+};
+
+/**
+ * Forks the workers, runs the function in each and returns the average bytes they dirtied.
+ */
+template<typename Function>
+static double dirtiedPerWorker(uint64_t workers, Function function) {
+    std::cout.flush();
+    std::vector<int> pipes;
+    for (uint64_t i = 0; i < workers; i++) {
+        int fds[2];
+        if (pipe(fds) != 0) {
+            return 0;
+        }
+
+        pid_t child = fork();
+        if (child == 0) {
+            close(fds[0]);
+            size_t before = Bench::privateDirtyBytes();
+            function();
+            uint64_t dirtied = Bench::privateDirtyBytes() - before;
+            ssize_t written = write(fds[1], &dirtied, sizeof(dirtied));
+            _exit(written == sizeof(dirtied) ? 0 : 1);
+        }
+
+        close(fds[1]);
+        pipes.push_back(fds[0]);
+    }
+
+    uint64_t total = 0;
+    for (int fd : pipes) {
+        uint64_t dirtied = 0;
+        if (read(fd, &dirtied, sizeof(dirtied)) == sizeof(dirtied)) {
+            total += dirtied;
+        }
+
+        close(fd);
+    }
+
+    while (wait(nullptr) > 0) {
+    }
+
+    return static_cast<double>(total) / workers;
+}
+
+static void report(const char *name, uint64_t services, double dirtied) {
+    std::cout << std::left << std::setw(16) << name << std::right << std::fixed << std::setprecision(0)
+              << std::setw(16) << dirtied / 1024 << std::setw(16) << std::setprecision(1) << dirtied / services
+              << std::endl;
+}
+
+int main(int argc, char **argv) {
+    uint64_t workers = Bench::arg(argc, argv, "workers", 32ULL);
+    uint64_t services = Bench::arg(argc, argv, "services", 100000ULL);
+    uint64_t rounds = Bench::arg(argc, argv, "rounds", 3ULL);
+
+    auto container = std::make_shared<Dot::Container>();
+    for (uint64_t i = 0; i < services; i++) {
+        container->registerService(new Handler(), static_cast<int>(i));
+    }
+
+    std::cout << "workers=" << workers << " services=" << services << " rounds=" << rounds << " (parent rss "
+              << Bench::residentBytes() / 1024 << " KB)" << std::endl;
+    std::cout << std::left << std::setw(16) << "case" << std::right << std::setw(16) << "dirty KB/worker"
+              << std::setw(16) << "B/service" << std::endl;
+
+    auto resolveAll = [&]() {
+        for (uint64_t round = 0; round < rounds; round++) {
+            for (uint64_t i = 0; i < services; i++) {
+                Bench::doNotOptimize(container->get<Handler>(static_cast<int>(i)));
+            }
+        }
+    };
+
+    report("get", services, dirtiedPerWorker(workers, resolveAll));
+
+    container->freeze();
+    report("frozen/get", services, dirtiedPerWorker(workers, resolveAll));
+    report("frozen/getRef", services, dirtiedPerWorker(workers, [&]() {
+        for (uint64_t round = 0; round < rounds; round++) {
+            for (uint64_t i = 0; i < services; i++) {
+                Bench::doNotOptimize(container->getRef<Handler>(static_cast<int>(i)).requests);
+            }
+        }
+    }));
+
+    return 0;
+}
@@ -0,0 +1,99 @@
+#include <iostream>
+#include <iomanip>
+#include <sys/wait.h>
+#include "../dot.h"
+#include "bench.h"
+
+// Measures what the container layer itself costs per scope and per service, for each
+// registry layout.  Each case runs in a forked child so freed memory from one case doesn't
+// hide the growth of the next, and reports both the resident set growth and the figure from
+// Container::memoryUsage().  The difference between the two is mostly allocator headers and
+// rounding, which memoryUsage() leaves out.
+//
+// Usage: dot_bench_memory [--scopes=100000] [--services=1000000]
+
+class Small {
+public:
+    int value;
+};
+
+class SmallCounted : public Dot::RefCounted {
+public:
+    int value;
+};
+
+static void report(const char *mode, const char *what, uint64_t count, size_t before, size_t accounted) {
+    size_t after = Bench::residentBytes();
+    std::cout << std::left << std::setw(10) << mode << std::setw(14) << what << std::right << std::setw(10) << count
+              << std::fixed << std::setprecision(1) << std::setw(14) << static_cast<double>(after - before) / count
+              << std::setw(14) << static_cast<double>(accounted) / count << std::endl;
+}
+
+static void scopes(Dot::RegistryMode mode, const char *name, uint64_t count) {
+    auto container = std::make_shared<Dot::Container>(mode);
+    std::vector<std::shared_ptr<Dot::Container>> scopes;
+    scopes.reserve(count);
+
+    size_t before = Bench::residentBytes();
+    for (uint64_t i = 0; i < count; i++) {
+        scopes.push_back(container->getScope());
+    }
+
+    report(name, "empty scope", count, before, scopes.front()->memoryUsage().overhead() * count);
+}
+
+template<typename Service>
+static void services(Dot::RegistryMode mode, const char *name, const char *what, uint64_t count) {
+    auto container = std::make_shared<Dot::Container>(mode);
+
+    size_t before = Bench::residentBytes();
+    for (uint64_t i = 0; i < count; i++) {
+        container->registerService(new Service(), static_cast<int>(i));
+    }
+
+    // Subtract the services themselves so only the container layer is left.
+    auto usage = container->memoryUsage();
+    size_t serviceBytes = count * sizeof(Service);
+    report(name, what, count, before + serviceBytes, usage.registry + usage.wrappers);
+}
+
+template<typename Function>
+static void isolated(Function function) {
+    std::cout.flush();
+    pid_t child = fork();
+    if (child == 0) {
+        function();
+        std::cout.flush();
+        _exit(0);
+    }
+
+    int status = 0;
+    waitpid(child, &status, 0);
+}
+
+int main(int argc, char **argv) {
+    uint64_t scopeCount = Bench::arg(argc, argv, "scopes", 100000ULL);
+    uint64_t serviceCount = Bench::arg(argc, argv, "services", 1000000ULL);
+
+    std::cout << std::left << std::setw(10) << "mode" << std::setw(14) << "case" << std::right << std::setw(10)
+              << "count" << std::setw(14) << "rss B/each" << std::setw(14) << "counted B" << std::endl;
+
+    const std::pair<Dot::RegistryMode, const char *> modes[] = {
+            { Dot::RegistryMode::Ordered, "ordered" },
+            { Dot::RegistryMode::Churn, "churn" }
+    };
+
+    for (const auto &mode : modes) {
+        isolated([&]() {
+            scopes(mode.first, mode.second, scopeCount);
+        });
+        isolated([&]() {
+            services<Small>(mode.first, mode.second, "per service", serviceCount);
+        });
+        isolated([&]() {
+            services<SmallCounted>(mode.first, mode.second, "per intrusive", serviceCount);
+        });
+    }
+
+    return 0;
+}
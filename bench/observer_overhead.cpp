@@ -0,0 +1,66 @@
+#include <iostream>
+#include <iomanip>
+#include "../dot.h"
+#include "bench.h"
+
+// Measures the cost of the observer hooks on the hot container operations.  This file is
+// built twice: dot_bench_observer with the hooks compiled in (measured with no observer
+// installed and with a no-op observer installed), and dot_bench_observer_disabled with
+// DOT_DISABLE_OBSERVERS defined.
+//
+// Usage: dot_bench_observer [--iterations=1000000]
+
+class NoopObserver : public Dot::ContainerObserver {
+};
+
+class Config {
+};
+
+static void run(const char *mode, uint64_t iterations) {
+    auto container = std::make_shared<Dot::Container>();
+    container->registerService(new int(1));
+    container->registerFactory<char, Config>([](const Config & /* config */) {
+        return new char(1);
+    });
+
+    auto scope = container->getScope()->getScope();
+
+    std::cout << std::left << std::setw(16) << mode << std::right << std::fixed << std::setprecision(1);
+    std::cout << std::setw(12) << Bench::nanosPerOp(iterations, [&container]() {
+        Bench::doNotOptimize(container->get<int>());
+    });
+    std::cout << std::setw(12) << Bench::nanosPerOp(iterations, [&scope]() {
+        Bench::doNotOptimize(scope->get<int>());
+    });
+    std::cout << std::setw(12) << Bench::nanosPerOp(iterations, [&container]() {
+        container->registerService(new long(1));
+        container->unregisterService<long>();
+    });
+    std::cout << std::setw(12) << Bench::nanosPerOp(iterations, [&container]() {
+        Bench::doNotOptimize(container->generate<char>(Config()));
+    });
+    std::cout << std::setw(12) << Bench::nanosPerOp(iterations / 10, [&container]() {
+        Bench::doNotOptimize(container->getScope());
+    }) << std::endl;
+}
+
+int main(int argc, char **argv) {
+    uint64_t iterations = Bench::arg(argc, argv, "iterations", 1000000ULL);
+
+    std::cout << std::left << std::setw(16) << "hooks (ns/op)" << std::right << std::setw(12) << "get"
+              << std::setw(12) << "get depth 2" << std::setw(12) << "reg+unreg" << std::setw(12) << "generate"
+              << std::setw(12) << "getScope" << std::endl;
+
+#ifdef DOT_DISABLE_OBSERVERS
+    run("compiled out", iterations);
+#else
+    run("none installed", iterations);
+
+    NoopObserver observer;
+    Dot::Observers::add(&observer);
+    run("no-op observer", iterations);
+    Dot::Observers::remove(&observer);
+#endif
+
+    return 0;
+}
@@ -0,0 +1,199 @@
+#include <iostream>
+#include <iomanip>
+#include <thread>
+#include "../dot.h"
+#include "bench.h"
+
+// Simulates a request server to get an end-to-end figure for Dot.  The root AppContainer is
+// filled with a few hundred shared services at startup; a pool of worker threads then handles
+// requests, each with a ContainerAware handler that makes a scope of its own, registers the
+// per-request services, resolves a dozen dependencies, generates a few transient objects and
+// tears the scope down again.  Reports requests per second and request latency percentiles.
+//
+// Usage: dot_bench_server [--workers=<cores>] [--seconds=5] [--services=300] [--resolves=12]
+//                         [--transients=3]
+
+// Services are spread over SERVICE_TYPES types, with several ids per type, which keeps the
+// number of template instantiations (and the build time) down.
+static const int SERVICE_TYPES = 32;
+static const int MAX_SERVICES = 1024;
+
+template<int N>
+class SharedService {
+public:
+    char state[64];
+};
+
+class RequestContext {
+public:
+    RequestContext(uint64_t id) :
+            id(id) {
+
+    }
+
+    uint64_t id;
+    char headers[512];
+};
+
+class User {
+public:
+    uint64_t id;
+    std::string name;
+};
+
+class Session {
+public:
+    uint64_t user;
+    char data[128];
+};
+
+class ResponseConfig {
+public:
+    uint64_t request;
+    int status;
+};
+
+class Response {
+public:
+    uint64_t request;
+    int status;
+    std::string body;
+};
+
+class ResponseFactory : public Dot::Factory<Response, ResponseConfig> {
+public:
+    using Dot::Factory<Response, ResponseConfig>::generate;
+
+    virtual Response *generate(const ResponseConfig &config) {
+        Response *response = new Response();
+        response->request = config.request;
+        response->status = config.status;
+        return response;
+    }
+};
+
+typedef void (*Resolve)(Dot::Container &container, int id);
+static Resolve resolvers[SERVICE_TYPES];
+
+template<int N>
+struct Services {
+    static void registerAll(Dot::Container &container, int count) {
+        Services<N - 1>::registerAll(container, count);
+        for (int service = N - 1; service < count; service += SERVICE_TYPES) {
+            container.registerService(new SharedService<N - 1>(), service / SERVICE_TYPES);
+        }
+
+        resolvers[N - 1] = [](Dot::Container &container, int id) {
+            Bench::doNotOptimize(container.get<SharedService<N - 1>>(id));
+        };
+    }
+};
+
+template<>
+struct Services<0> {
+    static void registerAll(Dot::Container & /* container */, int /* count */) {
+    }
+};
+
+struct Options {
+    int services;
+    int resolves;
+    int transients;
+};
+
+/**
+ * Handles one request in a scope of its own, the way application handlers do.
+ */
+class RequestHandler : public Dot::ContainerAware {
+public:
+    void handle(const Options &options, uint64_t request, uint64_t &random) {
+        makeScope();
+
+        // Per-request services.
+        _container->registerService(new RequestContext(request));
+        _container->registerService(new User { request % 1000, "user" });
+        _container->registerService(new Session { request % 1000, { 0 } });
+
+        // A dozen dependencies: the per-request services and the rest from the shared root.
+        Bench::doNotOptimize(_container->get<RequestContext>());
+        Bench::doNotOptimize(_container->get<User>());
+        Bench::doNotOptimize(_container->get<Session>());
+        for (int i = 3; i < options.resolves; i++) {
+            random ^= random << 13;
+            random ^= random >> 7;
+            random ^= random << 17;
+            int service = static_cast<int>(random % options.services);
+            resolvers[service % SERVICE_TYPES](*_container, service / SERVICE_TYPES);
+        }
+
+        for (int i = 0; i < options.transients; i++) {
+            Bench::doNotOptimize(_container->generate<Response>(ResponseConfig { request, 200 }));
+        }
+    }
+};
+
+int main(int argc, char **argv) {
+    unsigned cores = std::max(1u, std::thread::hardware_concurrency());
+    unsigned workers = static_cast<unsigned>(Bench::arg(argc, argv, "workers", static_cast<uint64_t>(cores)));
+    double seconds = std::strtod(Bench::arg(argc, argv, "seconds", std::string("5")).c_str(), nullptr);
+
+    Options options;
+    options.services = static_cast<int>(Bench::arg(argc, argv, "services", 300ULL));
+    options.resolves = static_cast<int>(Bench::arg(argc, argv, "resolves", 12ULL));
+    options.transients = static_cast<int>(Bench::arg(argc, argv, "transients", 3ULL));
+    if (options.services < 1 || options.services > MAX_SERVICES || workers < 1) {
+        std::cerr << "services must be between 1 and " << MAX_SERVICES << ", and workers at least 1" << std::endl;
+        return 2;
+    }
+
+    // Application startup.
+    uint64_t startup = Bench::now();
+    auto app = Dot::AppContainer::getInstance();
+    Services<SERVICE_TYPES>::registerAll(*app, options.services);
+    app->registerFactory<ResponseFactory>();
+    std::cout << "started " << options.services << " services in " << Dot::formatNanos(Bench::now() - startup)
+              << ", " << workers << " workers, " << options.resolves << " resolves and " << options.transients
+              << " transients per request" << std::endl;
+
+    std::atomic<bool> stop(false);
+    std::atomic<uint64_t> nextRequest(0);
+    std::vector<Dot::LatencyHistogram> latencies(workers);
+    std::vector<std::thread> threads;
+
+    uint64_t start = Bench::now();
+    for (unsigned worker = 0; worker < workers; worker++) {
+        threads.push_back(std::thread([&, worker]() {
+            uint64_t random = 0x9e3779b97f4a7c15ULL * (worker + 1);
+            while (!stop.load(std::memory_order_relaxed)) {
+                uint64_t request = nextRequest.fetch_add(1, std::memory_order_relaxed);
+                uint64_t begin = Bench::now();
+                {
+                    RequestHandler handler;
+                    handler.handle(options, request, random);
+                }
+                latencies[worker].record(Bench::now() - begin);
+            }
+        }));
+    }
+
+    std::this_thread::sleep_for(std::chrono::duration<double>(seconds));
+    stop.store(true);
+    for (auto &thread : threads) {
+        thread.join();
+    }
+
+    double elapsed = (Bench::now() - start) / 1e9;
+    Dot::LatencyHistogram all;
+    for (const auto &latency : latencies) {
+        all.merge(latency);
+    }
+
+    std::cout << std::fixed << std::setprecision(0) << all.count() / elapsed << " requests/sec over "
+              << std::setprecision(1) << elapsed << "s" << std::endl;
+    std::cout << "latency: p50 " << Dot::formatNanos(all.percentile(0.5)) << ", p90 "
+              << Dot::formatNanos(all.percentile(0.9)) << ", p99 " << Dot::formatNanos(all.percentile(0.99))
+              << ", p999 " << Dot::formatNanos(all.percentile(0.999)) << ", max " << Dot::formatNanos(all.max())
+              << std::endl;
+
+    return 0;
+}
@@ -0,0 +1,270 @@
+#include <iostream>
+#include <iomanip>
+#include <thread>
+#include "../dot.h"
+#include "bench.h"
+
+// Scaling benchmark for a mixed workload on a shared AppContainer, the way servers use Dot:
+// threads mostly read shared services, handle requests in a scope of their own, and now and
+// then overwrite a shared service.  Each thread count runs for a fixed time and reports the
+// throughput, its speedup over one thread, and latency percentiles for all operations and
+// per kind of operation.
+//
+// Usage: dot_bench_scaling [--threads=1,2,4,...] [--seconds=2] [--reads=90] [--overwrites=1]
+//                          [--types=16] [--depth=1] [--request-services=4] [--csv=scaling.csv]
+//
+// --reads and --overwrites are percentages of operations; the remainder are requests.  A
+// request creates a scope --depth levels below the root, registers --request-services
+// services in it, resolves each of them and one shared service through the scopes, and
+// destroys the scope.  --types (at most 64) sets how many shared service types there are.
+
+static const int MAX_TYPES = 64;
+
+template<int N>
+class Shared {
+public:
+    uint64_t value;
+};
+
+template<int N>
+class PerRequest {
+public:
+    uint64_t value;
+};
+
+/**
+ * Type-erased operations on the Nth shared and per-request types, so the workload can pick
+ * types at run time.
+ */
+struct TypeOps {
+    void (*registerShared)(Dot::Container &container, bool overwrite);
+    void (*getShared)(Dot::Container &container);
+    void (*registerRequest)(Dot::Container &container);
+    void (*getRequest)(Dot::Container &container);
+};
+
+template<int N>
+struct TypeTable {
+    static void fill(TypeOps *table) {
+        TypeTable<N - 1>::fill(table);
+        table[N - 1] = TypeOps {
+            [](Dot::Container &container, bool overwrite) {
+                container.registerService(new Shared<N - 1> { N }, 0, overwrite);
+            },
+            [](Dot::Container &container) {
+                Bench::doNotOptimize(container.get<Shared<N - 1>>());
+            },
+            [](Dot::Container &container) {
+                container.registerService(new PerRequest<N - 1> { N });
+            },
+            [](Dot::Container &container) {
+                Bench::doNotOptimize(container.get<PerRequest<N - 1>>());
+            }
+        };
+    }
+};
+
+template<>
+struct TypeTable<0> {
+    static void fill(TypeOps * /* table */) {
+    }
+};
+
+enum Kind {
+    READ,
+    REQUEST,
+    OVERWRITE,
+    KINDS
+};
+
+static const char *kindNames[] = { "get", "request", "overwrite" };
+
+struct Workload {
+    unsigned reads;
+    unsigned overwrites;
+    unsigned types;
+    unsigned depth;
+    unsigned requestServices;
+    double seconds;
+};
+
+struct Point {
+    unsigned threads;
+    uint64_t operations;
+    double seconds;
+    Dot::LatencyHistogram all;
+    Dot::LatencyHistogram kinds[KINDS];
+};
+
+static TypeOps table[MAX_TYPES];
+
+static void worker(const Workload &workload, unsigned seed, const std::atomic<bool> &stop, uint64_t &operations,
+                   Dot::LatencyHistogram *kinds) {
+    Dot::Container &root = *Dot::AppContainer::getInstance();
+    uint64_t state = 0x9e3779b97f4a7c15ULL * (seed + 1);
+    auto random = [&state]() {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        return state;
+    };
+
+    uint64_t count = 0;
+    while (!stop.load(std::memory_order_relaxed)) {
+        unsigned roll = random() % 100;
+        Kind kind = roll < workload.reads ? READ : roll < workload.reads + workload.overwrites ? OVERWRITE : REQUEST;
+        const TypeOps &shared = table[random() % workload.types];
+
+        uint64_t start = Bench::now();
+        if (kind == READ) {
+            shared.getShared(root);
+        } else if (kind == OVERWRITE) {
+            shared.registerShared(root, true);
+        } else {
+            auto scope = root.getScope();
+            for (unsigned level = 1; level < workload.depth; level++) {
+                scope = scope->getScope();
+            }
+
+            for (unsigned i = 0; i < workload.requestServices; i++) {
+                table[i].registerRequest(*scope);
+            }
+
+            for (unsigned i = 0; i < workload.requestServices; i++) {
+                table[i].getRequest(*scope);
+            }
+
+            shared.getShared(*scope);
+        }
+
+        kinds[kind].record(Bench::now() - start);
+        count++;
+    }
+
+    operations = count;
+}
+
+static void run(const Workload &workload, Point &point) {
+    std::atomic<bool> stop(false);
+    std::vector<uint64_t> operations(point.threads);
+    std::vector<std::vector<Dot::LatencyHistogram>> kinds(point.threads, std::vector<Dot::LatencyHistogram>(KINDS));
+    std::vector<std::thread> threads;
+
+    uint64_t start = Bench::now();
+    for (unsigned thread = 0; thread < point.threads; thread++) {
+        threads.push_back(std::thread([&, thread]() {
+            worker(workload, thread, stop, operations[thread], kinds[thread].data());
+        }));
+    }
+
+    std::this_thread::sleep_for(std::chrono::duration<double>(workload.seconds));
+    stop.store(true);
+    for (auto &thread : threads) {
+        thread.join();
+    }
+
+    point.seconds = (Bench::now() - start) / 1e9;
+    for (unsigned thread = 0; thread < point.threads; thread++) {
+        point.operations += operations[thread];
+        for (int kind = 0; kind < KINDS; kind++) {
+            point.kinds[kind].merge(kinds[thread][kind]);
+            point.all.merge(kinds[thread][kind]);
+        }
+    }
+}
+
+static std::vector<unsigned> threadCounts(const std::string &list) {
+    std::vector<unsigned> counts;
+    if (list.empty()) {
+        unsigned cores = std::max(1u, std::thread::hardware_concurrency());
+        for (unsigned threads = 1; threads < cores; threads *= 2) {
+            counts.push_back(threads);
+        }
+
+        counts.push_back(cores);
+        return counts;
+    }
+
+    std::stringstream stream(list);
+    std::string value;
+    while (std::getline(stream, value, ',')) {
+        if (!value.empty()) {
+            counts.push_back(static_cast<unsigned>(std::max(1UL, std::strtoul(value.c_str(), nullptr, 10))));
+        }
+    }
+
+    return counts;
+}
+
+int main(int argc, char **argv) {
+    Workload workload;
+    workload.reads = static_cast<unsigned>(Bench::arg(argc, argv, "reads", 90ULL));
+    workload.overwrites = static_cast<unsigned>(Bench::arg(argc, argv, "overwrites", 1ULL));
+    workload.types = static_cast<unsigned>(Bench::arg(argc, argv, "types", 16ULL));
+    workload.depth = static_cast<unsigned>(Bench::arg(argc, argv, "depth", 1ULL));
+    workload.requestServices = static_cast<unsigned>(Bench::arg(argc, argv, "request-services", 4ULL));
+    workload.seconds = std::strtod(Bench::arg(argc, argv, "seconds", std::string("2")).c_str(), nullptr);
+    std::vector<unsigned> counts = threadCounts(Bench::arg(argc, argv, "threads", std::string()));
+    std::string csv = Bench::arg(argc, argv, "csv", std::string());
+
+    if (workload.reads + workload.overwrites > 100 || workload.types < 1 || workload.types > MAX_TYPES ||
+            workload.depth < 1 || workload.requestServices > MAX_TYPES) {
+        std::cerr << "Invalid workload: reads + overwrites must be at most 100, types and request-services at "
+                  << "most " << MAX_TYPES << ", and depth at least 1" << std::endl;
+        return 2;
+    }
+
+    TypeTable<MAX_TYPES>::fill(table);
+    Dot::Container &root = *Dot::AppContainer::getInstance();
+    for (unsigned type = 0; type < workload.types; type++) {
+        table[type].registerShared(root, true);
+    }
+
+    std::cout << "reads=" << workload.reads << "% overwrites=" << workload.overwrites << "% requests="
+              << 100 - workload.reads - workload.overwrites << "% types=" << workload.types << " depth="
+              << workload.depth << " request-services=" << workload.requestServices << std::endl;
+    std::cout << std::setw(8) << "threads" << std::setw(14) << "ops/sec" << std::setw(10) << "speedup"
+              << std::setw(12) << "efficiency" << std::setw(10) << "p50" << std::setw(10) << "p99"
+              << std::setw(10) << "p999";
+    for (int kind = 0; kind < KINDS; kind++) {
+        std::cout << std::setw(14) << (std::string(kindNames[kind]) + " p99");
+    }
+    std::cout << std::endl;
+
+    std::ofstream csvOut;
+    if (!csv.empty()) {
+        csvOut.open(csv.c_str());
+        csvOut << "threads,ops_per_sec,speedup,p50_ns,p99_ns,p999_ns" << std::endl;
+    }
+
+    double baseline = 0;
+    for (unsigned threads : counts) {
+        std::unique_ptr<Point> point(new Point());
+        point->threads = threads;
+        run(workload, *point);
+
+        double rate = point->operations / point->seconds;
+        if (baseline == 0) {
+            baseline = rate / threads;
+        }
+
+        double speedup = rate / baseline;
+        std::cout << std::setw(8) << threads << std::fixed << std::setprecision(0) << std::setw(14) << rate
+                  << std::setprecision(2) << std::setw(10) << speedup << std::setw(11) << speedup * 100 / threads
+                  << "%" << std::setw(10) << Dot::formatNanos(point->all.percentile(0.5)) << std::setw(10)
+                  << Dot::formatNanos(point->all.percentile(0.99)) << std::setw(10)
+                  << Dot::formatNanos(point->all.percentile(0.999));
+        for (int kind = 0; kind < KINDS; kind++) {
+            std::cout << std::setw(14) << Dot::formatNanos(point->kinds[kind].percentile(0.99));
+        }
+        std::cout << std::endl;
+
+        if (csvOut) {
+            csvOut << threads << "," << std::fixed << std::setprecision(0) << rate << "," << std::setprecision(3) << speedup << ","
+                   << point->all.percentile(0.5) << "," << point->all.percentile(0.99) << ","
+                   << point->all.percentile(0.999) << std::endl;
+        }
+    }
+
+    return 0;
+}
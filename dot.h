@@ -4,15 +4,108 @@
 #include <typeinfo>
 #include <typeindex>
 #include <memory>
+#include <type_traits>
 #include <map>
+#include <set>
 #include <functional>
 #include <mutex>
+#include <thread>
+#include <vector>
+#include <cstdint>
+#include <atomic>
+#include <string>
+#include <sstream>
+#include <fstream>
+#include <cstdio>
+#include <cstdlib>
+#include <algorithm>
+#include <stdexcept>
+#include <cstring>
+#include <chrono>
+#include <iomanip>
+#include <iostream>
 
-#define DOT_INJECT(type, member) member = Dot::AppContainer::getInstance()->get<type>()
-#define DOT_INJECT_ID(type, id, member) member = Dot::AppContainer::getInstance()->get<type>(id)
+#if defined(__cpp_impl_coroutine)
+#include <coroutine>
+#endif
 
-#define DOT_INJECT_FROM(type, member, injector) blah
-#define DOT_INJECT_ID_FROM(type, member, id, injector) blah
+#if defined(__GNUG__)
+#include <cxxabi.h>
+#endif
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#define DOT_POSIX 1
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#if defined(__GLIBC__)
+#include <execinfo.h>
+#define DOT_BACKTRACE 1
+#endif
+
+/**
+ * Static tracepoints for perf and bpftrace.  Define DOT_ENABLE_USDT to compile USDT probes
+ * (provider "dot") into the container operations; this needs <sys/sdt.h> from SystemTap.  The
+ * probe arguments are values the operations already have in hand, so an unattached probe is a
+ * single nop.
+ */
+#if defined(DOT_ENABLE_USDT)
+#include <sys/sdt.h>
+#define DOT_PROBE1(name, a) STAP_PROBE1(dot, name, a)
+#define DOT_PROBE2(name, a, b) STAP_PROBE2(dot, name, a, b)
+#define DOT_PROBE3(name, a, b, c) STAP_PROBE3(dot, name, a, b, c)
+#define DOT_PROBE4(name, a, b, c, d) STAP_PROBE4(dot, name, a, b, c, d)
+#define DOT_PROBE5(name, a, b, c, d, e) STAP_PROBE5(dot, name, a, b, c, d, e)
+#else
+#define DOT_PROBE1(name, a) do { } while (0)
+#define DOT_PROBE2(name, a, b) do { } while (0)
+#define DOT_PROBE3(name, a, b, c) do { } while (0)
+#define DOT_PROBE4(name, a, b, c, d) do { } while (0)
+#define DOT_PROBE5(name, a, b, c, d, e) do { } while (0)
+#endif
+
+/**
+ * Maximum number of distinct service types tracked by the per-type diagnostics.  Types beyond
+ * this limit share a single "other" slot.
+ */
+#ifndef DOT_MAX_TYPES
+#define DOT_MAX_TYPES 4096
+#endif
+
+/**
+ * Exception specification of the container operations.  Dynamic exception specifications were
+ * removed in C++17, so they are only emitted for older standards.
+ */
+#if __cplusplus >= 201703L
+#define DOT_THROWS(...)
+#else
+#define DOT_THROWS(...) throw(__VA_ARGS__)
+#endif
+
+/**
+ * Injection macros.  Each use has its own per-thread cache of the last service it resolved
+ * (see Container::InjectCache), so repeated construction of injected objects skips the full
+ * resolution while the container is unchanged.  DOT_INJECT and DOT_INJECT_ID resolve from the
+ * current scope (see Dot::current()), which is the app container unless a ScopeGuard set
+ * another.  The FROM variants take any pointer-like reference to a container.
+ */
+#define DOT_INJECT(type, member) DOT_INJECT_ID_FROM(type, member, 0, &Dot::current())
+#define DOT_INJECT_ID(type, id, member) DOT_INJECT_ID_FROM(type, member, id, &Dot::current())
+
+#define DOT_INJECT_FROM(type, member, injector) DOT_INJECT_ID_FROM(type, member, 0, injector)
+#define DOT_INJECT_ID_FROM(type, member, id, injector) \
+    member = [](Dot::Container &container, int serviceId) -> Dot::ServicePtr<type> { \
+        static thread_local Dot::Container::InjectCache<type> cache; \
+        return cache.get(container, serviceId); \
+    }(*(injector), (id))
 
 namespace Dot {
 
@@ -24,341 +117,5794 @@ class EmptyConfig {
 };
 
 /**
- * Base factory class used for storing templated factories.
+ * Storage layout used by a container for its registered services.
+ */
+enum class RegistryMode {
+    /**
+     * Nested ordered maps keyed by type and then id.  This is the default.
+     */
+    Ordered,
+
+    /**
+     * Generational slot map with a free list and an open-addressing index.  Slots are reused
+     * in O(1) and the storage is compacted as services are unregistered, which keeps memory
+     * bounded for containers that register and unregister services at a high rate.
+     */
+    Churn
+};
+
+/**
+ * Container operations, as reported by the diagnostics.
+ */
+enum class Operation {
+    Get,
+    RegisterService,
+    Generate,
+    UnregisterService,
+    GetScope,
+    RegisterFactory,
+    DestroyScope,
+
+    /** size(), memoryUsage(), compact() and freeze(). */
+    Maintenance
+};
+
+static const int OPERATION_COUNT = 8;
+
+inline const char *operationName(Operation operation) {
+    static const char *names[OPERATION_COUNT] = {
+        "get", "registerService", "generate", "unregisterService", "getScope", "registerFactory", "destroyScope",
+        "maintenance"
+    };
+
+    return names[static_cast<int>(operation)];
+}
+
+/**
+ * Returns a monotonic timestamp in nanoseconds.
+ */
+inline uint64_t monotonicNanos() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/**
+ * Returns a small number identifying the calling thread, assigned in order of first use.
+ */
+inline uint32_t threadNumber() {
+    static std::atomic<uint32_t> next(1);
+    static thread_local uint32_t number = 0;
+    if (!number) {
+        number = next.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    return number;
+}
+
+/**
+ * Formats a duration in nanoseconds with a readable unit.
+ */
+inline std::string formatNanos(uint64_t nanos) {
+    static const char *units[] = { "ns", "us", "ms", "s" };
+
+    double value = static_cast<double>(nanos);
+    int unit = 0;
+    while (value >= 1000.0 && unit < 3) {
+        value /= 1000.0;
+        unit++;
+    }
+
+    std::ostringstream out;
+    out << std::fixed << std::setprecision(unit == 0 ? 0 : 1) << value << units[unit];
+    return out.str();
+}
+
+/**
+ * Runtime type information for a service type, with the type hash computed once.  Each key
+ * also gets a small slot number that the per-type diagnostics use as an array index.
+ */
+class TypeKey {
+public:
+    std::type_index index() const {
+        return std::type_index(*info);
+    }
+
+    /**
+     * Returns the readable (demangled) name of the type.
+     */
+    std::string name() const {
+        return demangle(*info);
+    }
+
+    /**
+     * Returns the cached key for the given type.
+     */
+    template<typename Type>
+    static const TypeKey &of() {
+        static const TypeKey key(typeid(Type));
+        return key;
+    }
+
+    /**
+     * Returns the number of slots handed out so far.
+     */
+    static uint32_t count() {
+        return std::min<uint32_t>(counter().load(std::memory_order_acquire), DOT_MAX_TYPES);
+    }
+
+    /**
+     * Returns the type in the given slot, or nullptr for the shared overflow slot.
+     */
+    static const std::type_info *at(uint32_t slot) {
+        return table()[slot].load(std::memory_order_acquire);
+    }
+
+    static std::string demangle(const std::type_info &info) {
+#if defined(__GNUG__)
+        int status = 0;
+        char *name = abi::__cxa_demangle(info.name(), nullptr, nullptr, &status);
+        if (status == 0 && name) {
+            std::string result(name);
+            std::free(name);
+            return result;
+        }
+#endif
+        return info.name();
+    }
+
+    const std::type_info *info;
+    size_t hash;
+    uint32_t slot;
+
+private:
+    explicit TypeKey(const std::type_info &info) :
+            info(&info),
+            hash(std::type_index(info).hash_code()),
+            slot(std::min<uint32_t>(counter().fetch_add(1), DOT_MAX_TYPES - 1)) {
+        if (slot < DOT_MAX_TYPES - 1) {
+            table()[slot].store(&info, std::memory_order_release);
+        }
+    }
+
+    static std::atomic<uint32_t> &counter() {
+        static std::atomic<uint32_t> counter(0);
+        return counter;
+    }
+
+    static std::atomic<const std::type_info *> *table() {
+        static std::atomic<const std::type_info *> table[DOT_MAX_TYPES];
+        return table;
+    }
+};
+
+/**
+ * Counters for a single service type, summed across all containers and threads.
+ */
+struct TypeStats {
+    std::string type;
+
+    /** Calls to get(). */
+    uint64_t resolves;
+
+    /** get() calls that missed the container they were made on and walked to a parent. */
+    uint64_t parentFallthroughs;
+
+    /** Total and maximum number of parent hops taken by those calls. */
+    uint64_t parentDepthTotal;
+    uint64_t parentDepthMax;
+
+    /** get() calls that found no service anywhere in the hierarchy. */
+    uint64_t misses;
+
+    /** Factory invocations, from both generate() and factory registrations. */
+    uint64_t generates;
+
+    uint64_t registrations;
+    uint64_t unregistrations;
+};
+
+/**
+ * Process-wide container statistics.  Each thread counts into its own shard with relaxed
+ * atomics, so recording never contends; shards are summed when a snapshot is taken.  Define
+ * DOT_DISABLE_STATS to compile the recording out entirely.
+ */
+class Stats {
+    enum Counter {
+        RESOLVES,
+        PARENT_FALLTHROUGHS,
+        PARENT_DEPTH_TOTAL,
+        PARENT_DEPTH_MAX,
+        MISSES,
+        GENERATES,
+        REGISTRATIONS,
+        UNREGISTRATIONS,
+        COUNTERS
+    };
+
+    static const uint32_t CHUNK = 64;
+
+    struct Counters {
+        std::atomic<uint64_t> values[COUNTERS];
+    };
+
+    /**
+     * A thread's counters, allocated in chunks of types as they are first used.
+     */
+    class Shard {
+    public:
+        Shard() {
+            for (auto &chunk : _chunks) {
+                chunk.store(nullptr, std::memory_order_relaxed);
+            }
+        }
+
+        ~Shard() {
+            for (auto &chunk : _chunks) {
+                delete[] chunk.load(std::memory_order_relaxed);
+            }
+        }
+
+        Counters &at(uint32_t slot) {
+            auto &chunk = _chunks[slot / CHUNK];
+            Counters *counters = chunk.load(std::memory_order_relaxed);
+            if (!counters) {
+                counters = new Counters[CHUNK];
+                for (uint32_t i = 0; i < CHUNK; i++) {
+                    for (auto &value : counters[i].values) {
+                        value.store(0, std::memory_order_relaxed);
+                    }
+                }
+
+                chunk.store(counters, std::memory_order_release);
+            }
+
+            return counters[slot % CHUNK];
+        }
+
+        const Counters *find(uint32_t slot) const {
+            const Counters *counters = _chunks[slot / CHUNK].load(std::memory_order_acquire);
+            return counters ? &counters[slot % CHUNK] : nullptr;
+        }
+
+    private:
+        std::atomic<Counters *> _chunks[(DOT_MAX_TYPES + CHUNK - 1) / CHUNK];
+    };
+
+    /**
+     * All live shards, plus the totals of shards whose threads have exited.
+     */
+    class Registry {
+    public:
+        std::mutex mutex;
+        std::vector<Shard *> shards;
+        std::vector<uint64_t> retired;
+    };
+
+    /**
+     * Moves a thread's counts into the retired totals when the thread exits.
+     */
+    class ShardOwner {
+    public:
+        ShardOwner(Shard *shard) :
+                _shard(shard) {
+
+        }
+
+        ~ShardOwner() {
+            Registry &registry = instance();
+            std::lock_guard<std::mutex> locker(registry.mutex);
+            registry.retired.resize(TypeKey::count() * COUNTERS, 0);
+            accumulate(*_shard, registry.retired);
+            registry.shards.erase(std::find(registry.shards.begin(), registry.shards.end(), _shard));
+            delete _shard;
+        }
+
+    private:
+        Shard *_shard;
+    };
+
+public:
+    static void recordResolve(const TypeKey &type, int depth, bool found) {
+#ifndef DOT_DISABLE_STATS
+        Counters &counters = shard().at(type.slot);
+        increment(counters, RESOLVES);
+        if (depth > 0) {
+            increment(counters, PARENT_FALLTHROUGHS);
+            increment(counters, PARENT_DEPTH_TOTAL, depth);
+            if (static_cast<uint64_t>(depth) > counters.values[PARENT_DEPTH_MAX].load(std::memory_order_relaxed)) {
+                counters.values[PARENT_DEPTH_MAX].store(depth, std::memory_order_relaxed);
+            }
+        }
+
+        if (!found) {
+            increment(counters, MISSES);
+        }
+#endif
+    }
+
+    static void recordGenerate(const TypeKey &type) {
+#ifndef DOT_DISABLE_STATS
+        increment(shard().at(type.slot), GENERATES);
+#endif
+    }
+
+    static void recordRegister(const TypeKey &type) {
+#ifndef DOT_DISABLE_STATS
+        increment(shard().at(type.slot), REGISTRATIONS);
+#endif
+    }
+
+    static void recordUnregister(const TypeKey &type) {
+#ifndef DOT_DISABLE_STATS
+        increment(shard().at(type.slot), UNREGISTRATIONS);
+#endif
+    }
+
+    /**
+     * Returns the counters of every type seen so far, most resolved first.
+     */
+    static std::vector<TypeStats> snapshot() {
+        std::vector<uint64_t> totals;
+        {
+            Registry &registry = instance();
+            std::lock_guard<std::mutex> locker(registry.mutex);
+            totals = registry.retired;
+            totals.resize(TypeKey::count() * COUNTERS, 0);
+            for (auto shard : registry.shards) {
+                accumulate(*shard, totals);
+            }
+        }
+
+        std::vector<TypeStats> result;
+        for (uint32_t slot = 0; slot < totals.size() / COUNTERS; slot++) {
+            const uint64_t *values = &totals[slot * COUNTERS];
+            if (std::all_of(values, values + COUNTERS, [](uint64_t value) { return value == 0; })) {
+                continue;
+            }
+
+            const std::type_info *info = TypeKey::at(slot);
+            TypeStats stats;
+            stats.type = info ? TypeKey::demangle(*info) : "other";
+            stats.resolves = values[RESOLVES];
+            stats.parentFallthroughs = values[PARENT_FALLTHROUGHS];
+            stats.parentDepthTotal = values[PARENT_DEPTH_TOTAL];
+            stats.parentDepthMax = values[PARENT_DEPTH_MAX];
+            stats.misses = values[MISSES];
+            stats.generates = values[GENERATES];
+            stats.registrations = values[REGISTRATIONS];
+            stats.unregistrations = values[UNREGISTRATIONS];
+            result.push_back(stats);
+        }
+
+        std::stable_sort(result.begin(), result.end(), [](const TypeStats &a, const TypeStats &b) {
+            return a.resolves > b.resolves;
+        });
+
+        return result;
+    }
+
+    /**
+     * Writes a snapshot in the Prometheus text exposition format.
+     */
+    static void writePrometheus(std::ostream &out) {
+        auto stats = snapshot();
+
+        struct Metric {
+            const char *name;
+            const char *type;
+            const char *help;
+            uint64_t TypeStats::*value;
+        };
+
+        static const Metric metrics[] = {
+            { "dot_resolve_total", "counter", "Service lookups made through Container::get.", &TypeStats::resolves },
+            { "dot_resolve_parent_total", "counter", "Lookups that fell through to a parent container.", &TypeStats::parentFallthroughs },
+            { "dot_resolve_parent_depth_total", "counter", "Parent containers walked by lookups that fell through.", &TypeStats::parentDepthTotal },
+            { "dot_resolve_parent_depth_max", "gauge", "Deepest parent walk seen by a single lookup.", &TypeStats::parentDepthMax },
+            { "dot_resolve_miss_total", "counter", "Lookups that found no service in the container hierarchy.", &TypeStats::misses },
+            { "dot_generate_total", "counter", "Factory invocations.", &TypeStats::generates },
+            { "dot_register_total", "counter", "Service registrations.", &TypeStats::registrations },
+            { "dot_unregister_total", "counter", "Service unregistrations.", &TypeStats::unregistrations }
+        };
+
+        for (const auto &metric : metrics) {
+            out << "# HELP " << metric.name << " " << metric.help << "\n";
+            out << "# TYPE " << metric.name << " " << metric.type << "\n";
+            for (const auto &type : stats) {
+                out << metric.name << "{type=\"" << escapeLabel(type.type) << "\"} " << type.*metric.value << "\n";
+            }
+        }
+    }
+
+    /**
+     * Passes a snapshot in the Prometheus text format to the given callback.
+     */
+    static void writePrometheus(const std::function<void(const std::string &)> &callback) {
+        std::ostringstream out;
+        writePrometheus(out);
+        callback(out.str());
+    }
+
+    /**
+     * Writes a snapshot in the Prometheus text format to a file.  The file is written under a
+     * temporary name and renamed into place, so a scraper never sees a partial file.
+     */
+    static bool writePrometheusFile(const std::string &path) {
+        std::string temporary = path + ".tmp";
+        {
+            std::ofstream out(temporary.c_str(), std::ios::trunc);
+            if (!out) {
+                return false;
+            }
+
+            writePrometheus(out);
+            if (!out.flush()) {
+                return false;
+            }
+        }
+
+        return std::rename(temporary.c_str(), path.c_str()) == 0;
+    }
+
+private:
+    static Registry &instance() {
+        static Registry registry;
+        return registry;
+    }
+
+    static Shard &shard() {
+        static thread_local Shard *current = nullptr;
+        if (!current) {
+            current = new Shard;
+            {
+                Registry &registry = instance();
+                std::lock_guard<std::mutex> locker(registry.mutex);
+                registry.shards.push_back(current);
+            }
+
+            static thread_local ShardOwner owner(current);
+        }
+
+        return *current;
+    }
+
+    /**
+     * Only the owning thread writes to a shard, so a relaxed load and store is enough.
+     */
+    static void increment(Counters &counters, Counter counter, uint64_t amount = 1) {
+        auto &value = counters.values[counter];
+        value.store(value.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+    }
+
+    static void accumulate(const Shard &shard, std::vector<uint64_t> &totals) {
+        for (uint32_t slot = 0; slot < totals.size() / COUNTERS; slot++) {
+            const Counters *counters = shard.find(slot);
+            if (!counters) {
+                slot += CHUNK - 1;
+                continue;
+            }
+
+            for (int counter = 0; counter < COUNTERS; counter++) {
+                uint64_t value = counters->values[counter].load(std::memory_order_relaxed);
+                uint64_t &total = totals[slot * COUNTERS + counter];
+                total = counter == PARENT_DEPTH_MAX ? std::max(total, value) : total + value;
+            }
+        }
+    }
+
+    static std::string escapeLabel(const std::string &value) {
+        std::string result;
+        for (char c : value) {
+            if (c == '\\' || c == '"') {
+                result += '\\';
+                result += c;
+            } else if (c == '\n') {
+                result += "\\n";
+            } else {
+                result += c;
+            }
+        }
+
+        return result;
+    }
+};
+
+/**
+ * Log-linear latency histogram in the style of HdrHistogram.  Values are bucketed by power of
+ * two with 16 linear sub-buckets each, which bounds the relative error to about 6%, up to a
+ * maximum of 2^40ns (about 18 minutes).  Recording is a relaxed atomic increment, so any
+ * number of threads can record into the same histogram.
+ */
+class LatencyHistogram {
+public:
+    static const int SUB_BITS = 4;
+    static const int SUB_BUCKETS = 1 << SUB_BITS;
+    static const int MAX_BITS = 40;
+    static const int BUCKETS = (MAX_BITS - SUB_BITS + 1) * SUB_BUCKETS;
+
+    LatencyHistogram() {
+        reset();
+    }
+
+    LatencyHistogram(const LatencyHistogram &other) {
+        reset();
+        merge(other);
+    }
+
+    LatencyHistogram &operator =(const LatencyHistogram &other) {
+        if (this != &other) {
+            reset();
+            merge(other);
+        }
+
+        return *this;
+    }
+
+    void record(uint64_t nanos) {
+        _buckets[bucket(nanos)].fetch_add(1, std::memory_order_relaxed);
+        _count.fetch_add(1, std::memory_order_relaxed);
+        _total.fetch_add(nanos, std::memory_order_relaxed);
+
+        uint64_t max = _max.load(std::memory_order_relaxed);
+        while (nanos > max && !_max.compare_exchange_weak(max, nanos, std::memory_order_relaxed)) {
+        }
+    }
+
+    void merge(const LatencyHistogram &other) {
+        for (int i = 0; i < BUCKETS; i++) {
+            uint64_t value = other._buckets[i].load(std::memory_order_relaxed);
+            if (value) {
+                _buckets[i].fetch_add(value, std::memory_order_relaxed);
+            }
+        }
+
+        _count.fetch_add(other.count(), std::memory_order_relaxed);
+        _total.fetch_add(other.total(), std::memory_order_relaxed);
+        _max.store(std::max(max(), other.max()), std::memory_order_relaxed);
+    }
+
+    /**
+     * Moves everything recorded so far into the target and clears this histogram, without
+     * losing values recorded concurrently.
+     */
+    void drainInto(LatencyHistogram &target) {
+        for (int i = 0; i < BUCKETS; i++) {
+            uint64_t value = _buckets[i].exchange(0, std::memory_order_relaxed);
+            if (value) {
+                target._buckets[i].fetch_add(value, std::memory_order_relaxed);
+            }
+        }
+
+        target._count.fetch_add(_count.exchange(0, std::memory_order_relaxed), std::memory_order_relaxed);
+        target._total.fetch_add(_total.exchange(0, std::memory_order_relaxed), std::memory_order_relaxed);
+        uint64_t max = _max.exchange(0, std::memory_order_relaxed);
+        target._max.store(std::max(target.max(), max), std::memory_order_relaxed);
+    }
+
+    void reset() {
+        for (auto &bucket : _buckets) {
+            bucket.store(0, std::memory_order_relaxed);
+        }
+
+        _count.store(0, std::memory_order_relaxed);
+        _total.store(0, std::memory_order_relaxed);
+        _max.store(0, std::memory_order_relaxed);
+    }
+
+    uint64_t count() const {
+        return _count.load(std::memory_order_relaxed);
+    }
+
+    uint64_t total() const {
+        return _total.load(std::memory_order_relaxed);
+    }
+
+    uint64_t max() const {
+        return _max.load(std::memory_order_relaxed);
+    }
+
+    uint64_t mean() const {
+        uint64_t count = this->count();
+        return count ? total() / count : 0;
+    }
+
+    /**
+     * Returns the value at the given quantile (0.5 for the median, 0.99 for p99), reported as
+     * the highest value that falls in the same bucket.
+     */
+    uint64_t percentile(double quantile) const {
+        uint64_t count = this->count();
+        if (!count) {
+            return 0;
+        }
+
+        uint64_t target = static_cast<uint64_t>(quantile * count + 0.5);
+        target = std::max<uint64_t>(1, std::min(target, count));
+
+        uint64_t seen = 0;
+        for (int i = 0; i < BUCKETS; i++) {
+            seen += _buckets[i].load(std::memory_order_relaxed);
+            if (seen >= target) {
+                return std::min(upperBound(i), max());
+            }
+        }
+
+        return max();
+    }
+
+    static int bucket(uint64_t nanos) {
+        if (nanos >= (1ULL << MAX_BITS)) {
+            nanos = (1ULL << MAX_BITS) - 1;
+        }
+
+        if (nanos < static_cast<uint64_t>(SUB_BUCKETS)) {
+            return static_cast<int>(nanos);
+        }
+
+        int msb = 63 - __builtin_clzll(nanos);
+        int shift = msb - SUB_BITS;
+        return (shift + 1) * SUB_BUCKETS + static_cast<int>((nanos >> shift) & (SUB_BUCKETS - 1));
+    }
+
+    static uint64_t upperBound(int bucket) {
+        if (bucket < SUB_BUCKETS) {
+            return bucket;
+        }
+
+        int shift = bucket / SUB_BUCKETS - 1;
+        uint64_t lower = static_cast<uint64_t>(SUB_BUCKETS + bucket % SUB_BUCKETS) << shift;
+        return lower + (1ULL << shift) - 1;
+    }
+
+private:
+    std::atomic<uint64_t> _buckets[BUCKETS];
+    std::atomic<uint64_t> _count;
+    std::atomic<uint64_t> _total;
+    std::atomic<uint64_t> _max;
+};
+
+/**
+ * Opt-in profiler for the container mutex.  While running, every lock taken by a container
+ * operation records how long it waited (only when the lock was contended) and how long it was
+ * held, broken down by operation and by service type.  Locks taken on parent containers while
+ * resolving through a scope are reported separately.  When not running, each lock costs one
+ * relaxed load; define DOT_DISABLE_LOCK_PROFILING to remove the profiler entirely.
+ */
+class LockProfiler {
+    struct OperationProfile {
+        LatencyHistogram wait;
+        LatencyHistogram hold;
+        std::atomic<uint64_t> acquisitions;
+        std::atomic<uint64_t> contended;
+    };
+
+    struct TypeProfile {
+        std::atomic<uint64_t> acquisitions;
+        std::atomic<uint64_t> contended;
+        std::atomic<uint64_t> waitTotal;
+        std::atomic<uint64_t> waitMax;
+        std::atomic<uint64_t> holdTotal;
+    };
+
+    struct Profile {
+        OperationProfile operations[OPERATION_COUNT];
+        OperationProfile parent;
+        TypeProfile types[DOT_MAX_TYPES];
+        std::atomic<uint64_t> started;
+    };
+
+public:
+    /**
+     * Starts recording, clearing anything recorded before.
+     */
+    static void start() {
+        std::lock_guard<std::mutex> locker(mutex());
+        Profile *profile = current().load(std::memory_order_acquire);
+        if (!profile) {
+            profile = new Profile();
+            current().store(profile, std::memory_order_release);
+        }
+
+        clear(*profile);
+        running().store(true, std::memory_order_release);
+    }
+
+    static void stop() {
+        running().store(false, std::memory_order_release);
+    }
+
+    static bool isRunning() {
+#ifndef DOT_DISABLE_LOCK_PROFILING
+        return running().load(std::memory_order_relaxed);
+#else
+        return false;
+#endif
+    }
+
+    static void record(Operation operation, const TypeKey *type, bool parent, bool contended, uint64_t wait,
+                       uint64_t hold) {
+        Profile *profile = current().load(std::memory_order_acquire);
+        if (!profile) {
+            return;
+        }
+
+        OperationProfile &op = parent ? profile->parent : profile->operations[static_cast<int>(operation)];
+        op.acquisitions.fetch_add(1, std::memory_order_relaxed);
+        op.hold.record(hold);
+        if (contended) {
+            op.contended.fetch_add(1, std::memory_order_relaxed);
+            op.wait.record(wait);
+        }
+
+        if (type) {
+            TypeProfile &profileType = profile->types[type->slot];
+            profileType.acquisitions.fetch_add(1, std::memory_order_relaxed);
+            profileType.holdTotal.fetch_add(hold, std::memory_order_relaxed);
+            if (contended) {
+                profileType.contended.fetch_add(1, std::memory_order_relaxed);
+                profileType.waitTotal.fetch_add(wait, std::memory_order_relaxed);
+                uint64_t max = profileType.waitMax.load(std::memory_order_relaxed);
+                while (wait > max && !profileType.waitMax.compare_exchange_weak(max, wait, std::memory_order_relaxed)) {
+                }
+            }
+        }
+    }
+
+    /**
+     * Returns the wait histogram of an operation.  Only contended acquisitions are recorded.
+     */
+    static LatencyHistogram waitHistogram(Operation operation) {
+        Profile *profile = current().load(std::memory_order_acquire);
+        return profile ? profile->operations[static_cast<int>(operation)].wait : LatencyHistogram();
+    }
+
+    static LatencyHistogram holdHistogram(Operation operation) {
+        Profile *profile = current().load(std::memory_order_acquire);
+        return profile ? profile->operations[static_cast<int>(operation)].hold : LatencyHistogram();
+    }
+
+    /**
+     * Returns the wait histogram of parent container locks taken while resolving through scopes.
+     */
+    static LatencyHistogram parentWaitHistogram() {
+        Profile *profile = current().load(std::memory_order_acquire);
+        return profile ? profile->parent.wait : LatencyHistogram();
+    }
+
+    /**
+     * Writes the per-operation histograms and the most contended types.  This can be called at
+     * any time, including while the profiler is running.
+     */
+    static void report(std::ostream &out, size_t topTypes = 10) {
+        Profile *profile = current().load(std::memory_order_acquire);
+        if (!profile) {
+            out << "Container lock profiler has not been started." << std::endl;
+            return;
+        }
+
+        uint64_t elapsed = monotonicNanos() - profile->started.load(std::memory_order_relaxed);
+        out << "Container lock profile over " << formatNanos(elapsed) << std::endl;
+        out << std::left << std::setw(20) << "operation" << std::right << std::setw(12) << "acquired"
+            << std::setw(12) << "contended" << std::setw(10) << "wait p50" << std::setw(10) << "wait p99"
+            << std::setw(10) << "wait max" << std::setw(10) << "hold p50" << std::setw(10) << "hold p99"
+            << std::setw(10) << "hold max" << std::endl;
+
+        for (int i = 0; i <= OPERATION_COUNT; i++) {
+            const OperationProfile &op = i < OPERATION_COUNT ? profile->operations[i] : profile->parent;
+            if (!op.acquisitions.load(std::memory_order_relaxed)) {
+                continue;
+            }
+
+            std::string name = i < OPERATION_COUNT ? operationName(static_cast<Operation>(i)) : "get (parent)";
+            out << std::left << std::setw(20) << name << std::right
+                << std::setw(12) << op.acquisitions.load(std::memory_order_relaxed)
+                << std::setw(12) << op.contended.load(std::memory_order_relaxed)
+                << std::setw(10) << formatNanos(op.wait.percentile(0.5))
+                << std::setw(10) << formatNanos(op.wait.percentile(0.99))
+                << std::setw(10) << formatNanos(op.wait.max())
+                << std::setw(10) << formatNanos(op.hold.percentile(0.5))
+                << std::setw(10) << formatNanos(op.hold.percentile(0.99))
+                << std::setw(10) << formatNanos(op.hold.max()) << std::endl;
+        }
+
+        std::vector<uint32_t> slots;
+        for (uint32_t slot = 0; slot < TypeKey::count(); slot++) {
+            if (profile->types[slot].contended.load(std::memory_order_relaxed)) {
+                slots.push_back(slot);
+            }
+        }
+
+        std::sort(slots.begin(), slots.end(), [profile](uint32_t a, uint32_t b) {
+            return profile->types[a].waitTotal.load(std::memory_order_relaxed) >
+                   profile->types[b].waitTotal.load(std::memory_order_relaxed);
+        });
+
+        if (slots.size() > topTypes) {
+            slots.resize(topTypes);
+        }
+
+        out << std::endl << "Top contended types" << std::endl;
+        out << std::left << std::setw(40) << "type" << std::right << std::setw(12) << "acquired"
+            << std::setw(12) << "contended" << std::setw(12) << "wait total" << std::setw(10) << "wait max"
+            << std::setw(12) << "hold total" << std::endl;
+
+        for (uint32_t slot : slots) {
+            const TypeProfile &type = profile->types[slot];
+            const std::type_info *info = TypeKey::at(slot);
+            out << std::left << std::setw(40) << (info ? TypeKey::demangle(*info) : "other") << std::right
+                << std::setw(12) << type.acquisitions.load(std::memory_order_relaxed)
+                << std::setw(12) << type.contended.load(std::memory_order_relaxed)
+                << std::setw(12) << formatNanos(type.waitTotal.load(std::memory_order_relaxed))
+                << std::setw(10) << formatNanos(type.waitMax.load(std::memory_order_relaxed))
+                << std::setw(12) << formatNanos(type.holdTotal.load(std::memory_order_relaxed)) << std::endl;
+        }
+    }
+
+private:
+    static std::atomic<bool> &running() {
+        static std::atomic<bool> running(false);
+        return running;
+    }
+
+    static std::atomic<Profile *> &current() {
+        static std::atomic<Profile *> profile(nullptr);
+        return profile;
+    }
+
+    static std::mutex &mutex() {
+        static std::mutex mutex;
+        return mutex;
+    }
+
+    static void clear(OperationProfile &op) {
+        op.wait.reset();
+        op.hold.reset();
+        op.acquisitions.store(0, std::memory_order_relaxed);
+        op.contended.store(0, std::memory_order_relaxed);
+    }
+
+    static void clear(Profile &profile) {
+        for (auto &op : profile.operations) {
+            clear(op);
+        }
+
+        clear(profile.parent);
+        for (auto &type : profile.types) {
+            type.acquisitions.store(0, std::memory_order_relaxed);
+            type.contended.store(0, std::memory_order_relaxed);
+            type.waitTotal.store(0, std::memory_order_relaxed);
+            type.waitMax.store(0, std::memory_order_relaxed);
+            type.holdTotal.store(0, std::memory_order_relaxed);
+        }
+
+        profile.started.store(monotonicNanos(), std::memory_order_relaxed);
+    }
+};
+
+/**
+ * Opt-in profiler for service construction, meant to be run over application startup.  While
+ * running, every factory invocation records its wall time, thread, nesting (the factory or
+ * resolve that invoked it) and, if an allocation probe is installed, the bytes it allocated.
+ * Services resolved from inside a factory are recorded as children of that factory.  The
+ * results can be written as a report sorted by cost, and as a Chrome trace-event file that
+ * can be opened in chrome://tracing or Perfetto.  Define DOT_DISABLE_STARTUP_PROFILER to
+ * remove the profiler entirely.
+ */
+class StartupProfiler {
+    static const int MAX_DEPTH = 64;
+
+    struct Event {
+        const TypeKey *type;
+        const std::type_info *config;
+        int id;
+        Operation operation;
+        uint32_t thread;
+        int parent;
+        int depth;
+        uint64_t start;
+        uint64_t end;
+        uint64_t allocated;
+        uint64_t children;
+    };
+
+    struct Session {
+        std::mutex mutex;
+        std::vector<Event> events;
+        uint64_t start = 0;
+        uint64_t end = 0;
+        uint64_t number = 0;
+    };
+
+    struct Stack {
+        int events[MAX_DEPTH];
+        int size;
+    };
+
+public:
+    /**
+     * Returns the number of bytes allocated so far by the calling thread.
+     */
+    typedef uint64_t (*AllocationProbe)();
+
+    /**
+     * Records a factory invocation, or a resolve made from inside one, for the lifetime of
+     * the object.
+     */
+    class Invocation {
+    public:
+        Invocation(Operation operation, const TypeKey &type, const std::type_info *config, int id) :
+                _event(-1),
+                _session(0) {
+#ifndef DOT_DISABLE_STARTUP_PROFILER
+            if (isRunning()) {
+                _event = begin(operation, type, config, id, _session);
+            }
+#endif
+        }
+
+        ~Invocation() {
+            if (_event >= 0) {
+                end(_event, _session);
+            }
+        }
+
+        Invocation(const Invocation &) = delete;
+        void operator =(const Invocation &) = delete;
+
+    private:
+        int _event;
+        uint64_t _session;
+    };
+
+    /**
+     * Starts recording, clearing anything recorded before.
+     */
+    static void start() {
+        Session &current = session();
+        std::lock_guard<std::mutex> locker(current.mutex);
+        current.events.clear();
+        current.start = monotonicNanos();
+        current.end = 0;
+        current.number++;
+        running().store(true, std::memory_order_release);
+    }
+
+    static void stop() {
+        running().store(false, std::memory_order_release);
+        Session &current = session();
+        std::lock_guard<std::mutex> locker(current.mutex);
+        current.end = monotonicNanos();
+    }
+
+    static bool isRunning() {
+#ifndef DOT_DISABLE_STARTUP_PROFILER
+        return running().load(std::memory_order_relaxed);
+#else
+        return false;
+#endif
+    }
+
+    /**
+     * Installs a probe used to measure allocation volume, for example one reading jemalloc's
+     * "thread.allocatedp" counter or a counter kept by a replacement operator new.  Without a
+     * probe no allocation volume is reported.
+     */
+    static void setAllocationProbe(AllocationProbe probe) {
+        allocationProbe().store(probe, std::memory_order_release);
+    }
+
+    /**
+     * Returns the number of factory invocations recorded.
+     */
+    static size_t invocations() {
+        Session &current = session();
+        std::lock_guard<std::mutex> locker(current.mutex);
+        return std::count_if(current.events.begin(), current.events.end(), [](const Event &event) {
+            return event.operation != Operation::Get;
+        });
+    }
+
+    /**
+     * Writes the recorded factories sorted by total time, the slowest invocations, and the
+     * critical path: the slowest top-level factory followed down through its slowest child.
+     */
+    static void writeReport(std::ostream &out, size_t top = 25) {
+        Session &current = session();
+        std::lock_guard<std::mutex> locker(current.mutex);
+        const std::vector<Event> &events = current.events;
+
+        uint64_t topLevel = 0;
+        size_t factories = 0;
+        for (const auto &event : events) {
+            if (event.operation != Operation::Get) {
+                factories++;
+                topLevel += event.parent < 0 && event.end ? event.end - event.start : 0;
+            }
+        }
+
+        uint64_t end = current.end ? current.end : monotonicNanos();
+        out << "Startup profile: " << factories << " factory invocations over " << formatNanos(end - current.start)
+            << ", " << formatNanos(topLevel) << " in top-level factories" << std::endl;
+
+        // Aggregate by factory.
+        struct Total {
+            const Event *first;
+            uint64_t calls;
+            uint64_t total;
+            uint64_t self;
+            uint64_t max;
+            uint64_t allocated;
+            uint64_t resolves;
+        };
+
+        std::map<std::pair<std::type_index, std::type_index>, Total> totals;
+        for (const auto &event : events) {
+            if (event.operation == Operation::Get) {
+                if (event.parent >= 0) {
+                    const Event &parent = events[event.parent];
+                    auto &total = totals[std::make_pair(parent.type->index(), std::type_index(*parent.config))];
+                    total.resolves++;
+                }
+
+                continue;
+            }
+
+            auto &total = totals[std::make_pair(event.type->index(), std::type_index(*event.config))];
+            uint64_t duration = event.end ? event.end - event.start : 0;
+            if (!total.calls) {
+                total.first = &event;
+            }
+
+            total.calls++;
+            total.total += duration;
+            total.self += duration - std::min(duration, event.children);
+            total.max = std::max(total.max, duration);
+            total.allocated += event.allocated;
+        }
+
+        std::vector<Total> sorted;
+        for (const auto &total : totals) {
+            if (total.second.calls) {
+                sorted.push_back(total.second);
+            }
+        }
+
+        std::sort(sorted.begin(), sorted.end(), [](const Total &a, const Total &b) {
+            return a.total > b.total;
+        });
+
+        out << std::endl << "Factories by total time" << std::endl;
+        out << std::left << std::setw(40) << "type" << std::setw(24) << "config" << std::right << std::setw(8)
+            << "calls" << std::setw(10) << "total" << std::setw(10) << "self" << std::setw(10) << "max"
+            << std::setw(10) << "resolves" << std::setw(14) << "allocated" << std::endl;
+
+        for (size_t i = 0; i < sorted.size() && i < top; i++) {
+            const Total &total = sorted[i];
+            out << std::left << std::setw(40) << total.first->type->name() << std::setw(24)
+                << TypeKey::demangle(*total.first->config) << std::right << std::setw(8) << total.calls
+                << std::setw(10) << formatNanos(total.total) << std::setw(10) << formatNanos(total.self)
+                << std::setw(10) << formatNanos(total.max) << std::setw(10) << total.resolves << std::setw(14)
+                << total.allocated << std::endl;
+        }
+
+        std::vector<int> slowest;
+        for (int i = 0; i < static_cast<int>(events.size()); i++) {
+            if (events[i].operation != Operation::Get) {
+                slowest.push_back(i);
+            }
+        }
+
+        std::sort(slowest.begin(), slowest.end(), [&events](int a, int b) {
+            return duration(events[a]) > duration(events[b]);
+        });
+
+        out << std::endl << "Slowest invocations" << std::endl;
+        for (size_t i = 0; i < slowest.size() && i < top; i++) {
+            const Event &event = events[slowest[i]];
+            out << std::right << std::setw(10) << formatNanos(duration(event)) << "  " << describe(event)
+                << " on thread " << event.thread << " at depth " << event.depth << std::endl;
+        }
+
+        out << std::endl << "Critical path" << std::endl;
+        int node = -1;
+        for (int i : slowest) {
+            if (events[i].parent < 0) {
+                node = i;
+                break;
+            }
+        }
+
+        while (node >= 0) {
+            const Event &event = events[node];
+            out << std::string(2 + 2 * event.depth, ' ') << formatNanos(duration(event)) << "  " << describe(event)
+                << std::endl;
+
+            int next = -1;
+            for (int i = node + 1; i < static_cast<int>(events.size()); i++) {
+                if (events[i].parent == node && events[i].operation != Operation::Get &&
+                        (next < 0 || duration(events[i]) > duration(events[next]))) {
+                    next = i;
+                }
+            }
+
+            node = next;
+        }
+    }
+
+    /**
+     * Writes the recorded invocations in the Chrome trace-event JSON format.
+     */
+    static void writeChromeTrace(std::ostream &out) {
+        Session &current = session();
+        std::lock_guard<std::mutex> locker(current.mutex);
+
+        out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+
+        std::vector<uint32_t> threads;
+        for (const auto &event : current.events) {
+            if (std::find(threads.begin(), threads.end(), event.thread) == threads.end()) {
+                threads.push_back(event.thread);
+            }
+        }
+
+        bool first = true;
+        for (uint32_t thread : threads) {
+            out << (first ? "" : ",") << "\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << thread
+                << ",\"args\":{\"name\":\"thread " << thread << "\"}}";
+            first = false;
+        }
+
+        out << std::fixed << std::setprecision(3);
+        for (const auto &event : current.events) {
+            uint64_t end = event.end ? event.end : event.start;
+            out << (first ? "" : ",") << "\n{\"name\":\"" << jsonEscape(event.type->name()) << "\",\"cat\":\""
+                << operationName(event.operation) << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << event.thread
+                << ",\"ts\":" << (event.start - current.start) / 1000.0 << ",\"dur\":" << (end - event.start) / 1000.0
+                << ",\"args\":{\"id\":" << event.id;
+
+            if (event.config) {
+                out << ",\"config\":\"" << jsonEscape(TypeKey::demangle(*event.config)) << "\",\"self_us\":"
+                    << (end - event.start - std::min(end - event.start, event.children)) / 1000.0;
+            }
+
+            if (allocationProbe().load(std::memory_order_acquire)) {
+                out << ",\"allocated_bytes\":" << event.allocated;
+            }
+
+            out << "}}";
+            first = false;
+        }
+
+        out << "\n]}\n";
+    }
+
+    static bool writeChromeTrace(const std::string &path) {
+        std::ofstream out(path.c_str(), std::ios::trunc);
+        writeChromeTrace(out);
+        return static_cast<bool>(out.flush());
+    }
+
+private:
+    static Session &session() {
+        static Session session;
+        return session;
+    }
+
+    static std::atomic<bool> &running() {
+        static std::atomic<bool> running(false);
+        return running;
+    }
+
+    static std::atomic<AllocationProbe> &allocationProbe() {
+        static std::atomic<AllocationProbe> probe(nullptr);
+        return probe;
+    }
+
+    static Stack &stack() {
+        static thread_local Stack stack;
+        return stack;
+    }
+
+    static int begin(Operation operation, const TypeKey &type, const std::type_info *config, int id,
+                     uint64_t &number) {
+        Stack &open = stack();
+
+        // Resolves are only interesting as dependencies of a factory.
+        if (operation == Operation::Get && open.size == 0) {
+            return -1;
+        }
+
+        AllocationProbe probe = allocationProbe().load(std::memory_order_acquire);
+
+        Session &current = session();
+        std::lock_guard<std::mutex> locker(current.mutex);
+
+        int parent = open.size > 0 && open.size <= MAX_DEPTH ? open.events[open.size - 1] : -1;
+        int index = static_cast<int>(current.events.size());
+        current.events.push_back(Event { &type, config, id, operation, threadNumber(), parent, open.size,
+                                         monotonicNanos(), 0, probe ? probe() : 0, 0 });
+        number = current.number;
+
+        if (open.size < MAX_DEPTH) {
+            open.events[open.size] = index;
+        }
+
+        open.size++;
+        return index;
+    }
+
+    static void end(int index, uint64_t number) {
+        uint64_t now = monotonicNanos();
+        AllocationProbe probe = allocationProbe().load(std::memory_order_acquire);
+
+        Stack &open = stack();
+        open.size--;
+
+        Session &current = session();
+        std::lock_guard<std::mutex> locker(current.mutex);
+        if (current.number != number || index >= static_cast<int>(current.events.size())) {
+            return;
+        }
+
+        Event &event = current.events[index];
+        event.end = now;
+        event.allocated = probe ? probe() - event.allocated : 0;
+        if (event.parent >= 0 && event.operation != Operation::Get) {
+            current.events[event.parent].children += now - event.start;
+        }
+    }
+
+    static uint64_t duration(const Event &event) {
+        return event.end ? event.end - event.start : 0;
+    }
+
+    static std::string describe(const Event &event) {
+        std::ostringstream out;
+        out << operationName(event.operation) << " " << event.type->name() << " (id " << event.id;
+        if (event.config) {
+            out << ", config " << TypeKey::demangle(*event.config);
+        }
+
+        out << ")";
+        return out.str();
+    }
+
+    static std::string jsonEscape(const std::string &value) {
+        std::string result;
+        for (char c : value) {
+            if (c == '"' || c == '\\') {
+                result += '\\';
+                result += c;
+            } else if (static_cast<unsigned char>(c) < 0x20) {
+                char escaped[8];
+                std::snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+                result += escaped;
+            } else {
+                result += c;
+            }
+        }
+
+        return result;
+    }
+};
+
+/**
+ * Latency of a single (Type, Config) factory, as returned by GenerateLatency::snapshot().
+ */
+struct FactoryLatency {
+    std::string type;
+    std::string config;
+    uint64_t count;
+    uint64_t mean;
+    uint64_t p50;
+    uint64_t p99;
+    uint64_t p999;
+    uint64_t max;
+};
+
+/**
+ * Opt-in latency histograms for factory invocations, kept per (Type, Config) factory.  Each
+ * thread records into its own histograms, which are merged when read, so recording never
+ * contends between threads.  Reading with reset drains the histograms, for reporting over
+ * fixed intervals.  When disabled each invocation costs one relaxed load; define
+ * DOT_DISABLE_GENERATE_LATENCY to remove the histograms entirely.
+ */
+class GenerateLatency {
+    static const uint32_t CHUNK = 64;
+
+    /** Shared by the factories past the first DOT_MAX_TYPES - 1, and reported as "other". */
+    static const uint32_t OTHER = DOT_MAX_TYPES - 1;
+
+    /**
+     * A thread's histograms, allocated as factories are first invoked on the thread.
+     */
+    class Shard {
+    public:
+        Shard() {
+            for (auto &chunk : _chunks) {
+                chunk.store(nullptr, std::memory_order_relaxed);
+            }
+        }
+
+        ~Shard() {
+            for (auto &chunk : _chunks) {
+                std::atomic<LatencyHistogram *> *histograms = chunk.load(std::memory_order_relaxed);
+                if (histograms) {
+                    for (uint32_t i = 0; i < CHUNK; i++) {
+                        delete histograms[i].load(std::memory_order_relaxed);
+                    }
+
+                    delete[] histograms;
+                }
+            }
+        }
+
+        LatencyHistogram &at(uint32_t slot) {
+            auto &chunk = _chunks[slot / CHUNK];
+            std::atomic<LatencyHistogram *> *histograms = chunk.load(std::memory_order_relaxed);
+            if (!histograms) {
+                histograms = new std::atomic<LatencyHistogram *>[CHUNK];
+                for (uint32_t i = 0; i < CHUNK; i++) {
+                    histograms[i].store(nullptr, std::memory_order_relaxed);
+                }
+
+                chunk.store(histograms, std::memory_order_release);
+            }
+
+            LatencyHistogram *histogram = histograms[slot % CHUNK].load(std::memory_order_relaxed);
+            if (!histogram) {
+                histogram = new LatencyHistogram;
+                histograms[slot % CHUNK].store(histogram, std::memory_order_release);
+            }
+
+            return *histogram;
+        }
+
+        LatencyHistogram *find(uint32_t slot) const {
+            std::atomic<LatencyHistogram *> *histograms = _chunks[slot / CHUNK].load(std::memory_order_acquire);
+            return histograms ? histograms[slot % CHUNK].load(std::memory_order_acquire) : nullptr;
+        }
+
+    private:
+        std::atomic<std::atomic<LatencyHistogram *> *> _chunks[(DOT_MAX_TYPES + CHUNK - 1) / CHUNK];
+    };
+
+    struct FactoryInfo {
+        const TypeKey *type;
+        const std::type_info *config;
+    };
+
+    /**
+     * All live shards, the factories seen so far, and the histograms of exited threads.
+     */
+    class Registry {
+    public:
+        std::mutex mutex;
+        std::vector<Shard *> shards;
+        std::vector<FactoryInfo> factories;
+        bool overflowed = false;
+        Shard retired;
+    };
+
+    class ShardOwner {
+    public:
+        ShardOwner(Shard *shard) :
+                _shard(shard) {
+
+        }
+
+        ~ShardOwner() {
+            Registry &registry = instance();
+            std::lock_guard<std::mutex> locker(registry.mutex);
+            for (uint32_t slot : usedSlots(registry)) {
+                LatencyHistogram *histogram = _shard->find(slot);
+                if (histogram) {
+                    histogram->drainInto(registry.retired.at(slot));
+                }
+            }
+
+            registry.shards.erase(std::find(registry.shards.begin(), registry.shards.end(), _shard));
+            delete _shard;
+        }
+
+    private:
+        Shard *_shard;
+    };
+
+public:
+    /**
+     * Times one factory invocation for the lifetime of the object.
+     */
+    template<typename Type, typename Config>
+    class Timer {
+    public:
+        Timer() :
+                _start(isEnabled() ? monotonicNanos() : 0) {
+
+        }
+
+        ~Timer() {
+            if (_start) {
+                record(slot<Type, Config>(), monotonicNanos() - _start);
+            }
+        }
+
+        Timer(const Timer &) = delete;
+        void operator =(const Timer &) = delete;
+
+    private:
+        uint64_t _start;
+    };
+
+    static void enable() {
+        enabled().store(true, std::memory_order_release);
+    }
+
+    static void disable() {
+        enabled().store(false, std::memory_order_release);
+    }
+
+    static bool isEnabled() {
+#ifndef DOT_DISABLE_GENERATE_LATENCY
+        return enabled().load(std::memory_order_relaxed);
+#else
+        return false;
+#endif
+    }
+
+    /**
+     * Returns the merged histogram of a single factory.  With reset, the returned values are
+     * removed from the factory's histograms.
+     */
+    template<typename Type, typename Config>
+    static LatencyHistogram histogram(bool reset = false) {
+        uint32_t factory = slot<Type, Config>();
+
+        LatencyHistogram result;
+        Registry &registry = instance();
+        std::lock_guard<std::mutex> locker(registry.mutex);
+        collect(registry, factory, reset, result);
+        return result;
+    }
+
+    /**
+     * Returns the latency of every factory invoked so far, slowest p99 first.  With reset, the
+     * returned values are removed from the histograms, so successive calls report intervals.
+     */
+    static std::vector<FactoryLatency> snapshot(bool reset = false) {
+        std::vector<FactoryLatency> result;
+        Registry &registry = instance();
+        std::lock_guard<std::mutex> locker(registry.mutex);
+
+        for (uint32_t slot : usedSlots(registry)) {
+            LatencyHistogram merged;
+            collect(registry, slot, reset, merged);
+            if (!merged.count()) {
+                continue;
+            }
+
+            FactoryLatency latency;
+            if (slot < registry.factories.size()) {
+                const FactoryInfo &factory = registry.factories[slot];
+                latency.type = factory.type->name();
+                latency.config = TypeKey::demangle(*factory.config);
+            } else {
+                latency.type = "other";
+            }
+
+            latency.count = merged.count();
+            latency.mean = merged.mean();
+            latency.p50 = merged.percentile(0.5);
+            latency.p99 = merged.percentile(0.99);
+            latency.p999 = merged.percentile(0.999);
+            latency.max = merged.max();
+            result.push_back(latency);
+        }
+
+        std::sort(result.begin(), result.end(), [](const FactoryLatency &a, const FactoryLatency &b) {
+            return a.p99 > b.p99;
+        });
+
+        return result;
+    }
+
+    /**
+     * Writes a table of factory latencies.
+     */
+    static void report(std::ostream &out, bool reset = false) {
+        out << std::left << std::setw(40) << "type" << std::setw(24) << "config" << std::right << std::setw(10)
+            << "count" << std::setw(10) << "mean" << std::setw(10) << "p50" << std::setw(10) << "p99"
+            << std::setw(10) << "p999" << std::setw(10) << "max" << std::endl;
+
+        for (const auto &latency : snapshot(reset)) {
+            out << std::left << std::setw(40) << latency.type << std::setw(24) << latency.config << std::right
+                << std::setw(10) << latency.count << std::setw(10) << formatNanos(latency.mean) << std::setw(10)
+                << formatNanos(latency.p50) << std::setw(10) << formatNanos(latency.p99) << std::setw(10)
+                << formatNanos(latency.p999) << std::setw(10) << formatNanos(latency.max) << std::endl;
+        }
+    }
+
+private:
+    static Registry &instance() {
+        static Registry registry;
+        return registry;
+    }
+
+    static std::atomic<bool> &enabled() {
+        static std::atomic<bool> enabled(false);
+        return enabled;
+    }
+
+    template<typename Type, typename Config>
+    static uint32_t slot() {
+        static const uint32_t slot = registerFactory(TypeKey::of<Type>(), typeid(Config));
+        return slot;
+    }
+
+    static uint32_t registerFactory(const TypeKey &type, const std::type_info &config) {
+        Registry &registry = instance();
+        std::lock_guard<std::mutex> locker(registry.mutex);
+        if (registry.factories.size() >= OTHER) {
+            registry.overflowed = true;
+            return OTHER;
+        }
+
+        registry.factories.push_back(FactoryInfo { &type, &config });
+        return static_cast<uint32_t>(registry.factories.size() - 1);
+    }
+
+    static void record(uint32_t slot, uint64_t nanos) {
+        static thread_local Shard *current = nullptr;
+        if (!current) {
+            current = new Shard;
+            {
+                Registry &registry = instance();
+                std::lock_guard<std::mutex> locker(registry.mutex);
+                registry.shards.push_back(current);
+            }
+
+            static thread_local ShardOwner owner(current);
+        }
+
+        current->at(slot).record(nanos);
+    }
+
+    /**
+     * Returns the slots handed out so far, including the overflow slot once it is used.
+     */
+    static std::vector<uint32_t> usedSlots(const Registry &registry) {
+        std::vector<uint32_t> slots;
+        for (uint32_t slot = 0; slot < registry.factories.size(); slot++) {
+            slots.push_back(slot);
+        }
+
+        if (registry.overflowed) {
+            // Pushed as a temporary, since OTHER has no out-of-class definition in C++11.
+            slots.push_back(static_cast<uint32_t>(OTHER));
+        }
+
+        return slots;
+    }
+
+    static void collect(Registry &registry, uint32_t slot, bool reset, LatencyHistogram &result) {
+        std::vector<Shard *> shards(registry.shards);
+        shards.push_back(&registry.retired);
+        for (auto shard : shards) {
+            LatencyHistogram *histogram = shard->find(slot);
+            if (!histogram) {
+                continue;
+            }
+
+            if (reset) {
+                histogram->drainInto(result);
+            } else {
+                result.merge(*histogram);
+            }
+        }
+    }
+};
+
+/**
+ * Base factory class used for storing templated factories.
+ */
+class BaseFactory {
+public:
+    virtual ~BaseFactory() { }
+};
+
+/**
+ * Always-on recorder of the most recent container operations in the process, for finding out
+ * what happened before a service went missing or was overwritten.  Each thread writes into its
+ * own ring of DOT_FLIGHT_RECORDER_SIZE entries, so recording is wait-free and costs a handful
+ * of plain stores.  Rings of exited threads are kept (and reused by new threads), so their
+ * history survives.  The rings can be dumped to a stream at any time, to a file whenever a
+ * ContainerException is thrown, or to a file from a signal handler.  Define
+ * DOT_DISABLE_FLIGHT_RECORDER to remove the recorder entirely.
+ */
+#ifndef DOT_FLIGHT_RECORDER_SIZE
+#define DOT_FLIGHT_RECORDER_SIZE 256
+#endif
+
+class FlightRecorder {
+public:
+    enum class Outcome {
+        Ok,
+        Overwritten,
+        NotFound,
+        AlreadyExists,
+        NoFactory,
+        BadCast,
+        Frozen
+    };
+
+    static const char *outcomeName(Outcome outcome) {
+        static const char *names[] = { "ok", "overwritten", "not found", "already exists", "no factory", "bad cast", "frozen" };
+        return names[static_cast<int>(outcome)];
+    }
+
+    /**
+     * A recorded operation, as returned by entries().
+     */
+    struct Record {
+        uint64_t nanosAgo;
+        Operation operation;
+        Outcome outcome;
+        uint32_t thread;
+        const void *container;
+        const std::type_info *type;
+        int id;
+    };
+
+    static void record(Operation operation, const void *container, const TypeKey *type, int id, Outcome outcome) {
+#ifndef DOT_DISABLE_FLIGHT_RECORDER
+        Ring &ring = current();
+        uint64_t position = ring.head.load(std::memory_order_relaxed);
+        Entry &entry = ring.entries[position % DOT_FLIGHT_RECORDER_SIZE];
+
+        // Seqlock write: odd while the entry is being written, even once it is complete.
+        uint64_t sequence = entry.sequence.load(std::memory_order_relaxed);
+        entry.sequence.store(sequence + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        entry.timestamp.store(ticks(), std::memory_order_relaxed);
+        entry.container.store(container, std::memory_order_relaxed);
+        entry.type.store(type ? type->info : nullptr, std::memory_order_relaxed);
+        entry.packed.store(pack(operation, outcome, ring.thread, id), std::memory_order_relaxed);
+        entry.sequence.store(sequence + 2, std::memory_order_release);
+        ring.head.store(position + 1, std::memory_order_release);
+#endif
+    }
+
+    /**
+     * Returns the recorded operations of all threads, oldest first.
+     */
+    static std::vector<Record> entries() {
+        uint64_t now = ticks();
+        double nanosPerTick = calibrate();
+
+        std::vector<std::pair<uint64_t, Record>> collected;
+        for (Ring *ring = rings().load(std::memory_order_acquire); ring; ring = ring->next) {
+            for (auto &entry : ring->entries) {
+                Record record;
+                uint64_t timestamp;
+                if (read(entry, record, timestamp)) {
+                    record.nanosAgo = now > timestamp ? static_cast<uint64_t>((now - timestamp) * nanosPerTick) : 0;
+                    collected.push_back(std::make_pair(timestamp, record));
+                }
+            }
+        }
+
+        std::sort(collected.begin(), collected.end(), [](const std::pair<uint64_t, Record> &a,
+                                                         const std::pair<uint64_t, Record> &b) {
+            return a.first < b.first;
+        });
+
+        std::vector<Record> result;
+        for (const auto &entry : collected) {
+            result.push_back(entry.second);
+        }
+
+        return result;
+    }
+
+    /**
+     * Writes the recorded operations of all threads, oldest first.
+     */
+    static void dump(std::ostream &out) {
+        auto records = entries();
+        out << "Dot flight recorder: last " << records.size() << " container operations" << std::endl;
+        for (const auto &record : records) {
+            out << std::right << std::setw(12) << ("-" + formatNanos(record.nanosAgo)) << "  thread "
+                << std::left << std::setw(4) << record.thread << std::setw(18) << operationName(record.operation)
+                << std::setw(40) << (record.type ? TypeKey::demangle(*record.type) : "-") << " id "
+                << std::setw(8) << record.id << std::setw(16) << outcomeName(record.outcome) << "container "
+                << record.container << std::endl;
+        }
+    }
+
+    static bool dump(const std::string &path) {
+        std::ofstream out(path.c_str(), std::ios::app);
+        dump(out);
+        return static_cast<bool>(out.flush());
+    }
+
+    /**
+     * Appends a dump to the given file whenever a ContainerException is thrown.  An empty path
+     * turns this off.
+     */
+    static void dumpOnException(const std::string &path) {
+        std::lock_guard<std::mutex> locker(exceptionMutex());
+        exceptionPath() = path;
+    }
+
+    /**
+     * Called by ContainerException when it is constructed.
+     */
+    static void exceptionThrown(const std::string &what) {
+        std::lock_guard<std::mutex> locker(exceptionMutex());
+        if (exceptionPath().empty()) {
+            return;
+        }
+
+        std::ofstream out(exceptionPath().c_str(), std::ios::app);
+        out << "ContainerException: " << what << std::endl;
+        dump(out);
+    }
+
+#if defined(DOT_POSIX)
+    /**
+     * Installs a handler that appends a dump to the given file when the signal is delivered.
+     * The dump is written with async-signal-safe calls only, ring by ring, with mangled type
+     * names.  With reraise set (for crash signals such as SIGSEGV or SIGABRT), the previous
+     * disposition is restored and the signal raised again once the dump is written.
+     */
+    static bool dumpOnSignal(int signal, const std::string &path, bool reraise = false) {
+        if (path.size() >= SIGNAL_PATH_SIZE || signal <= 0 || signal >= NSIG) {
+            return false;
+        }
+
+        // Start the calibration now, so the handler never has to.
+        calibrate();
+        std::copy(path.begin(), path.end(), signalPath());
+        signalPath()[path.size()] = '\0';
+        signalReraise()[signal] = reraise;
+
+        struct sigaction action;
+        std::memset(&action, 0, sizeof(action));
+        action.sa_handler = &handleSignal;
+        sigemptyset(&action.sa_mask);
+        return sigaction(signal, &action, &previousActions()[signal]) == 0;
+    }
+
+    /**
+     * Writes the rings to a file descriptor using only async-signal-safe calls.
+     */
+    static void dump(int fd) {
+        uint64_t now = ticks();
+        double nanosPerTick = calibrate();
+
+        writeText(fd, "Dot flight recorder (ns ago, thread, operation, outcome, id, type, container)\n");
+        for (Ring *ring = rings().load(std::memory_order_acquire); ring; ring = ring->next) {
+            uint64_t head = ring->head.load(std::memory_order_acquire);
+            uint64_t count = std::min<uint64_t>(head, DOT_FLIGHT_RECORDER_SIZE);
+            for (uint64_t position = head - count; position < head; position++) {
+                Record record;
+                uint64_t timestamp;
+                if (!read(ring->entries[position % DOT_FLIGHT_RECORDER_SIZE], record, timestamp)) {
+                    continue;
+                }
+
+                writeNumber(fd, now > timestamp ? static_cast<uint64_t>((now - timestamp) * nanosPerTick) : 0);
+                writeText(fd, " ");
+                writeNumber(fd, record.thread);
+                writeText(fd, " ");
+                writeText(fd, operationName(record.operation));
+                writeText(fd, " ");
+                writeText(fd, outcomeName(record.outcome));
+                writeText(fd, " ");
+                if (record.id < 0) {
+                    writeText(fd, "-");
+                }
+                writeNumber(fd, record.id < 0 ? -static_cast<int64_t>(record.id) : record.id);
+                writeText(fd, " ");
+                writeText(fd, record.type ? record.type->name() : "-");
+                writeText(fd, " 0x");
+                writeNumber(fd, reinterpret_cast<uintptr_t>(record.container), 16);
+                writeText(fd, "\n");
+            }
+        }
+    }
+#endif
+
+private:
+    struct Entry {
+        std::atomic<uint64_t> sequence;
+        std::atomic<uint64_t> timestamp;
+        std::atomic<const void *> container;
+        std::atomic<const std::type_info *> type;
+        std::atomic<uint64_t> packed;
+    };
+
+    struct Ring {
+        Entry entries[DOT_FLIGHT_RECORDER_SIZE];
+        std::atomic<uint64_t> head;
+        std::atomic<bool> inUse;
+        uint32_t thread;
+        Ring *next;
+    };
+
+    /**
+     * Releases the thread's ring for reuse when the thread exits.
+     */
+    class RingOwner {
+    public:
+        RingOwner(Ring *ring) :
+                _ring(ring) {
+
+        }
+
+        ~RingOwner() {
+            _ring->inUse.store(false, std::memory_order_release);
+        }
+
+    private:
+        Ring *_ring;
+    };
+
+    static std::atomic<Ring *> &rings() {
+        static std::atomic<Ring *> rings(nullptr);
+        return rings;
+    }
+
+    static Ring &current() {
+        static thread_local Ring *ring = nullptr;
+        if (!ring) {
+            ring = acquire();
+            static thread_local RingOwner owner(ring);
+        }
+
+        return *ring;
+    }
+
+    /**
+     * Takes over the ring of an exited thread, or adds a new ring.  Rings are never freed, so
+     * readers can walk the list without locking.
+     */
+    static Ring *acquire() {
+        calibrate();
+        for (Ring *ring = rings().load(std::memory_order_acquire); ring; ring = ring->next) {
+            bool free = false;
+            if (ring->inUse.compare_exchange_strong(free, true, std::memory_order_acq_rel)) {
+                ring->thread = threadNumber();
+                return ring;
+            }
+        }
+
+        Ring *ring = new Ring();
+        ring->head.store(0, std::memory_order_relaxed);
+        ring->inUse.store(true, std::memory_order_relaxed);
+        ring->thread = threadNumber();
+        ring->next = rings().load(std::memory_order_relaxed);
+        while (!rings().compare_exchange_weak(ring->next, ring, std::memory_order_acq_rel)) {
+        }
+
+        return ring;
+    }
+
+    static uint64_t pack(Operation operation, Outcome outcome, uint32_t thread, int id) {
+        return static_cast<uint64_t>(static_cast<uint8_t>(operation)) << 56 |
+               static_cast<uint64_t>(static_cast<uint8_t>(outcome)) << 48 |
+               static_cast<uint64_t>(thread & 0xffff) << 32 |
+               static_cast<uint32_t>(id);
+    }
+
+    /**
+     * Reads an entry, returning false if it is empty or was being written.
+     */
+    static bool read(const Entry &entry, Record &record, uint64_t &timestamp) {
+        uint64_t before = entry.sequence.load(std::memory_order_acquire);
+        if (before == 0 || before % 2) {
+            return false;
+        }
+
+        timestamp = entry.timestamp.load(std::memory_order_relaxed);
+        record.container = entry.container.load(std::memory_order_relaxed);
+        record.type = entry.type.load(std::memory_order_relaxed);
+        uint64_t packed = entry.packed.load(std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (entry.sequence.load(std::memory_order_relaxed) != before) {
+            return false;
+        }
+
+        record.operation = static_cast<Operation>(packed >> 56);
+        record.outcome = static_cast<Outcome>((packed >> 48) & 0xff);
+        record.thread = static_cast<uint32_t>((packed >> 32) & 0xffff);
+        record.id = static_cast<int>(static_cast<uint32_t>(packed));
+        record.nanosAgo = 0;
+        return true;
+    }
+
+    /**
+     * A cheap timestamp: the TSC on x86, otherwise the monotonic clock in nanoseconds.
+     */
+    static uint64_t ticks() {
+#if defined(__x86_64__) || defined(__i386__)
+        return __rdtsc();
+#else
+        return monotonicNanos();
+#endif
+    }
+
+    struct Calibration {
+        // Constant-initialized, so calibration() takes no guard and is safe in a signal handler.
+        constexpr Calibration() :
+                ticks(0),
+                nanos(0),
+                nanosPerTickBits(0) {
+
+        }
+
+        std::atomic<uint64_t> ticks;
+        std::atomic<uint64_t> nanos;
+        std::atomic<uint64_t> nanosPerTickBits;
+    };
+
+    static Calibration &calibration() {
+        static Calibration calibration;
+        return calibration;
+    }
+
+    /**
+     * Measures the tick rate against the monotonic clock since the first ring was created.
+     */
+    static double calibrate() {
+#if defined(__x86_64__) || defined(__i386__)
+        Calibration &state = calibration();
+        uint64_t nanos = monotonicNanos();
+        uint64_t now = ticks();
+        uint64_t expected = 0;
+        if (state.ticks.compare_exchange_strong(expected, now)) {
+            state.nanos.store(nanos);
+            return 1.0;
+        }
+
+        uint64_t elapsedTicks = now - state.ticks.load();
+        uint64_t elapsedNanos = nanos - state.nanos.load();
+        if (elapsedTicks < 1000000) {
+            return calibrated();
+        }
+
+        double rate = static_cast<double>(elapsedNanos) / elapsedTicks;
+        uint64_t bits;
+        std::memcpy(&bits, &rate, sizeof(bits));
+        state.nanosPerTickBits.store(bits);
+        return rate;
+#else
+        return 1.0;
+#endif
+    }
+
+    /**
+     * Returns the last calibrated tick rate without reading any clocks.
+     */
+    static double calibrated() {
+#if defined(__x86_64__) || defined(__i386__)
+        uint64_t bits = calibration().nanosPerTickBits.load();
+        if (!bits) {
+            return 1.0;
+        }
+
+        double rate;
+        std::memcpy(&rate, &bits, sizeof(rate));
+        return rate;
+#else
+        return 1.0;
+#endif
+    }
+
+    static std::mutex &exceptionMutex() {
+        static std::mutex mutex;
+        return mutex;
+    }
+
+    static std::string &exceptionPath() {
+        static std::string path;
+        return path;
+    }
+
+#if defined(DOT_POSIX)
+    static const size_t SIGNAL_PATH_SIZE = 4096;
+
+    static char *signalPath() {
+        static char path[SIGNAL_PATH_SIZE];
+        return path;
+    }
+
+    static bool *signalReraise() {
+        static bool reraise[NSIG];
+        return reraise;
+    }
+
+    static struct sigaction *previousActions() {
+        static struct sigaction actions[NSIG];
+        return actions;
+    }
+
+    static void handleSignal(int signal) {
+        int fd = open(signalPath(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+        if (fd >= 0) {
+            dump(fd);
+            close(fd);
+        }
+
+        if (signalReraise()[signal]) {
+            sigaction(signal, &previousActions()[signal], nullptr);
+            raise(signal);
+        }
+    }
+
+    static void writeText(int fd, const char *text) {
+        size_t length = 0;
+        while (text[length]) {
+            length++;
+        }
+
+        while (length > 0) {
+            ssize_t written = write(fd, text, length);
+            if (written <= 0) {
+                return;
+            }
+
+            text += written;
+            length -= written;
+        }
+    }
+
+    static void writeNumber(int fd, uint64_t value, unsigned base = 10) {
+        char buffer[24];
+        char *position = buffer + sizeof(buffer) - 1;
+        *position = '\0';
+        do {
+            *--position = "0123456789abcdef"[value % base];
+            value /= base;
+        } while (value);
+
+        writeText(fd, position);
+    }
+#endif
+};
+
+/**
+ * Base exception class used for catching container exceptions.
+ */
+class ContainerException : public std::runtime_error {
+public:
+    ContainerException(const std::string &what) :
+            std::runtime_error(what) {
+#ifndef DOT_DISABLE_FLIGHT_RECORDER
+        FlightRecorder::exceptionThrown(what);
+#endif
+    }
+};
+
+/**
+ * Base of the factories for one service type, whatever their config.
+ */
+template<typename Type>
+class TypedFactory : public BaseFactory {
+public:
+    /**
+     * Disposes of an object returned by generateUnique().  Override it along with generate()
+     * to recycle objects through a pool or an arena.  Objects from generate() and
+     * registerService() are still released with delete.
+     */
+    virtual void destroy(Type *object) {
+        delete object;
+    }
+};
+
+/**
+ * Abstract factory object, used for generating objects of the specified types using
+ * a given configuration.
+ */
+template<typename Type, typename Config>
+class Factory : public TypedFactory<Type> {
+public:
+    typedef Type ServiceType;
+    typedef Config ConfigType;
+
+    /**
+     * Generates an object of the specified Type using the config object passed in.
+     */
+    virtual Type* generate(const Config &config) = 0;
+
+    /**
+     * Generates an object from a config the caller has given up, as with a temporary or
+     * std::move.  Defaults to the const version; MoveFactory overrides it to move the config
+     * into the object.  Factories that override only the const version should bring this one
+     * in with a using-declaration, or Clang's -Woverloaded-virtual reports it as hidden.
+     */
+    virtual Type* generate(Config &&config) {
+        return generate(static_cast<const Config &>(config));
+    }
+
+    /**
+     * Returns object-specific type info for the factory of the current type.
+     */
+    static std::type_index getTypeInfo() {
+        return std::type_index(typeid(Type));
+    }
+};
+
+/**
+ * Factory for configs worth moving, such as ones holding large tables.  Implement the rvalue
+ * generate() and move from the config; configs passed as lvalues are copied once and then
+ * moved.  With the forwarding registerService() and generate(), a config passed as an rvalue
+ * reaches the factory without being copied.
+ */
+template<typename Type, typename Config>
+class MoveFactory : public Factory<Type, Config> {
+public:
+    virtual Type *generate(Config &&config) = 0;
+
+    virtual Type *generate(const Config &config) {
+        Config copy(config);
+        return generate(std::move(copy));
+    }
+};
+
+/**
+ * Basic version of a factory.  This uses the EmptyConfig configuration type
+ * and will create an object using the default constructor.
+ */
+template<typename Type>
+class BasicFactory : public Factory<Type, EmptyConfig> {
+public:
+    using Factory<Type, EmptyConfig>::generate;
+
+    virtual Type *generate(const EmptyConfig &config)  {
+        return new Type;
+    };
+};
+
+template<typename Type, typename Config>
+class LambdaFactory : public Factory<Type, Config> {
+public:
+    using Factory<Type, Config>::generate;
+
+    LambdaFactory(std::function<Type *(const Config &config)> lambda) :
+            _lambda(lambda) {
+
+    }
+
+    virtual Type *generate(const Config &config)  {
+        return _lambda(config);
+    };
+
+private:
+    std::function<Type *(const Config &config)> _lambda;
+};
+
+/**
+ * Deleter for generateUnique() results.  Hands the object back to the factory that made it,
+ * and keeps that factory alive so the object may outlive its container, or the factory being
+ * replaced.  The price is a shared_ptr: the deleter is two pointers wide, and creating and
+ * destroying a UniquePtr each cost an atomic reference count update.  A raw pointer would
+ * leave a pooled factory's objects dangling once the container that pinned it is gone.
+ */
+template<typename Type>
+class FactoryDeleter {
+public:
+    FactoryDeleter() { }
+
+    explicit FactoryDeleter(std::shared_ptr<TypedFactory<Type>> factory) :
+            _factory(std::move(factory)) {
+
+    }
+
+    void operator()(Type *object) const {
+        if (_factory) {
+            _factory->destroy(object);
+        } else {
+            delete object;
+        }
+    }
+
+private:
+    std::shared_ptr<TypedFactory<Type>> _factory;
+};
+
+/**
+ * Uniquely owned object returned by generateUnique().
+ */
+template<typename Type>
+using UniquePtr = std::unique_ptr<Type, FactoryDeleter<Type>>;
+
+/**
+ * Optional check for services that outlive their container.  When enabled, each container
+ * looks at its services as it is destroyed and reports the ones still referenced from
+ * elsewhere, usually a shared_ptr from get() kept past the end of a request scope.  With call
+ * site capture on, get() also records a short backtrace per service (where the backtrace()
+ * call is available), so the report shows where the references were taken.  Reports go to
+ * std::cerr unless a handler is set.  Define DOT_DISABLE_LEAK_CHECK to remove the check.
+ */
+class LeakCheck {
+public:
+    static const int SITE_FRAMES = 8;
+    static const size_t MAX_SITES = 16;
+
+    /**
+     * A service that was still referenced when its container was destroyed.
+     */
+    struct Retained {
+        std::string type;
+        int id;
+
+        /** References held outside the container. */
+        long references;
+
+        /** The distinct get() call sites for the service, most frequent first. */
+        std::vector<std::string> sites;
+    };
+
+    struct Report {
+        const void *container;
+        int depth;
+        std::vector<Retained> services;
+    };
+
+    typedef std::function<void(const Report &)> Handler;
+
+    /**
+     * The get() call sites of one service.
+     */
+    class Sites {
+    public:
+        void add(void *const *frames, int depth) {
+            std::lock_guard<std::mutex> locker(_mutex);
+            for (auto &site : _sites) {
+                if (site.depth == depth && std::equal(frames, frames + depth, site.frames)) {
+                    site.count++;
+                    return;
+                }
+            }
+
+            if (_sites.size() < MAX_SITES) {
+                Site site = Site();
+                std::copy(frames, frames + depth, site.frames);
+                site.depth = depth;
+                site.count = 1;
+                _sites.push_back(site);
+            } else {
+                _other++;
+            }
+        }
+
+        std::vector<std::string> describe() const {
+            std::lock_guard<std::mutex> locker(_mutex);
+            std::vector<Site> sites(_sites);
+            std::sort(sites.begin(), sites.end(), [](const Site &a, const Site &b) {
+                return a.count > b.count;
+            });
+
+            std::vector<std::string> result;
+            for (const auto &site : sites) {
+                result.push_back(std::to_string(site.count) + "x " + symbolize(site.frames, site.depth));
+            }
+
+            if (_other) {
+                result.push_back(std::to_string(_other) + "x from other call sites");
+            }
+
+            return result;
+        }
+
+    private:
+        struct Site {
+            void *frames[SITE_FRAMES];
+            int depth;
+            uint64_t count;
+        };
+
+        mutable std::mutex _mutex;
+        std::vector<Site> _sites;
+        uint64_t _other = 0;
+    };
+
+    /**
+     * Turns the check on, optionally with call site capture in get().
+     */
+    static void enable(bool captureSites = false) {
+        state().store(captureSites ? CAPTURING : ENABLED, std::memory_order_relaxed);
+    }
+
+    static void disable() {
+        state().store(DISABLED, std::memory_order_relaxed);
+    }
+
+    static bool isEnabled() {
+#ifndef DOT_DISABLE_LEAK_CHECK
+        return state().load(std::memory_order_relaxed) != DISABLED;
+#else
+        return false;
+#endif
+    }
+
+    static bool isCapturingSites() {
+#ifndef DOT_DISABLE_LEAK_CHECK
+        return state().load(std::memory_order_relaxed) == CAPTURING;
+#else
+        return false;
+#endif
+    }
+
+    /**
+     * Sets the function that receives reports.  An empty handler restores the default, which
+     * writes them to std::cerr.
+     */
+    static void setHandler(Handler handler) {
+        std::lock_guard<std::mutex> locker(handlerMutex());
+        currentHandler() = handler;
+    }
+
+    /**
+     * Returns the number of retained services reported since the process started.
+     */
+    static uint64_t retainedCount() {
+        return retained().load(std::memory_order_relaxed);
+    }
+
+    /**
+     * Records the caller of get() for the given sites, allocating them on first use.
+     */
+    static void capture(std::atomic<Sites *> &sites) {
+        Sites *current = sites.load(std::memory_order_acquire);
+        if (!current) {
+            Sites *created = new Sites;
+            if (sites.compare_exchange_strong(current, created, std::memory_order_acq_rel)) {
+                current = created;
+            } else {
+                delete created;
+            }
+        }
+
+#if defined(DOT_BACKTRACE)
+        void *frames[SITE_FRAMES + 1];
+        int depth = backtrace(frames, SITE_FRAMES + 1);
+
+        // Skip this function's own frame.
+        if (depth > 1) {
+            current->add(frames + 1, depth - 1);
+        }
+#endif
+    }
+
+    /**
+     * Passes a report to the handler.  Called by a container being destroyed.
+     */
+    static void report(const Report &report) {
+        retained().fetch_add(report.services.size(), std::memory_order_relaxed);
+
+        std::lock_guard<std::mutex> locker(handlerMutex());
+        if (currentHandler()) {
+            currentHandler()(report);
+        } else {
+            write(std::cerr, report);
+        }
+    }
+
+    static void write(std::ostream &out, const Report &report) {
+        out << "Dot: " << report.services.size() << " service(s) still referenced when "
+            << (report.depth ? "scope " : "container ") << report.container << " (depth " << report.depth
+            << ") was destroyed" << std::endl;
+        for (const auto &service : report.services) {
+            out << "  " << service.type << " id " << service.id << ": " << service.references
+                << " reference(s)" << std::endl;
+            for (const auto &site : service.sites) {
+                out << "    get() " << site << std::endl;
+            }
+        }
+    }
+
+private:
+    enum State {
+        DISABLED,
+        ENABLED,
+        CAPTURING
+    };
+
+    static std::atomic<int> &state() {
+        static std::atomic<int> state(DISABLED);
+        return state;
+    }
+
+    static std::atomic<uint64_t> &retained() {
+        static std::atomic<uint64_t> retained(0);
+        return retained;
+    }
+
+    static std::mutex &handlerMutex() {
+        static std::mutex mutex;
+        return mutex;
+    }
+
+    static Handler &currentHandler() {
+        static Handler handler;
+        return handler;
+    }
+
+    /**
+     * Formats a backtrace as "function <- caller <- ...", demangling where possible.
+     */
+    static std::string symbolize(void *const *frames, int depth) {
+        std::string result;
+#if defined(DOT_BACKTRACE)
+        char **symbols = backtrace_symbols(frames, depth);
+        for (int i = 0; i < depth; i++) {
+            std::string symbol = symbols ? symbols[i] : "?";
+
+            // glibc formats symbols as "binary(function+offset) [address]".
+            size_t open = symbol.find('(');
+            size_t plus = symbol.find('+', open);
+            if (open != std::string::npos && plus != std::string::npos && plus > open + 1) {
+                std::string function = symbol.substr(open + 1, plus - open - 1);
+#if defined(__GNUG__)
+                int status = 0;
+                char *demangled = abi::__cxa_demangle(function.c_str(), nullptr, nullptr, &status);
+                if (status == 0 && demangled) {
+                    function = demangled;
+                }
+                std::free(demangled);
+#endif
+                symbol = function;
+            }
+
+            result += (i ? " <- " : "") + symbol;
+        }
+
+        std::free(symbols);
+#endif
+        return result;
+    }
+};
+
+/**
+ * Size hook for memory accounting.  Returns the bytes used by a service; the default is its
+ * shallow size.  Specialize it to include memory the service owns:
+ *
+ *     template<>
+ *     struct ServiceSize<Cache> {
+ *         static size_t of(const Cache &cache) {
+ *             return sizeof(Cache) + cache.capacity() * sizeof(Cache::Entry);
+ *         }
+ *     };
+ */
+template<typename Type>
+struct ServiceSize {
+    static size_t of(const Type & /* service */) {
+        return sizeof(Type);
+    }
+};
+
+/**
+ * Bytes used by a single container, as returned by Container::memoryUsage().  The overhead of
+ * the container itself is kept apart from the services it holds.  Figures are estimates: map
+ * nodes and shared_ptr control blocks are counted at their typical size on 64-bit libstdc++
+ * and libc++, without allocator headers.
+ */
+struct MemoryUsage {
+    struct Type {
+        const std::type_info *type;
+        size_t count;
+
+        /** The wrappers and control blocks of the services of this type. */
+        size_t overhead;
+
+        size_t services;
+    };
+
+    /** The Container object and its registry object. */
+    size_t container;
+
+    /** Registry storage: map nodes, or slots and index buckets.  Forks count their own layer. */
+    size_t registry;
+
+    /** The wrapper around each service and the control blocks of the wrapper and service. */
+    size_t wrappers;
+
+    /** The factory map.  Scopes share their root's, so it is only counted for the root. */
+    size_t factories;
+
+    /** The services themselves, as reported by ServiceSize. */
+    size_t services;
+
+    size_t count;
+    std::vector<Type> types;
+
+    /**
+     * Returns the bytes used by Dot itself rather than by the services.
+     */
+    size_t overhead() const {
+        return container + registry + wrappers + factories;
+    }
+
+    void write(std::ostream &out) const {
+        out << "Dot memory: " << count << " services, " << overhead() << " B overhead (container "
+            << container << " B, registry " << registry << " B, wrappers " << wrappers << " B, factories "
+            << factories << " B), " << services << " B in services" << std::endl;
+        for (const auto &type : types) {
+            out << "  " << std::left << std::setw(40) << TypeKey::demangle(*type.type) << std::right
+                << std::setw(8) << type.count << std::setw(12) << type.overhead << " B overhead"
+                << std::setw(12) << type.services << " B" << std::endl;
+        }
+    }
+};
+
+/**
+ * Optional base for services that carry their own reference count.  Services derived from it
+ * are held through an IntrusivePtr instead of a shared_ptr, so registering one allocates no
+ * separate control block and get() hands out a single pointer.  The count starts at zero and
+ * the service deletes itself when the last IntrusivePtr lets go of it.
+ */
+class RefCounted {
+public:
+    void retain() const {
+        _references.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    /**
+     * Drops a reference and returns true if it was the last one.
+     */
+    bool release() const {
+        return _references.fetch_sub(1, std::memory_order_acq_rel) == 1;
+    }
+
+    long useCount() const {
+        return _references.load(std::memory_order_relaxed);
+    }
+
+protected:
+    RefCounted() :
+            _references(0) {
+
+    }
+
+    // A copy is a new object, so it starts without references.
+    RefCounted(const RefCounted &) :
+            _references(0) {
+
+    }
+
+    RefCounted &operator=(const RefCounted &) {
+        return *this;
+    }
+
+    virtual ~RefCounted() { }
+
+private:
+    mutable std::atomic<long> _references;
+};
+
+/**
+ * Ownership hook: types for which value is true are stored and returned through IntrusivePtr.
+ * The default covers RefCounted.  Specialize it for a type that keeps its own count:
+ *
+ *     template<>
+ *     struct Intrusive<Connection> {
+ *         static const bool value = true;
+ *         static void retain(const Connection *connection) { connection->addRef(); }
+ *         static void release(const Connection *connection) { connection->unref(); }
+ *         static long useCount(const Connection *connection) { return connection->refs(); }
+ *     };
+ *
+ * release() is responsible for deleting the object once the count reaches zero.
+ */
+template<typename Type>
+struct Intrusive {
+    static const bool value = std::is_base_of<RefCounted, Type>::value;
+
+    static void retain(const Type *object) {
+        object->retain();
+    }
+
+    static void release(const Type *object) {
+        if (object->release()) {
+            delete object;
+        }
+    }
+
+    static long useCount(const Type *object) {
+        return object->useCount();
+    }
+};
+
+/**
+ * Single-word owning pointer for intrusive services.  Mirrors the parts of the shared_ptr
+ * interface that callers of get() use, so code switching a type to RefCounted keeps compiling
+ * as long as it uses auto or ServicePtr.
+ */
+template<typename Type>
+class IntrusivePtr {
+public:
+    IntrusivePtr() :
+            _object(nullptr) {
+
+    }
+
+    IntrusivePtr(std::nullptr_t) :
+            _object(nullptr) {
+
+    }
+
+    explicit IntrusivePtr(Type *object) :
+            _object(object) {
+        if (_object) {
+            Intrusive<Type>::retain(_object);
+        }
+    }
+
+    IntrusivePtr(const IntrusivePtr &other) :
+            IntrusivePtr(other._object) {
+
+    }
+
+    IntrusivePtr(IntrusivePtr &&other) :
+            _object(other._object) {
+        other._object = nullptr;
+    }
+
+    template<typename Other>
+    IntrusivePtr(const IntrusivePtr<Other> &other) :
+            IntrusivePtr(other.get()) {
+
+    }
+
+    ~IntrusivePtr() {
+        reset();
+    }
+
+    IntrusivePtr &operator=(IntrusivePtr other) {
+        swap(other);
+        return *this;
+    }
+
+    Type *get() const {
+        return _object;
+    }
+
+    Type &operator*() const {
+        return *_object;
+    }
+
+    Type *operator->() const {
+        return _object;
+    }
+
+    explicit operator bool() const {
+        return _object != nullptr;
+    }
+
+    long use_count() const {
+        return _object ? Intrusive<Type>::useCount(_object) : 0;
+    }
+
+    void reset() {
+        if (_object) {
+            Type *object = _object;
+            _object = nullptr;
+            Intrusive<Type>::release(object);
+        }
+    }
+
+    void swap(IntrusivePtr &other) {
+        std::swap(_object, other._object);
+    }
+
+    friend bool operator==(const IntrusivePtr &a, const IntrusivePtr &b) {
+        return a._object == b._object;
+    }
+
+    friend bool operator!=(const IntrusivePtr &a, const IntrusivePtr &b) {
+        return a._object != b._object;
+    }
+
+private:
+    Type *_object;
+};
+
+/**
+ * The pointer a container stores and returns for a service type: IntrusivePtr for intrusive
+ * types and shared_ptr for everything else.
+ */
+template<typename Type>
+using ServicePtr = typename std::conditional<Intrusive<Type>::value, IntrusivePtr<Type>, std::shared_ptr<Type>>::type;
+
+/**
+ * Non-owning reference to a ServicePtr, as kept by the inject cache.  Intrusive services have
+ * no weak count to check, so for them it holds nothing and lock() always comes back empty.
+ */
+template<typename Type, bool = Intrusive<Type>::value>
+class WeakServicePtr {
+public:
+    WeakServicePtr &operator=(const std::shared_ptr<Type> &object) {
+        _object = object;
+        return *this;
+    }
+
+    std::shared_ptr<Type> lock() const {
+        return _object.lock();
+    }
+
+private:
+    std::weak_ptr<Type> _object;
+};
+
+template<typename Type>
+class WeakServicePtr<Type, true> {
+public:
+    WeakServicePtr &operator=(const IntrusivePtr<Type> &) {
+        return *this;
+    }
+
+    IntrusivePtr<Type> lock() const {
+        return IntrusivePtr<Type>();
+    }
+};
+
+/**
+ * Storage for a value service.  Values of 1, 2, 4 or 8 bytes are kept in a std::atomic;
+ * larger ones behind a sequence lock, with readers retrying while a write is in progress.
+ * Neither path takes a lock or touches a reference count on read.
+ */
+template<typename Type, bool Atomic = sizeof(Type) == 1 || sizeof(Type) == 2 || sizeof(Type) == 4 ||
+                                      sizeof(Type) == 8>
+class ValueCell {
+public:
+    explicit ValueCell(const Type &value) :
+            _value(value) {
+
+    }
+
+    Type load() const {
+        return _value.load(std::memory_order_acquire);
+    }
+
+    void store(const Type &value) {
+        _value.store(value, std::memory_order_release);
+    }
+
+private:
+    std::atomic<Type> _value;
+};
+
+template<typename Type>
+class ValueCell<Type, false> {
+public:
+    explicit ValueCell(const Type &value) :
+            _sequence(0) {
+        store(value);
+    }
+
+    Type load() const {
+        uint64_t words[WORDS];
+        uint32_t sequence;
+        do {
+            sequence = _sequence.load(std::memory_order_acquire);
+            for (size_t i = 0; i < WORDS; i++) {
+                words[i] = _words[i].load(std::memory_order_relaxed);
+            }
+
+            std::atomic_thread_fence(std::memory_order_acquire);
+        } while ((sequence & 1) || sequence != _sequence.load(std::memory_order_relaxed));
+
+        // Copied through raw storage, as Type need not be default constructible.
+        typename std::aligned_storage<sizeof(Type), alignof(Type)>::type storage;
+        std::memcpy(&storage, words, sizeof(Type));
+        return *reinterpret_cast<const Type *>(&storage);
+    }
+
+    void store(const Type &value) {
+        uint64_t words[WORDS] = {};
+        std::memcpy(words, &value, sizeof(Type));
+
+        // An odd sequence marks a write in progress; taking it also keeps writers apart.
+        uint32_t sequence = _sequence.load(std::memory_order_relaxed);
+        while ((sequence & 1) || !_sequence.compare_exchange_weak(sequence, sequence + 1, std::memory_order_acquire)) {
+            sequence = _sequence.load(std::memory_order_relaxed);
+        }
+
+        std::atomic_thread_fence(std::memory_order_release);
+        for (size_t i = 0; i < WORDS; i++) {
+            _words[i].store(words[i], std::memory_order_relaxed);
+        }
+
+        _sequence.store(sequence + 2, std::memory_order_release);
+    }
+
+private:
+    static const size_t WORDS = (sizeof(Type) + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+
+    std::atomic<uint32_t> _sequence;
+    std::atomic<uint64_t> _words[WORDS];
+};
+
+/**
+ * Handle to a value service, from Container::valueHandle().  It refers to the value's storage
+ * directly, so get() is a single atomic load (or sequence-locked copy) with no lookup, lock or
+ * reference counting, and set() updates the value for every reader.  The handle keeps the
+ * storage alive: after the value is unregistered it keeps the last value, detached from the
+ * container.  A handle taken before a fork() keeps referring to the value the fork shares.
+ */
+template<typename Type>
+class ValueHandle {
+public:
+    ValueHandle() { }
+
+    explicit ValueHandle(std::shared_ptr<ValueCell<Type>> cell) :
+            _cell(std::move(cell)) {
+
+    }
+
+    Type get() const {
+        return _cell->load();
+    }
+
+    void set(const Type &value) const {
+        _cell->store(value);
+    }
+
+    explicit operator bool() const {
+        return _cell != nullptr;
+    }
+
+private:
+    std::shared_ptr<ValueCell<Type>> _cell;
+};
+
+class Container;
+
+/**
+ * Describes a container event passed to a ContainerObserver.  Fields that don't apply to an
+ * event are left as nullptr or zero.
+ */
+struct ContainerEvent {
+    /** The container the operation was made on. */
+    const Container *container;
+
+    const TypeKey *type;
+    int id;
+
+    /** The factory configuration type, for factory events. */
+    const std::type_info *config;
+
+    /** The operation that invoked a factory (registerService or generate). */
+    Operation operation;
+
+    /** For resolves, whether the service was found and how many parents were walked. */
+    bool hit;
+    int depth;
+
+    /** For registrations, whether an existing service was replaced. */
+    bool overwritten;
+
+    /** For finished factory invocations, the time spent in the factory. */
+    uint64_t nanos;
+
+    /** For registrations and factory events, the size of the service type in bytes. */
+    size_t size;
+};
+
+/**
+ * Receives container events, for plugging Dot into tracing and debugging tools.  Callbacks are
+ * made synchronously on the thread performing the operation; most are made with the container
+ * mutex held, so an observer must not call back into the container that raised the event.
+ */
+class ContainerObserver {
+public:
+    virtual ~ContainerObserver() { }
+
+    /**
+     * A service was registered, either directly or through a factory.
+     */
+    virtual void onRegister(const ContainerEvent & /* event */) { }
+
+    virtual void onUnregister(const ContainerEvent & /* event */) { }
+
+    /**
+     * A factory is about to be invoked.  onFactoryEnd follows on the same thread, unless the
+     * factory throws.
+     */
+    virtual void onFactoryBegin(const ContainerEvent & /* event */) { }
+
+    virtual void onFactoryEnd(const ContainerEvent & /* event */) { }
+
+    /**
+     * A get() call completed, whether or not the service was found.
+     */
+    virtual void onResolve(const ContainerEvent & /* event */) { }
+
+    /**
+     * A scope was created from the given parent.
+     */
+    virtual void onScopeCreate(const Container & /* scope */, const Container & /* parent */) { }
+
+    /**
+     * A container was forked from the source, starting out with the source's services.  Its
+     * destruction is reported by onScopeDestroy.
+     */
+    virtual void onFork(const Container & /* fork */, const Container & /* source */) { }
+
+    /**
+     * A scope or fork is being destroyed.
+     */
+    virtual void onScopeDestroy(const Container & /* scope */) { }
+};
+
+/**
+ * The set of installed observers.  With no observer installed, each event costs a single
+ * predictable branch on a null pointer; define DOT_DISABLE_OBSERVERS to remove the events
+ * entirely.
+ */
+class Observers {
+public:
+    typedef std::vector<ContainerObserver *> List;
+
+    /**
+     * The installed observers as returned by active(), kept alive for as long as the object
+     * is.  Evaluates to false when there are none.
+     */
+    class Active {
+    public:
+        Active() :
+                _list(nullptr),
+                _parity(0) {
+#ifndef DOT_DISABLE_OBSERVERS
+            if (!list().load(std::memory_order_relaxed)) {
+                return;
+            }
+
+            // Announce the reader before loading the list, so remove() waits for it.
+            _parity = phase().load() & 1;
+            readers(_parity).fetch_add(1);
+            _list = list().load();
+            if (!_list) {
+                readers(_parity).fetch_sub(1, std::memory_order_release);
+            }
+#endif
+        }
+
+        ~Active() {
+            if (_list) {
+                readers(_parity).fetch_sub(1, std::memory_order_release);
+            }
+        }
+
+        Active(Active &&other) :
+                _list(other._list),
+                _parity(other._parity) {
+            other._list = nullptr;
+        }
+
+        Active(const Active &) = delete;
+        void operator =(const Active &) = delete;
+
+        explicit operator bool() const {
+            return _list != nullptr;
+        }
+
+        const List &operator *() const {
+            return *_list;
+        }
+
+    private:
+        const List *_list;
+        unsigned _parity;
+    };
+
+    /**
+     * Installs an observer.  The observer must stay alive until it is removed.  Observers
+     * can't be added or removed from inside an observer callback.
+     */
+    static void add(ContainerObserver *observer) {
+        std::lock_guard<std::mutex> locker(mutex());
+        List list = current() ? *current() : List();
+        list.push_back(observer);
+        publish(list);
+    }
+
+    static void remove(ContainerObserver *observer) {
+        std::lock_guard<std::mutex> locker(mutex());
+        List list = current() ? *current() : List();
+        list.erase(std::remove(list.begin(), list.end(), observer), list.end());
+        publish(list);
+    }
+
+    /**
+     * Returns the installed observers.
+     */
+    static Active active() {
+        return Active();
+    }
+
+private:
+    static std::atomic<const List *> &list() {
+        static std::atomic<const List *> list(nullptr);
+        return list;
+    }
+
+    static const List *current() {
+        return list().load(std::memory_order_relaxed);
+    }
+
+    static std::mutex &mutex() {
+        static std::mutex mutex;
+        return mutex;
+    }
+
+    /**
+     * Readers announce themselves in one of two counters, picked by the phase they saw.
+     */
+    static std::atomic<unsigned> &phase() {
+        static std::atomic<unsigned> phase(0);
+        return phase;
+    }
+
+    static std::atomic<uint64_t> &readers(unsigned parity) {
+        static std::atomic<uint64_t> readers[2] = { { 0 }, { 0 } };
+        return readers[parity];
+    }
+
+    /**
+     * Lists are immutable once published.  A replaced list is freed once every reader that
+     * may have loaded it is done: each of the two phases is retired in turn, waiting for its
+     * readers to leave, which covers readers that announced themselves in either phase.
+     * Lists are only allocated when observers are added or removed.
+     */
+    static void publish(const List &observers) {
+        const List *previous = current();
+        list().store(observers.empty() ? nullptr : new List(observers));
+        if (!previous) {
+            return;
+        }
+
+        for (int flip = 0; flip < 2; flip++) {
+            unsigned retired = phase().fetch_add(1) & 1;
+            while (readers(retired).load()) {
+                std::this_thread::yield();
+            }
+        }
+
+        delete previous;
+    }
+};
+
+/**
+ *
+ */
+class Container : public std::enable_shared_from_this<Container> {
+    /** A shared_ptr control block: a vtable pointer and the use and weak counts. */
+    static const size_t CONTROL_BLOCK_BYTES = sizeof(void *) + 2 * sizeof(int);
+
+    /** A red-black tree node header: color and parent, left and right pointers. */
+    static const size_t MAP_NODE_BYTES = 4 * sizeof(void *);
+
+    /**
+     * Mixes a type hash and id into a hash table index.
+     */
+    static size_t mix(size_t hash, int id) {
+        uint64_t h = (static_cast<uint64_t>(hash) ^ static_cast<uint32_t>(id)) * 0x9e3779b97f4a7c15ULL;
+        return static_cast<size_t>(h ^ (h >> 32));
+    }
+
+    class BaseObjectContainer {
+    public:
+        BaseObjectContainer() :
+                sites(nullptr) {
+
+        }
+
+        virtual ~BaseObjectContainer() {
+            delete sites.load(std::memory_order_relaxed);
+        }
+
+        virtual const std::type_info &type() const = 0;
+
+        /**
+         * Returns the key the service is registered under.
+         */
+        virtual const TypeKey &key() const = 0;
+
+        /**
+         * Returns the number of references to the service, including the container's own.
+         */
+        virtual long useCount() const = 0;
+
+        /**
+         * Returns the bytes of the wrapper and the control blocks of the wrapper and service.
+         */
+        virtual size_t overhead() const = 0;
+
+        /**
+         * Returns the bytes of the service, as reported by ServiceSize.
+         */
+        virtual size_t serviceSize() const = 0;
+
+        /**
+         * Returns the service object, or nullptr for a value service.
+         */
+        virtual void *address() const = 0;
+
+        /** The get() call sites, when LeakCheck is capturing them. */
+        std::atomic<LeakCheck::Sites *> sites;
+    };
+
+    template<typename Type>
+    class ObjectContainer : public BaseObjectContainer {
+    public:
+        virtual ~ObjectContainer() { }
+
+        virtual const std::type_info &type() const {
+            return typeid(Type);
+        }
+
+        virtual const TypeKey &key() const {
+            return TypeKey::of<Type>();
+        }
+
+        virtual long useCount() const {
+            return object.use_count();
+        }
+
+        virtual size_t overhead() const {
+            // The wrapper shares its control block with make_shared, while a shared service has
+            // a separate one that also holds its pointer.  Intrusive services keep their count.
+            size_t service = Intrusive<Type>::value ? 0 : CONTROL_BLOCK_BYTES + sizeof(void *);
+            return sizeof(*this) + CONTROL_BLOCK_BYTES + service;
+        }
+
+        virtual size_t serviceSize() const {
+            return object ? ServiceSize<Type>::of(*object) : 0;
+        }
+
+        virtual void *address() const {
+            return const_cast<void *>(static_cast<const void *>(object.get()));
+        }
+
+        ServicePtr<Type> object;
+    };
+
+    /**
+     * Wrapper holding a value service inline, rather than a pointer to it.
+     */
+    template<typename Type>
+    class ValueContainer : public BaseObjectContainer {
+    public:
+        explicit ValueContainer(const Type &value) :
+                cell(value) {
+
+        }
+
+        virtual const std::type_info &type() const {
+            return typeid(Type);
+        }
+
+        virtual const TypeKey &key() const {
+            return TypeKey::of<Type>();
+        }
+
+        // Values are copied out rather than shared, so nothing can hold on to them.
+        virtual long useCount() const {
+            return 1;
+        }
+
+        virtual size_t overhead() const {
+            return sizeof(*this) - sizeof(Type) + CONTROL_BLOCK_BYTES;
+        }
+
+        virtual size_t serviceSize() const {
+            return sizeof(Type);
+        }
+
+        virtual void *address() const {
+            return nullptr;
+        }
+
+        ValueCell<Type> cell;
+    };
+
+    /**
+     * Storage for the services registered directly in a container, keyed by type and id.
+     * All registry calls are made with the container mutex held.
+     */
+    class BaseRegistry {
+    public:
+        virtual ~BaseRegistry() { }
+
+        /**
+         * Returns the stored service, or nullptr if there is none for the given key.
+         */
+        virtual std::shared_ptr<BaseObjectContainer> *find(const TypeKey &type, int id) = 0;
+
+        /**
+         * Stores a service, replacing any existing service with the same key.  Returns true if
+         * a service was replaced.
+         */
+        virtual bool insert(const TypeKey &type, int id, std::shared_ptr<BaseObjectContainer> container) = 0;
+
+        /**
+         * Removes a service, returning false if there was none for the given key.
+         */
+        virtual bool erase(const TypeKey &type, int id) = 0;
+
+        /**
+         * Returns the number of services stored.
+         */
+        virtual size_t size() const = 0;
+
+        /**
+         * Returns the bytes used by the registry's own storage, not counting the services.
+         */
+        virtual size_t memoryUsage() const = 0;
+
+        /**
+         * Calls the function with the id and object container of every stored service.
+         */
+        virtual void forEach(const std::function<void(int, BaseObjectContainer &)> &function) const = 0;
+
+        /**
+         * Releases any storage that is no longer used.
+         */
+        virtual void compact() { }
+
+        /**
+         * Returns true if the stored service is shared with another registry, so it has to be
+         * replaced rather than changed in place.
+         */
+        virtual bool shared(const TypeKey & /* type */, int /* id */) {
+            return false;
+        }
+    };
+
+    class OrderedRegistry : public BaseRegistry {
+    public:
+        virtual std::shared_ptr<BaseObjectContainer> *find(const TypeKey &type, int id) {
+            auto objects = _objects.find(type.index());
+            if (objects == _objects.end()) {
+                return nullptr;
+            }
+
+            auto object = objects->second.find(id);
+            return object == objects->second.end() ? nullptr : &object->second;
+        }
+
+        virtual bool insert(const TypeKey &type, int id, std::shared_ptr<BaseObjectContainer> container) {
+            auto &slot = _objects[type.index()][id];
+            bool replaced = slot != nullptr;
+            if (!replaced) {
+                _size++;
+            }
+
+            slot = container;
+            return replaced;
+        }
+
+        virtual bool erase(const TypeKey &type, int id) {
+            auto objects = _objects.find(type.index());
+            if (objects == _objects.end() || !objects->second.erase(id)) {
+                return false;
+            }
+
+            // Drop the per-type map once it is empty so unregistered types don't accumulate.
+            if (objects->second.empty()) {
+                _objects.erase(objects);
+            }
+
+            _size--;
+            return true;
+        }
+
+        virtual size_t size() const {
+            return _size;
+        }
+
+        virtual size_t memoryUsage() const {
+            typedef std::map<int, std::shared_ptr<BaseObjectContainer>> Objects;
+            size_t bytes = _objects.size() * (MAP_NODE_BYTES + sizeof(std::pair<const std::type_index, Objects>));
+            return bytes + _size * (MAP_NODE_BYTES + sizeof(Objects::value_type));
+        }
+
+        virtual void forEach(const std::function<void(int, BaseObjectContainer &)> &function) const {
+            for (const auto &objects : _objects) {
+                for (const auto &object : objects.second) {
+                    function(object.first, *object.second);
+                }
+            }
+        }
+
+    private:
+        std::map<std::type_index, std::map<int, std::shared_ptr<BaseObjectContainer>>> _objects;
+        size_t _size = 0;
+    };
+
+    /**
+     * Generational slot map.  Services live in a vector of slots and freed slots are chained
+     * into a free list for O(1) reuse, with a slot's generation bumped each time it is freed.
+     * Lookups go through an open-addressing index of (slot, generation) buckets, so neither
+     * structure allocates per service.  Both are rebuilt at their live size once enough of
+     * them has been freed, which keeps memory bounded under sustained churn.
+     */
+    class SlotRegistry : public BaseRegistry {
+        static const uint32_t NONE = 0xffffffff;
+        static const uint32_t EMPTY = 0xffffffff;
+        static const uint32_t TOMBSTONE = 0xfffffffe;
+        static const size_t COMPACT_INTERVAL = 1024;
+        static const size_t MIN_INDEX = 16;
+
+        struct Slot {
+            std::shared_ptr<BaseObjectContainer> container;
+            const std::type_info *type;
+            size_t hash;
+            int id;
+            uint32_t generation;
+            uint32_t nextFree;
+        };
+
+        struct Bucket {
+            uint32_t slot;
+            uint32_t generation;
+        };
+
+    public:
+        SlotRegistry() :
+                _index(MIN_INDEX, Bucket { EMPTY, 0 }) {
+
+        }
+
+        virtual std::shared_ptr<BaseObjectContainer> *find(const TypeKey &type, int id) {
+            size_t bucket = lookup(type, id);
+            return bucket == NONE ? nullptr : &_slots[_index[bucket].slot].container;
+        }
+
+        virtual bool insert(const TypeKey &type, int id, std::shared_ptr<BaseObjectContainer> container) {
+            size_t bucket = lookup(type, id);
+            if (bucket != NONE) {
+                _slots[_index[bucket].slot].container = container;
+                return true;
+            }
+
+            if ((_size + _tombstones + 1) * 2 > _index.size()) {
+                rebuildIndex(_size + 1);
+            }
+
+            // Reuse a freed slot if there is one.
+            uint32_t slot = _freeHead;
+            if (slot != NONE) {
+                _freeHead = _slots[slot].nextFree;
+            } else {
+                slot = static_cast<uint32_t>(_slots.size());
+                _slots.push_back(Slot { nullptr, nullptr, 0, 0, 0, NONE });
+            }
+
+            Slot &entry = _slots[slot];
+            entry.container = container;
+            entry.type = type.info;
+            entry.hash = type.hash;
+            entry.id = id;
+            entry.nextFree = NONE;
+
+            size_t mask = _index.size() - 1;
+            for (size_t i = mix(type.hash, id) & mask;; i = (i + 1) & mask) {
+                if (_index[i].slot == EMPTY || _index[i].slot == TOMBSTONE) {
+                    if (_index[i].slot == TOMBSTONE) {
+                        _tombstones--;
+                    }
+
+                    _index[i] = Bucket { slot, entry.generation };
+                    break;
+                }
+            }
+
+            _size++;
+            return false;
+        }
+
+        virtual bool erase(const TypeKey &type, int id) {
+            size_t bucket = lookup(type, id);
+            if (bucket == NONE) {
+                return false;
+            }
+
+            uint32_t slot = _index[bucket].slot;
+            _index[bucket].slot = TOMBSTONE;
+            _tombstones++;
+
+            Slot &entry = _slots[slot];
+            entry.container.reset();
+            entry.type = nullptr;
+            entry.generation++;
+            entry.nextFree = _freeHead;
+            _freeHead = slot;
+            _size--;
+
+            if (++_erasures % COMPACT_INTERVAL == 0) {
+                compactIfSparse();
+            }
+
+            return true;
+        }
+
+        virtual size_t size() const {
+            return _size;
+        }
+
+        virtual size_t memoryUsage() const {
+            return _slots.capacity() * sizeof(Slot) + _index.capacity() * sizeof(Bucket);
+        }
+
+        virtual void forEach(const std::function<void(int, BaseObjectContainer &)> &function) const {
+            for (const auto &entry : _slots) {
+                if (entry.container) {
+                    function(entry.id, *entry.container);
+                }
+            }
+        }
+
+        virtual void compact() {
+            compactSlots();
+            rebuildIndex(_size);
+        }
+
+    private:
+        std::vector<Slot> _slots;
+        std::vector<Bucket> _index;
+        uint32_t _freeHead = NONE;
+        size_t _size = 0;
+        size_t _tombstones = 0;
+        size_t _erasures = 0;
+
+        size_t lookup(const TypeKey &type, int id) const {
+            size_t mask = _index.size() - 1;
+            for (size_t i = mix(type.hash, id) & mask;; i = (i + 1) & mask) {
+                const Bucket &bucket = _index[i];
+                if (bucket.slot == EMPTY) {
+                    return NONE;
+                }
+
+                if (bucket.slot != TOMBSTONE) {
+                    const Slot &entry = _slots[bucket.slot];
+                    if (entry.generation == bucket.generation && entry.hash == type.hash &&
+                            entry.id == id && *entry.type == *type.info) {
+                        return i;
+                    }
+                }
+            }
+        }
+
+        void compactIfSparse() {
+            if (_slots.size() > 2 * _size + MIN_INDEX) {
+                compactSlots();
+            }
+
+            if (_tombstones > _index.size() / 4 || _index.size() > 8 * (_size + MIN_INDEX)) {
+                rebuildIndex(_size);
+            }
+        }
+
+        /**
+         * Moves the live slots into a right-sized vector and clears the free list.
+         */
+        void compactSlots() {
+            std::vector<Slot> slots;
+            slots.reserve(_size);
+            for (auto &entry : _slots) {
+                if (entry.type) {
+                    slots.push_back(std::move(entry));
+                }
+            }
+
+            _slots.swap(slots);
+            _freeHead = NONE;
+            rebuildIndex(_size);
+        }
+
+        /**
+         * Rebuilds the index with room for at least the given number of services.
+         */
+        void rebuildIndex(size_t capacity) {
+            size_t buckets = MIN_INDEX;
+            while (buckets < capacity * 4) {
+                buckets *= 2;
+            }
+
+            std::vector<Bucket>(buckets, Bucket { EMPTY, 0 }).swap(_index);
+            _tombstones = 0;
+
+            size_t mask = buckets - 1;
+            for (uint32_t slot = 0; slot < _slots.size(); slot++) {
+                const Slot &entry = _slots[slot];
+                if (!entry.type) {
+                    continue;
+                }
+
+                size_t i = mix(entry.hash, entry.id) & mask;
+                while (_index[i].slot != EMPTY) {
+                    i = (i + 1) & mask;
+                }
+
+                _index[i] = Bucket { slot, entry.generation };
+            }
+        }
+    };
+
+    /**
+     * Registry of a forked container: a private overlay in front of a base that is shared with
+     * other forks and never changes again.  Changes only touch the overlay, and base services
+     * that are unregistered are remembered as erased so they stay hidden.  Only the overlay is
+     * counted by memoryUsage(), since the base belongs to every container that shares it.
+     */
+    class LayeredRegistry : public BaseRegistry {
+        typedef std::pair<std::type_index, int> Key;
+
+    public:
+        LayeredRegistry(std::shared_ptr<BaseRegistry> base, BaseRegistry *overlay) :
+                _base(std::move(base)),
+                _overlay(overlay),
+                _size(_base->size()),
+                _layers(1) {
+            if (auto layered = dynamic_cast<LayeredRegistry *>(_base.get())) {
+                _layers += layered->_layers;
+            }
+        }
+
+        virtual std::shared_ptr<BaseObjectContainer> *find(const TypeKey &type, int id) {
+            if (auto entry = _overlay->find(type, id)) {
+                return entry;
+            }
+
+            return erased(type, id) ? nullptr : _base->find(type, id);
+        }
+
+        virtual bool insert(const TypeKey &type, int id, std::shared_ptr<BaseObjectContainer> container) {
+            bool replaced = find(type, id) != nullptr;
+            _overlay->insert(type, id, std::move(container));
+            if (!_erased.empty()) {
+                _erased.erase(Key(type.index(), id));
+            }
+
+            if (!replaced) {
+                _size++;
+            }
+
+            return replaced;
+        }
+
+        virtual bool erase(const TypeKey &type, int id) {
+            if (!find(type, id)) {
+                return false;
+            }
+
+            _overlay->erase(type, id);
+            if (_base->find(type, id)) {
+                _erased.insert(Key(type.index(), id));
+            }
+
+            _size--;
+            return true;
+        }
+
+        virtual size_t size() const {
+            return _size;
+        }
+
+        virtual size_t memoryUsage() const {
+            return _overlay->memoryUsage() + _erased.size() * (MAP_NODE_BYTES + sizeof(Key));
+        }
+
+        virtual void forEach(const std::function<void(int, BaseObjectContainer &)> &function) const {
+            _overlay->forEach(function);
+            _base->forEach([this, &function](int id, BaseObjectContainer &object) {
+                if (!_overlay->find(object.key(), id) && !erased(object.key(), id)) {
+                    function(id, object);
+                }
+            });
+        }
+
+        virtual void compact() {
+            _overlay->compact();
+        }
+
+        virtual bool shared(const TypeKey &type, int id) {
+            return !_overlay->find(type, id) && find(type, id);
+        }
+
+        /**
+         * Returns true if the service comes from a base that another registry still refers
+         * to, so it doesn't belong to this registry alone.
+         */
+        bool sharedWithOthers(const TypeKey &type, int id) const {
+            if (_overlay->find(type, id) || erased(type, id)) {
+                return false;
+            }
+
+            if (_base.use_count() > 1) {
+                return true;
+            }
+
+            auto layered = dynamic_cast<LayeredRegistry *>(_base.get());
+            return layered && layered->sharedWithOthers(type, id);
+        }
+
+        /**
+         * Returns true if nothing has changed since the registry was created.
+         */
+        bool pristine() const {
+            return _overlay->size() == 0 && _erased.empty();
+        }
+
+        const std::shared_ptr<BaseRegistry> &base() const {
+            return _base;
+        }
+
+        /**
+         * Returns the number of layered registries stacked here, including this one.
+         */
+        size_t layers() const {
+            return _layers;
+        }
+
+    private:
+        std::shared_ptr<BaseRegistry> _base;
+        std::unique_ptr<BaseRegistry> _overlay;
+        std::set<Key> _erased;
+        size_t _size;
+        size_t _layers;
+
+        bool erased(const TypeKey &type, int id) const {
+            return !_erased.empty() && _erased.count(Key(type.index(), id));
+        }
+    };
+
+    /**
+     * Read-only index of a frozen container, built by freeze().  The entries are packed into
+     * pages of their own, made read-only once filled, so the frozen read path never shares a
+     * page with data that is written and forked workers keep the index shared.  Each entry
+     * points straight at its service, so a lookup takes no lock and no reference count.
+     */
+    class FrozenIndex {
+    public:
+        struct Entry {
+            /** nullptr for an empty bucket. */
+            const std::type_info *type;
+            size_t hash;
+            int id;
+            void *object;
+        };
+
+        explicit FrozenIndex(const BaseRegistry &registry) :
+                _mask(15) {
+            while (_mask + 1 < registry.size() * 2) {
+                _mask = _mask * 2 + 1;
+            }
+
+            _bytes = (_mask + 1) * sizeof(Entry);
+#if defined(DOT_POSIX)
+            size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+            _bytes = (_bytes + page - 1) / page * page;
+            void *memory = mmap(nullptr, _bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (memory == MAP_FAILED) {
+                throw ContainerException("Failed to map the frozen index.");
+            }
+#else
+            void *memory = ::operator new(_bytes);
+            std::memset(memory, 0, _bytes);
+#endif
+            _entries = static_cast<Entry *>(memory);
+
+            registry.forEach([this](int id, BaseObjectContainer &container) {
+                size_t hash = std::type_index(container.type()).hash_code();
+                size_t i = mix(hash, id) & _mask;
+                while (_entries[i].type) {
+                    i = (i + 1) & _mask;
+                }
+
+                _entries[i] = Entry { &container.type(), hash, id, container.address() };
+            });
+
+#if defined(DOT_POSIX)
+            mprotect(memory, _bytes, PROT_READ);
+#endif
+        }
+
+        ~FrozenIndex() {
+#if defined(DOT_POSIX)
+            munmap(_entries, _bytes);
+#else
+            ::operator delete(_entries);
+#endif
+        }
+
+        FrozenIndex(const FrozenIndex &) = delete;
+        void operator =(const FrozenIndex &) = delete;
+
+        const Entry *find(const TypeKey &type, int id) const {
+            for (size_t i = mix(type.hash, id) & _mask;; i = (i + 1) & _mask) {
+                const Entry &entry = _entries[i];
+                if (!entry.type) {
+                    return nullptr;
+                }
+
+                if (entry.hash == type.hash && entry.id == id && (entry.type == type.info || *entry.type == *type.info)) {
+                    return &entry;
+                }
+            }
+        }
+
+        size_t memoryUsage() const {
+            return _bytes;
+        }
+
+    private:
+        Entry *_entries;
+        size_t _mask;
+        size_t _bytes;
+    };
+
+    /**
+     * Scoped lock on a container mutex.  While the LockProfiler is running, this records how
+     * long the lock was waited for and held.
+     */
+    class Lock {
+    public:
+        Lock(Container &container, Operation operation, const TypeKey *type, bool parent = false) :
+                _mutex(container._mutex),
+                _operation(operation),
+                _type(type),
+                _parent(parent),
+                _contended(false),
+                _wait(0),
+                _acquired(0) {
+#ifndef DOT_DISABLE_LOCK_PROFILING
+            if (LockProfiler::isRunning()) {
+                // Only time the wait when the lock is actually contended.
+                if (!_mutex.try_lock()) {
+                    uint64_t start = monotonicNanos();
+                    _mutex.lock();
+                    _acquired = monotonicNanos();
+                    _contended = true;
+                    _wait = _acquired - start;
+                } else {
+                    _acquired = monotonicNanos();
+                }
+
+                return;
+            }
+#endif
+            _mutex.lock();
+        }
+
+        ~Lock() {
+#ifndef DOT_DISABLE_LOCK_PROFILING
+            if (_acquired) {
+                uint64_t hold = monotonicNanos() - _acquired;
+                _mutex.unlock();
+                LockProfiler::record(_operation, _type, _parent, _contended, _wait, hold);
+                return;
+            }
+#endif
+            _mutex.unlock();
+        }
+
+        Lock(const Lock &) = delete;
+        void operator =(const Lock &) = delete;
+
+    private:
+        std::recursive_mutex &_mutex;
+        Operation _operation;
+        const TypeKey *_type;
+        bool _parent;
+        bool _contended;
+        uint64_t _wait;
+        uint64_t _acquired;
+    };
+
+    /**
+     * Fires the generate__begin and generate__end probes around a factory invocation.
+     */
+    class FactoryProbe {
+    public:
+        FactoryProbe(const TypeKey &key, int id) :
+                _key(key),
+                _id(id) {
+            DOT_PROBE3(generate__begin, key.info->name(), key.hash, id);
+        }
+
+        ~FactoryProbe() {
+            DOT_PROBE3(generate__end, _key.info->name(), _key.hash, _id);
+        }
+
+    private:
+        const TypeKey &_key;
+        int _id;
+    };
+
+public:
+    explicit Container(RegistryMode mode = RegistryMode::Ordered) :
+            _factories(std::make_shared<std::map<std::type_index, std::shared_ptr<BaseFactory>>>()),
+            _registry(makeRegistry(mode)),
+            _mode(mode),
+            _depth(0),
+            _forked(false),
+            _serial(nextSerial()),
+            _generation(0),
+            _frozen(nullptr) {
+    }
+
+    virtual ~Container() {
+        FlightRecorder::record(Operation::DestroyScope, this, nullptr, _depth, FlightRecorder::Outcome::Ok);
+        if (LeakCheck::isEnabled()) {
+            reportRetained();
+        }
+
+        DOT_PROBE2(scope__destroy, this, _depth);
+        if (_parent || _forked) {
+            if (auto observers = Observers::active()) {
+                for (auto observer : *observers) {
+                    observer->onScopeDestroy(*this);
+                }
+            }
+        }
+    }
+
+    /**
+     * Creates a child scope using the same registry mode as this container.
+     */
+    std::shared_ptr<Container> getScope() {
+        return getScope(_mode);
+    }
+
+    /**
+     * Creates a child scope with the given registry mode.  A long-lived Churn scope is the
+     * usual home for per-session services that are registered and unregistered constantly.
+     */
+    std::shared_ptr<Container> getScope(RegistryMode mode) {
+        auto scope = std::shared_ptr<Container>(new Container(shared_from_this(), mode));
+        FlightRecorder::record(Operation::GetScope, scope.get(), nullptr, scope->_depth, FlightRecorder::Outcome::Ok);
+        DOT_PROBE3(scope__create, scope.get(), this, scope->_depth);
+        if (auto observers = Observers::active()) {
+            for (auto observer : *observers) {
+                observer->onScopeCreate(*scope, *this);
+            }
+        }
+
+        return scope;
+    }
+
+    /**
+     * Creates a sibling of this container that starts out with the same services, such as a
+     * copy of a request scope for each task the request fans out to.  Nothing is copied: the
+     * services registered so far become a layer shared by both containers, and whatever is
+     * registered or unregistered afterwards in either of them is private to it.  The sibling
+     * has the same parent, factories and registry mode.
+     */
+    std::shared_ptr<Container> fork() {
+        std::shared_ptr<Container> sibling;
+        {
+            Lock locker(*this, Operation::GetScope, nullptr);
+            sibling = std::shared_ptr<Container>(new Container(*this, sharedRegistry()));
+        }
+
+        FlightRecorder::record(Operation::GetScope, sibling.get(), nullptr, _depth, FlightRecorder::Outcome::Ok);
+        DOT_PROBE3(scope__create, sibling.get(), _parent.get(), _depth);
+        if (auto observers = Observers::active()) {
+            for (auto observer : *observers) {
+                observer->onFork(*sibling, *this);
+            }
+        }
+
+        return sibling;
+    }
+
+    RegistryMode getRegistryMode() const {
+        return _mode;
+    }
+
+    /**
+     * Returns the number of parents above this container (0 for a root container).
+     */
+    int getDepth() const {
+        return _depth;
+    }
+
+    /**
+     * Returns the parent of a scope, or nullptr for a root container.
+     */
+    Container *getParent() const {
+        return _parent.get();
+    }
+
+    /**
+     * Returns the number of services registered directly in this container.
+     */
+    size_t size() {
+        Lock locker(*this, Operation::Maintenance, nullptr);
+        return _registry->size();
+    }
+
+    /**
+     * Releases registry storage left behind by unregistered services.
+     */
+    void compact() {
+        Lock locker(*this, Operation::Maintenance, nullptr);
+        if (!_frozen.load(std::memory_order_relaxed)) {
+            _registry->compact();
+        }
+    }
+
+    /**
+     * Freezes the services registered directly in this container, for prefork servers that
+     * build their container once and then fork workers.  Afterwards registering or
+     * unregistering a service here throws, lookups here skip the mutex, and getRef() resolves
+     * through a packed read-only index without writing to memory at all, so forked workers
+     * keep the container's pages shared.  Value services can still be set, and scopes can
+     * still be created.  Freezing can't be undone.
+     */
+    void freeze() {
+        Lock locker(*this, Operation::Maintenance, nullptr);
+        if (!_frozenIndex) {
+            if (dynamic_cast<LayeredRegistry *>(_registry.get())) {
+                // A frozen registry is read without the lock, so a fork's layers are merged
+                // into one that setValue() will never copy into.
+                _registry = flatten();
+            }
+
+            _registry->compact();
+            _frozenIndex.reset(new FrozenIndex(*_registry));
+            _frozen.store(_frozenIndex.get(), std::memory_order_release);
+        }
+    }
+
+    bool isFrozen() const {
+        return _frozen.load(std::memory_order_acquire) != nullptr;
+    }
+
+    /**
+     * Returns a reference to a service rather than a shared_ptr, so no reference count is
+     * touched.  The reference is valid while the service stays registered, which for a frozen
+     * container is for its lifetime.  Services found in a frozen container are resolved with
+     * no lock and no writes, and without Stats, observers or the flight recorder seeing the
+     * lookup; elsewhere getRef() resolves like get().
+     */
+    template<typename Type>
+    Type &getRef(int id = 0) DOT_THROWS(ContainerException) {
+        const TypeKey &key = TypeKey::of<Type>();
+        if (auto frozen = _frozen.load(std::memory_order_acquire)) {
+            auto entry = frozen->find(key, id);
+            if (entry && entry->object) {
+                return *static_cast<Type *>(entry->object);
+            }
+
+            if (!entry && _parent) {
+                return _parent->getRef<Type>(id);
+            }
+        }
+
+        int depth = 0;
+        return *resolveWrapper<ObjectContainer<Type>>(key, id, depth)->object;
+    }
+
+    /**
+     * Returns the memory used by this container and the services registered directly in it.
+     * Scopes are accounted separately; call this on each scope of interest.
+     */
+    MemoryUsage memoryUsage() {
+        Lock locker(*this, Operation::Maintenance, nullptr);
+
+        MemoryUsage usage = MemoryUsage();
+        usage.container = sizeof(Container) + CONTROL_BLOCK_BYTES + sizeof(void *) +
+                          (_mode == RegistryMode::Churn ? sizeof(SlotRegistry) : sizeof(OrderedRegistry)) +
+                          (dynamic_cast<LayeredRegistry *>(_registry.get()) ? sizeof(LayeredRegistry) : 0);
+        usage.registry = _registry->memoryUsage() + (_frozenIndex ? _frozenIndex->memoryUsage() : 0);
+        if (!_parent) {
+            typedef std::map<std::type_index, std::shared_ptr<BaseFactory>> Factories;
+            usage.factories = sizeof(Factories) + CONTROL_BLOCK_BYTES + _factories->size() *
+                    (MAP_NODE_BYTES + sizeof(Factories::value_type) + CONTROL_BLOCK_BYTES + sizeof(BaseFactory));
+        }
+
+        std::map<std::type_index, size_t> types;
+        _registry->forEach([&usage, &types](int /* id */, BaseObjectContainer &object) {
+            size_t overhead = object.overhead();
+            size_t service = object.serviceSize();
+            usage.wrappers += overhead;
+            usage.services += service;
+            usage.count++;
+
+            auto type = types.find(object.type());
+            if (type == types.end()) {
+                type = types.insert(std::make_pair(std::type_index(object.type()), usage.types.size())).first;
+                usage.types.push_back(MemoryUsage::Type { &object.type(), 0, 0, 0 });
+            }
+
+            MemoryUsage::Type &entry = usage.types[type->second];
+            entry.count++;
+            entry.overhead += overhead;
+            entry.services += service;
+        });
+
+        std::sort(usage.types.begin(), usage.types.end(), [](const MemoryUsage::Type &a, const MemoryUsage::Type &b) {
+            return a.overhead + a.services > b.overhead + b.services;
+        });
+
+        return usage;
+    }
+
+    template<typename Type>
+    void registerService(Type* instance, int id = 0, bool allowOverwrite = false) DOT_THROWS(ContainerException) {
+        Lock locker(*this, Operation::RegisterService, &TypeKey::of<Type>());
+
+        const TypeKey &key = TypeKey::of<Type>();
+        checkMutable(Operation::RegisterService, key, id);
+        std::string typeName(key.info->name());
+
+        // Check if the given ID already exists.
+        if(!allowOverwrite && _registry->find(key, id)) {
+            FlightRecorder::record(Operation::RegisterService, this, &key, id, FlightRecorder::Outcome::AlreadyExists);
+            std::string message = "Service object for type \"" + typeName + "\" with id \"" + std::to_string(id) + "\" already exists in injector.";
+            throw ContainerException(message.data());
+        }
+
+        ServicePtr<Type> object(instance);
+        auto container = std::make_shared<ObjectContainer<Type>>();
+        container->object = object;
+
+        bool overwritten = _registry->insert(key, id, container);
+        Stats::recordRegister(key);
+        notifyRegister(key, id, overwritten, sizeof(Type));
+    }
+
+    /**
+     * Registers a service generated by the factory for its type and config.  The config is
+     * forwarded, so one passed as an rvalue can be moved into the service by a MoveFactory.
+     */
+    template<typename Type, typename Config>
+    void registerService(Config &&config = EmptyConfig(), int id = 0, bool allowOverwrite = false) DOT_THROWS(ContainerException) {
+        typedef typename std::decay<Config>::type ConfigType;
+        Lock locker(*this, Operation::RegisterService, &TypeKey::of<Type>());
+
+        const TypeKey &key = TypeKey::of<Type>();
+        checkMutable(Operation::RegisterService, key, id);
+        std::type_index type = key.index();
+        std::string typeName(type.name());
+
+        // Check if the given type exists.
+        if (!_factories->count(type)) {
+            FlightRecorder::record(Operation::RegisterService, this, &key, id, FlightRecorder::Outcome::NoFactory);
+            std::string message = "Factory for type \"" + typeName + "\" does not exist in injector.";
+            throw ContainerException(message.data());
+        }
+
+        // Check if the given ID already exists.
+        if(!allowOverwrite && _registry->find(key, id)) {
+            FlightRecorder::record(Operation::RegisterService, this, &key, id, FlightRecorder::Outcome::AlreadyExists);
+            std::string message = "Service object for type \"" + typeName + "\" with id \"" + std::to_string(id) + "\" already exists in injector.";
+            throw ContainerException(message.data());
+        }
+
+        // Fetch the factory and attempt to cast it.
+        auto factory = (*_factories)[type];
+        auto castFactory = std::dynamic_pointer_cast<Factory<Type, ConfigType>>(factory);
+        if (!castFactory) {
+            FlightRecorder::record(Operation::RegisterService, this, &key, id, FlightRecorder::Outcome::BadCast);
+            std::string message = "Invalid cast when fetching factory for type \"" + typeName + "\".";
+            throw ContainerException(message.data());
+        }
+
+        // Generate the actual object to store.
+        auto object = ServicePtr<Type>(invokeFactory(*castFactory, std::forward<Config>(config),
+                                                       Operation::RegisterService, id));
+        auto container = std::make_shared<ObjectContainer<Type>>();
+        container->object = object;
+
+        bool overwritten = _registry->insert(key, id, container);
+        Stats::recordRegister(key);
+        notifyRegister(key, id, overwritten, sizeof(Type));
+    }
+
+    template<typename Type>
+    void registerService(int id = 0, bool allowOverwrite = false) DOT_THROWS(ContainerException) {
+        registerService<Type>(EmptyConfig(), id, allowOverwrite);
+    }
+
+    /**
+     * Registers a value service: a small trivially copyable value such as a timeout, a limit
+     * or a sampling rate, stored inline and read through getValue(), or without a lookup,
+     * lock or reference count through a ValueHandle.  Overwriting a value of the same type stores into it in
+     * place, so existing handles see the new value.
+     */
+    template<typename Type>
+    void registerValue(const Type &value, int id = 0, bool allowOverwrite = false) DOT_THROWS(ContainerException) {
+        static_assert(std::is_trivially_copyable<Type>::value, "Value services must be trivially copyable.");
+        Lock locker(*this, Operation::RegisterService, &TypeKey::of<Type>());
+
+        const TypeKey &key = TypeKey::of<Type>();
+        checkMutable(Operation::RegisterService, key, id);
+        std::string typeName(key.info->name());
+
+        auto existing = _registry->find(key, id);
+        if (!allowOverwrite && existing) {
+            FlightRecorder::record(Operation::RegisterService, this, &key, id, FlightRecorder::Outcome::AlreadyExists);
+            std::string message = "Service object for type \"" + typeName + "\" with id \"" + std::to_string(id) + "\" already exists in injector.";
+            throw ContainerException(message.data());
+        }
+
+        // A value shared with a fork is replaced, so the other containers keep the old one.
+        bool shared = existing && _registry->shared(key, id);
+        auto current = existing && !shared ? dynamic_cast<ValueContainer<Type> *>(existing->get()) : nullptr;
+        if (current) {
+            current->cell.store(value);
+        } else {
+            _registry->insert(key, id, std::make_shared<ValueContainer<Type>>(value));
+        }
+
+        Stats::recordRegister(key);
+        notifyRegister(key, id, existing != nullptr, sizeof(Type));
+    }
+
+    template<typename Factory>
+    void registerFactory() DOT_THROWS(ContainerException) {
+        Lock locker(*this, Operation::RegisterFactory, &TypeKey::of<typename Factory::ServiceType>());
+
+        std::type_index type = Factory::getTypeInfo();
+        std::string typeName(type.name());
+        
+        if (_factories->count(type)) {
+            FlightRecorder::record(Operation::RegisterFactory, this, &TypeKey::of<typename Factory::ServiceType>(), 0,
+                                   FlightRecorder::Outcome::AlreadyExists);
+            std::string message = "Factory for type \"" + typeName + "\" already exists in injector.";
+            throw ContainerException(message.data());
+        }
+
+        (*_factories)[type] = std::make_shared<Factory>();
+        FlightRecorder::record(Operation::RegisterFactory, this, &TypeKey::of<typename Factory::ServiceType>(), 0,
+                               FlightRecorder::Outcome::Ok);
+    }
+
+    template<typename Type, typename Config>
+    void registerFactory(std::function<Type *(const Config &)> generator) {
+        Lock locker(*this, Operation::RegisterFactory, &TypeKey::of<Type>());
+
+        std::type_index type = typeid(Type);
+        std::string typeName(type.name());
+
+        if (_factories->count(type)) {
+            FlightRecorder::record(Operation::RegisterFactory, this, &TypeKey::of<Type>(), 0,
+                                   FlightRecorder::Outcome::AlreadyExists);
+            std::string message = "Factory for type \"" + typeName + "\" already exists in injector.";
+            throw ContainerException(message.data());
+        }
+
+        (*_factories)[type] = std::make_shared<LambdaFactory<Type, Config>>(generator);
+        FlightRecorder::record(Operation::RegisterFactory, this, &TypeKey::of<Type>(), 0, FlightRecorder::Outcome::Ok);
+    };
+
+    template<typename Type>
+    ServicePtr<Type> get(int id = 0) DOT_THROWS(ContainerException) {
+        int depth = 0;
+        return resolve<Type>(id, depth);
+    };
+
+    /**
+     * Returns a copy of a value service registered with registerValue(), here or in a parent.
+     * Like get(), each call looks the value up under the container's lock and briefly holds a
+     * reference to its storage; hot paths should poll a valueHandle() instead.
+     */
+    template<typename Type>
+    Type getValue(int id = 0) DOT_THROWS(ContainerException) {
+        int depth = 0;
+        return resolveWrapper<ValueContainer<Type>>(TypeKey::of<Type>(), id, depth)->cell.load();
+    }
+
+    /**
+     * Updates a value service in place, in the container it was registered in.  Readers see
+     * the new value on their next read; unlike overwriting a service, nothing is re-registered.
+     * A value still shared with a fork is copied first, so the fork keeps the old value.
+     */
+    template<typename Type>
+    void setValue(const Type &value, int id = 0) DOT_THROWS(ContainerException) {
+        privateValue<Type>(id)->cell.store(value);
+    }
+
+    /**
+     * Returns a handle for polling a value service on hot paths; see ValueHandle.  Like
+     * setValue(), it first gives the container its own copy of a value shared with a fork.
+     */
+    template<typename Type>
+    ValueHandle<Type> valueHandle(int id = 0) DOT_THROWS(ContainerException) {
+        auto wrapper = privateValue<Type>(id);
+        return ValueHandle<Type>(std::shared_ptr<ValueCell<Type>>(wrapper, &wrapper->cell));
+    }
+
+    /**
+     * Per-call-site cache for the DOT_INJECT macros.  Remembers the container (by serial
+     * number, so a new container at the same address doesn't match), the generations of the
+     * containers the service was resolved through, and a weak reference to the service.  While
+     * none of those containers has had a service registered or unregistered, get() returns the
+     * cached service without locking or walking the registries.  Services resolved more than
+     * MAX_DEPTH parents up aren't cached, nor are intrusive services, which have no weak
+     * reference.  The cache is bypassed while observers, leak call site capture or the startup
+     * profiler are active so they see every resolution.  Cached hits are counted in Stats but
+     * not recorded by the FlightRecorder.  Instances are meant to be static thread_local, one
+     * per call site.
+     */
+    template<typename Type>
+    class InjectCache {
+    public:
+        static const int MAX_DEPTH = 3;
+
+        ServicePtr<Type> get(Container &container, int id) {
+            bool cacheable = !Intrusive<Type>::value && !Observers::active() && !LeakCheck::isCapturingSites() && !StartupProfiler::isRunning();
+            if (cacheable && container._serial == _serial && id == _id && current(container)) {
+                if (auto object = _object.lock()) {
+                    Stats::recordResolve(TypeKey::of<Type>(), _depth, true);
+                    return object;
+                }
+            }
+
+            // Take the generations before resolving, so a concurrent change makes the entry
+            // stale rather than wrong.
+            uint64_t generations[MAX_DEPTH + 1];
+            const Container *scope = &container;
+            for (int i = 0; i <= MAX_DEPTH && scope; i++) {
+                generations[i] = scope->_generation.load(std::memory_order_acquire);
+                scope = scope->_parent.get();
+            }
+
+            int depth = 0;
+            auto object = container.resolve<Type>(id, depth);
+            _serial = 0;
+            if (cacheable && depth <= MAX_DEPTH) {
+                std::copy(generations, generations + depth + 1, _generations);
+                _serial = container._serial;
+                _id = id;
+                _depth = depth;
+                _object = object;
+            }
+
+            return object;
+        }
+
+    private:
+        uint64_t _serial = 0;
+        int _id = 0;
+        int _depth = 0;
+        uint64_t _generations[MAX_DEPTH + 1];
+        WeakServicePtr<Type> _object;
+
+        bool current(const Container &container) const {
+            const Container *scope = &container;
+            for (int i = 0; i <= _depth; i++) {
+                if (scope->_generation.load(std::memory_order_acquire) != _generations[i]) {
+                    return false;
+                }
+
+                scope = scope->_parent.get();
+            }
+
+            return true;
+        }
+    };
+
+    /**
+     * Generates a new object with the factory for its type and config.  The config is
+     * forwarded as for registerService().
+     */
+    template<typename Type, typename Config>
+    ServicePtr<Type> generate(Config &&config) DOT_THROWS(ContainerException) {
+        Lock locker(*this, Operation::Generate, &TypeKey::of<Type>());
+
+        // Generate the object.
+        auto factory = generatingFactory<Type, typename std::decay<Config>::type>();
+        auto object = ServicePtr<Type>(invokeFactory(*factory, std::forward<Config>(config), Operation::Generate, 0));
+        FlightRecorder::record(Operation::Generate, this, &TypeKey::of<Type>(), 0, FlightRecorder::Outcome::Ok);
+        return object;
+    };
+
+    /**
+     * Like generate(), but for objects with a single owner: returns a unique_ptr, so no
+     * control block is allocated and ownership moves without atomic operations.  The object
+     * is released through the factory's destroy(), which lets pooled or arena factories take
+     * it back.
+     */
+    template<typename Type, typename Config>
+    UniquePtr<Type> generateUnique(Config &&config) DOT_THROWS(ContainerException) {
+        Lock locker(*this, Operation::Generate, &TypeKey::of<Type>());
+
+        auto factory = generatingFactory<Type, typename std::decay<Config>::type>();
+        Type *object = invokeFactory(*factory, std::forward<Config>(config), Operation::Generate, 0);
+        FlightRecorder::record(Operation::Generate, this, &TypeKey::of<Type>(), 0, FlightRecorder::Outcome::Ok);
+        return UniquePtr<Type>(object, FactoryDeleter<Type>(std::move(factory)));
+    };
+
+    template<typename Type>
+    void unregisterService(int id = 0) DOT_THROWS(ContainerException) {
+        Lock locker(*this, Operation::UnregisterService, &TypeKey::of<Type>());
+
+        const TypeKey &key = TypeKey::of<Type>();
+        checkMutable(Operation::UnregisterService, key, id);
+        std::string typeName(key.info->name());
+
+        if (!_registry->erase(key, id)) {
+            FlightRecorder::record(Operation::UnregisterService, this, &key, id, FlightRecorder::Outcome::NotFound);
+            std::string message = "Service object for type \"" + typeName + "\" with id \"" + std::to_string(id) + "\" doesn't exist in injector.";
+            throw ContainerException(message.data());
+        }
+
+        _generation.fetch_add(1, std::memory_order_release);
+        Stats::recordUnregister(key);
+        FlightRecorder::record(Operation::UnregisterService, this, &key, id, FlightRecorder::Outcome::Ok);
+        DOT_PROBE4(unregister, key.info->name(), key.hash, id, this);
+        if (auto observers = Observers::active()) {
+            ContainerEvent event = ContainerEvent();
+            event.container = this;
+            event.type = &key;
+            event.id = id;
+            for (auto observer : *observers) {
+                observer->onUnregister(event);
+            }
+        }
+    }
+
+private:
+    std::shared_ptr<std::map<std::type_index, std::shared_ptr<BaseFactory>>> _factories;
+    std::shared_ptr<BaseRegistry> _registry;
+    RegistryMode _mode;
+    int _depth;
+    std::shared_ptr<Container> _parent;
+    bool _forked;
+    std::recursive_mutex _mutex;
+
+    /** Unique for the life of the process, unlike the container's address. */
+    const uint64_t _serial;
+
+    /** Bumped whenever a service is registered or unregistered here, for InjectCache. */
+    std::atomic<uint64_t> _generation;
+
+    /** Set once by freeze(); readers only load the pointer. */
+    std::unique_ptr<FrozenIndex> _frozenIndex;
+    std::atomic<const FrozenIndex *> _frozen;
+
+    /** Forking stacks at most this many layers before they are copied into one. */
+    static const size_t MAX_LAYERS = 8;
+
+    /**
+     * Creates a fork of the source, with the given registry as its shared layer.
+     */
+    Container(const Container &source, std::shared_ptr<BaseRegistry> base) :
+            _factories(source._factories),
+            _registry(new LayeredRegistry(std::move(base), makeRegistry(source._mode))),
+            _mode(source._mode),
+            _depth(source._depth),
+            _parent(source._parent),
+            _forked(true),
+            _serial(nextSerial()),
+            _generation(0),
+            _frozen(nullptr) {
+    }
+
+    Container(std::shared_ptr<Container> parent, RegistryMode mode) :
+            _registry(makeRegistry(mode)),
+            _mode(mode),
+            _depth(parent->_depth + 1),
+            _parent(parent),
+            _forked(false),
+            _serial(nextSerial()),
+            _generation(0),
+            _frozen(nullptr) {
+        Lock locker(*_parent, Operation::GetScope, nullptr);
+        _factories = _parent->_factories;
+    }
+
+    /**
+     * Resolves a service for get(), with depth set to the number of parents walked.
+     */
+    template<typename Type>
+    ServicePtr<Type> resolve(int id, int &depth) {
+        auto castContainer = resolveWrapper<ObjectContainer<Type>>(TypeKey::of<Type>(), id, depth);
+        if (LeakCheck::isCapturingSites()) {
+            LeakCheck::capture(castContainer->sites);
+        }
+
+        return castContainer->object;
+    };
+
+    /**
+     * Finds a value for setValue() and valueHandle().  If the container it was registered in
+     * shares it with a fork, the container gets a copy of its own, which is returned instead.
+     * freeze() flattens a layered registry, so the values of a frozen container are never
+     * copied and are set in place.
+     */
+    template<typename Type>
+    std::shared_ptr<ValueContainer<Type>> privateValue(int id) {
+        const TypeKey &key = TypeKey::of<Type>();
+        int depth = 0;
+        auto wrapper = resolveWrapper<ValueContainer<Type>>(key, id, depth);
+
+        Container *holder = this;
+        for (int i = 0; i < depth; i++) {
+            holder = holder->_parent.get();
+        }
+
+        Lock locker(*holder, Operation::RegisterService, &key);
+        auto entry = holder->_registry->find(key, id);
+        if (entry && entry->get() == wrapper.get() && holder->_registry->shared(key, id)) {
+            wrapper = std::make_shared<ValueContainer<Type>>(wrapper->cell.load());
+            holder->_registry->insert(key, id, wrapper);
+        }
+
+        return wrapper;
+    }
+
+    /**
+     * Finds the wrapper of a service or value for resolve() and the value accessors, with
+     * diagnostics.  Throws if there is none or it is of another kind.
+     */
+    template<typename Wrapper>
+    std::shared_ptr<Wrapper> resolveWrapper(const TypeKey &key, int id, int &depth) {
+        DOT_PROBE3(get__entry, key.info->name(), key.hash, id);
+        StartupProfiler::Invocation invocation(Operation::Get, key, nullptr, id);
+
+        auto container = lookup(key, id, depth);
+        DOT_PROBE5(get__exit, key.info->name(), key.hash, id, container != nullptr, depth);
+        Stats::recordResolve(key, depth, container != nullptr);
+        if (auto observers = Observers::active()) {
+            ContainerEvent event = ContainerEvent();
+            event.container = this;
+            event.type = &key;
+            event.id = id;
+            event.hit = container != nullptr;
+            event.depth = depth;
+            for (auto observer : *observers) {
+                observer->onResolve(event);
+            }
+        }
+
+        if (!container) {
+            FlightRecorder::record(Operation::Get, this, &key, id, FlightRecorder::Outcome::NotFound);
+            std::string message = "Service object for type \"" + std::string(key.info->name()) + "\" with id \"" +
+                                  std::to_string(id) + "\" doesn't exist in injector.";
+            throw ContainerException(message.data());
+        }
+
+        // Attempt to properly cast the container to the given type.
+        auto castContainer = std::dynamic_pointer_cast<Wrapper>(container);
+        if (!castContainer) {
+            FlightRecorder::record(Operation::Get, this, &key, id, FlightRecorder::Outcome::BadCast);
+            std::string message = "Invalid object cast during injector get.";
+            throw ContainerException(message.data());
+        }
+
+        FlightRecorder::record(Operation::Get, this, &key, id, FlightRecorder::Outcome::Ok);
+        return castContainer;
+    }
+
+    /**
+     * Finds a service in this container or its parents.  Returns nullptr if there is none,
+     * with depth set to the number of parents walked.
+     */
+    std::shared_ptr<BaseObjectContainer> lookup(const TypeKey &key, int id, int &depth) {
+        if (_frozen.load(std::memory_order_acquire)) {
+            // A frozen registry never changes, so it is read without the lock.
+            return lookupUnlocked(key, id, depth);
+        }
+
+        Lock locker(*this, Operation::Get, &key, depth > 0);
+        return lookupUnlocked(key, id, depth);
+    }
+
+    std::shared_ptr<BaseObjectContainer> lookupUnlocked(const TypeKey &key, int id, int &depth) {
+        auto entry = _registry->find(key, id);
+        if (entry) {
+            return *entry;
+        }
+
+        if (!_parent) {
+            return nullptr;
+        }
+
+        depth++;
+        return _parent->lookup(key, id, depth);
+    }
+
+    /**
+     * Throws if the container is frozen.  Called with the lock held by every operation that
+     * changes the registry.
+     */
+    void checkMutable(Operation operation, const TypeKey &key, int id) {
+        if (_frozen.load(std::memory_order_relaxed)) {
+            FlightRecorder::record(operation, this, &key, id, FlightRecorder::Outcome::Frozen);
+            std::string message = "Service object for type \"" + key.name() + "\" with id \"" + std::to_string(id) +
+                                  "\" can't be changed in a frozen injector.";
+            throw ContainerException(message.data());
+        }
+    }
+
+    /**
+     * Returns the factory for generate() and generateUnique(), or throws if there is none for
+     * the type and config.
+     */
+    template<typename Type, typename Config>
+    std::shared_ptr<Factory<Type, Config>> generatingFactory() {
+        std::type_index type = typeid(Type);
+        std::string typeName(type.name());
+
+        // Check for a factory.
+        auto factory = _factories->find(type);
+        if (factory == _factories->end()) {
+            FlightRecorder::record(Operation::Generate, this, &TypeKey::of<Type>(), 0, FlightRecorder::Outcome::NoFactory);
+            throw ContainerException("Factory for type \"" + typeName + "\" does not exist in injector.");
+        }
+
+        auto castFactory = std::dynamic_pointer_cast<Factory<Type, Config>>(factory->second);
+        if (!castFactory) {
+            FlightRecorder::record(Operation::Generate, this, &TypeKey::of<Type>(), 0, FlightRecorder::Outcome::BadCast);
+            throw ContainerException("Invalid cast when fetching factory for type \"" + typeName + "\".");
+        }
+
+        return castFactory;
+    }
+
+    /**
+     * Invokes a factory on behalf of registerService or generate, with diagnostics.  The
+     * config is passed on as an rvalue if the caller gave one.
+     */
+    template<typename Type, typename Config, typename Argument>
+    Type *invokeFactory(Factory<Type, Config> &factory, Argument &&config, Operation operation, int id) {
+        const TypeKey &key = TypeKey::of<Type>();
+        Stats::recordGenerate(key);
+        StartupProfiler::Invocation invocation(operation, key, &typeid(Config), id);
+        GenerateLatency::Timer<Type, Config> timer;
+        FactoryProbe probe(key, id);
+
+        auto observers = Observers::active();
+        if (!observers) {
+            return factory.generate(std::forward<Argument>(config));
+        }
+
+        ContainerEvent event = ContainerEvent();
+        event.container = this;
+        event.type = &key;
+        event.id = id;
+        event.config = &typeid(Config);
+        event.operation = operation;
+        event.size = sizeof(Type);
+        for (auto observer : *observers) {
+            observer->onFactoryBegin(event);
+        }
+
+        uint64_t start = monotonicNanos();
+        Type *object = factory.generate(std::forward<Argument>(config));
+        event.nanos = monotonicNanos() - start;
+        for (auto observer : *observers) {
+            observer->onFactoryEnd(event);
+        }
+
+        return object;
+    }
+
+    void notifyRegister(const TypeKey &key, int id, bool overwritten, size_t size) {
+        _generation.fetch_add(1, std::memory_order_release);
+        FlightRecorder::record(Operation::RegisterService, this, &key, id,
+                               overwritten ? FlightRecorder::Outcome::Overwritten : FlightRecorder::Outcome::Ok);
+        DOT_PROBE5(register, key.info->name(), key.hash, id, overwritten, this);
+        if (auto observers = Observers::active()) {
+            ContainerEvent event = ContainerEvent();
+            event.container = this;
+            event.type = &key;
+            event.id = id;
+            event.overwritten = overwritten;
+            event.size = size;
+            for (auto observer : *observers) {
+                observer->onRegister(event);
+            }
+        }
+    }
+
+    /**
+     * Reports the services still referenced from outside this container to LeakCheck.  A
+     * fork skips the services it shares with containers that are still alive.
+     */
+    void reportRetained() {
+        LeakCheck::Report report = LeakCheck::Report();
+        report.container = this;
+        report.depth = _depth;
+        auto layered = dynamic_cast<LayeredRegistry *>(_registry.get());
+        _registry->forEach([&report, layered](int id, BaseObjectContainer &object) {
+            if (layered && layered->sharedWithOthers(object.key(), id)) {
+                return;
+            }
+
+            long references = object.useCount() - 1;
+            if (references > 0) {
+                LeakCheck::Retained retained = LeakCheck::Retained();
+                retained.type = TypeKey::demangle(object.type());
+                retained.id = id;
+                retained.references = references;
+                if (auto sites = object.sites.load(std::memory_order_acquire)) {
+                    retained.sites = sites->describe();
+                }
+
+                report.services.push_back(retained);
+            }
+        });
+
+        if (!report.services.empty()) {
+            LeakCheck::report(report);
+        }
+    }
+
+    static uint64_t nextSerial() {
+        static std::atomic<uint64_t> next(1);
+        return next.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    /**
+     * Returns the services registered so far as a registry that won't change again, for
+     * fork().  A frozen container's registry, which freeze() made a single layer, is returned
+     * as it is; otherwise the container's own registry is replaced by an empty layer on top of
+     * the returned one.  Called with the lock held.
+     */
+    std::shared_ptr<BaseRegistry> sharedRegistry() {
+        if (_frozen.load(std::memory_order_relaxed)) {
+            return _registry;
+        }
+
+        auto layered = dynamic_cast<LayeredRegistry *>(_registry.get());
+        if (layered && layered->pristine()) {
+            // Nothing has changed since the last fork, so the forks share the same layer.
+            return layered->base();
+        }
+
+        std::shared_ptr<BaseRegistry> base = _registry;
+        if (layered && layered->layers() >= MAX_LAYERS) {
+            // Copy a deep stack into a single registry so lookups don't walk every layer.
+            base = flatten();
+        }
+
+        _registry = std::make_shared<LayeredRegistry>(base, makeRegistry(_mode));
+        return base;
+    }
+
+    /**
+     * Returns a single registry holding the same services as the current one.  Called with
+     * the lock held.
+     */
+    std::shared_ptr<BaseRegistry> flatten() {
+        std::shared_ptr<BaseRegistry> flat(makeRegistry(_mode));
+        _registry->forEach([this, &flat](int id, BaseObjectContainer &object) {
+            flat->insert(object.key(), id, *_registry->find(object.key(), id));
+        });
+
+        return flat;
+    }
+
+    static BaseRegistry *makeRegistry(RegistryMode mode) {
+        if (mode == RegistryMode::Churn) {
+            return new SlotRegistry;
+        }
+
+        return new OrderedRegistry;
+    }
+
+    /**
+     * Check if this container
+     */
+    template<typename Type>
+    bool contains(int id) {
+        if (_registry->find(TypeKey::of<Type>(), id)) {
+            return true;
+        } else if (_parent) {
+            return _parent->contains<Type>(id);
+        }
+
+        return false;
+    }
+
+};
+
+/**
+ * Observer that records the service dependency graph: the services each factory resolved or
+ * generated while it ran, the scope each service lives in, and what each cost to construct.
+ * Install it with Observers::add() before the services are built (typically for application
+ * startup or a handful of requests) and export the graph for Graphviz with writeDot():
+ *
+ *     dot -Tsvg services.dot -o services.svg
+ *
+ * Destroyed scopes stay in the graph, so it grows with the number of scopes created while it
+ * is installed.
+ */
+class DependencyGraph : public ContainerObserver {
+public:
+    virtual void onRegister(const ContainerEvent &event) {
+        std::lock_guard<std::mutex> locker(_mutex);
+        Node &node = this->node(key(event.container, event, false), event);
+        node.unregistered = false;
+        node.size = event.size;
+    }
+
+    virtual void onUnregister(const ContainerEvent &event) {
+        std::lock_guard<std::mutex> locker(_mutex);
+        node(key(event.container, event, false), event).unregistered = true;
+    }
+
+    virtual void onFactoryBegin(const ContainerEvent &event) {
+        std::lock_guard<std::mutex> locker(_mutex);
+        bool generated = event.operation == Operation::Generate;
+        NodeKey key = this->key(event.container, event, generated);
+        node(key, event).size = event.size;
+        link(key, generated);
+        frames().push_back(Frame { this, key });
+    }
+
+    virtual void onFactoryEnd(const ContainerEvent &event) {
+        std::lock_guard<std::mutex> locker(_mutex);
+        NodeKey key = this->key(event.container, event, event.operation == Operation::Generate);
+        Node &node = this->node(key, event);
+        node.constructions++;
+        node.nanos += event.nanos;
+
+        // Frames of factories that threw never got their end event, so unwind past them too.
+        auto &frames = this->frames();
+        for (size_t i = frames.size(); i > 0; i--) {
+            if (frames[i - 1].graph == this && !(frames[i - 1].key < key) && !(key < frames[i - 1].key)) {
+                frames.erase(frames.begin() + (i - 1), frames.end());
+                break;
+            }
+        }
+    }
+
+    virtual void onResolve(const ContainerEvent &event) {
+        if (!event.hit) {
+            return;
+        }
+
+        // The service lives in the container the lookup ended in.
+        const Container *owner = event.container;
+        for (int i = 0; i < event.depth && owner; i++) {
+            owner = owner->getParent();
+        }
+
+        std::lock_guard<std::mutex> locker(_mutex);
+        NodeKey key = this->key(owner, event, false);
+        node(key, event).resolves++;
+        link(key, false);
+    }
+
+    virtual void onScopeCreate(const Container &scope, const Container & /* parent */) {
+        std::lock_guard<std::mutex> locker(_mutex);
+        scopeIndex(&scope);
+    }
+
+    virtual void onFork(const Container &fork, const Container & /* source */) {
+        std::lock_guard<std::mutex> locker(_mutex);
+        scopeIndex(&fork);
+    }
+
+    virtual void onScopeDestroy(const Container &scope) {
+        std::lock_guard<std::mutex> locker(_mutex);
+        auto live = _live.find(&scope);
+        if (live != _live.end()) {
+            _scopes[live->second].destroyed = true;
+            _live.erase(live);
+        }
+    }
+
+    /**
+     * Forgets everything recorded so far.
+     */
+    void clear() {
+        std::lock_guard<std::mutex> locker(_mutex);
+        _scopes.clear();
+        _live.clear();
+        _nodes.clear();
+        _edges.clear();
+    }
+
+    /**
+     * Writes the container hierarchy as nested clusters and the services as nodes, labelled
+     * with their size, construction count and time, resolve count and fan-in.  Nodes are
+     * shaded by their share of the most expensive construction, and unregistered services are
+     * dashed.  Resolve edges are solid and generate edges dashed, each labelled with how often
+     * the dependency was followed.
+     */
+    void writeDot(std::ostream &out) const {
+        std::lock_guard<std::mutex> locker(_mutex);
+
+        std::map<NodeKey, size_t> numbers;
+        std::map<NodeKey, size_t> fanIn;
+        std::vector<std::vector<NodeKey>> nodesByScope(_scopes.size());
+        std::vector<std::vector<size_t>> children(_scopes.size());
+        uint64_t maxNanos = 0;
+        for (const auto &node : _nodes) {
+            size_t number = numbers.size();
+            numbers[node.first] = number;
+            nodesByScope[node.first.scope].push_back(node.first);
+            maxNanos = std::max(maxNanos, node.second.nanos);
+        }
+
+        for (const auto &edge : _edges) {
+            fanIn[edge.first.second]++;
+        }
+
+        for (size_t scope = 0; scope < _scopes.size(); scope++) {
+            if (_scopes[scope].parent != NO_SCOPE) {
+                children[_scopes[scope].parent].push_back(scope);
+            }
+        }
+
+        out << "digraph services {" << std::endl;
+        out << "    rankdir=LR;" << std::endl;
+        out << "    node [shape=box, style=filled, fontname=\"Helvetica\", fontsize=10];" << std::endl;
+        out << "    edge [fontname=\"Helvetica\", fontsize=9];" << std::endl;
+        for (size_t scope = 0; scope < _scopes.size(); scope++) {
+            if (_scopes[scope].parent == NO_SCOPE) {
+                writeScope(out, scope, 1, children, nodesByScope, numbers, fanIn, maxNanos);
+            }
+        }
+
+        for (const auto &edge : _edges) {
+            out << "    n" << numbers[edge.first.first] << " -> n" << numbers[edge.first.second] << " [label=\""
+                << (edge.second.generate ? "generate " : "") << edge.second.count << "x\""
+                << (edge.second.generate ? ", style=dashed" : "") << "];" << std::endl;
+        }
+
+        out << "}" << std::endl;
+    }
+
+    bool writeDot(const std::string &path) const {
+        std::ofstream out(path.c_str());
+        writeDot(out);
+        return static_cast<bool>(out.flush());
+    }
+
+private:
+    static const size_t NO_SCOPE = static_cast<size_t>(-1);
+
+    struct Scope {
+        const Container *container;
+        size_t parent;
+        int depth;
+        RegistryMode mode;
+        bool destroyed;
+    };
+
+    /**
+     * A service is identified by the scope it lives in, its type and id.  Objects returned by
+     * generate() are a separate node per requesting scope and type, since they aren't stored.
+     */
+    struct NodeKey {
+        size_t scope;
+        uint32_t slot;
+        int id;
+        bool generated;
+
+        bool operator <(const NodeKey &other) const {
+            if (scope != other.scope) {
+                return scope < other.scope;
+            } else if (slot != other.slot) {
+                return slot < other.slot;
+            } else if (id != other.id) {
+                return id < other.id;
+            }
+
+            return generated < other.generated;
+        }
+    };
+
+    struct Node {
+        const TypeKey *type;
+        size_t size;
+        uint64_t constructions;
+        uint64_t nanos;
+        uint64_t resolves;
+        bool unregistered;
+    };
+
+    struct Edge {
+        uint64_t count;
+        bool generate;
+    };
+
+    /**
+     * A factory in progress on the current thread.
+     */
+    struct Frame {
+        const DependencyGraph *graph;
+        NodeKey key;
+    };
+
+    mutable std::mutex _mutex;
+    std::vector<Scope> _scopes;
+    std::map<const Container *, size_t> _live;
+    std::map<NodeKey, Node> _nodes;
+    std::map<std::pair<NodeKey, NodeKey>, Edge> _edges;
+
+    static std::vector<Frame> &frames() {
+        static thread_local std::vector<Frame> frames;
+        return frames;
+    }
+
+    size_t scopeIndex(const Container *container) {
+        auto live = _live.find(container);
+        if (live != _live.end()) {
+            return live->second;
+        }
+
+        Scope scope = Scope();
+        scope.container = container;
+        scope.parent = container->getParent() ? scopeIndex(container->getParent()) : NO_SCOPE;
+        scope.depth = container->getDepth();
+        scope.mode = container->getRegistryMode();
+        _scopes.push_back(scope);
+        _live[container] = _scopes.size() - 1;
+        return _scopes.size() - 1;
+    }
+
+    NodeKey key(const Container *container, const ContainerEvent &event, bool generated) {
+        NodeKey key = NodeKey();
+        key.scope = scopeIndex(container);
+        key.slot = event.type->slot;
+        key.id = event.id;
+        key.generated = generated;
+        return key;
+    }
+
+    Node &node(const NodeKey &key, const ContainerEvent &event) {
+        auto existing = _nodes.find(key);
+        if (existing != _nodes.end()) {
+            return existing->second;
+        }
+
+        Node &node = _nodes[key];
+        node = Node();
+        node.type = event.type;
+        return node;
+    }
+
+    /**
+     * Adds an edge from the factory running on this thread, if any, to the given service.
+     */
+    void link(const NodeKey &to, bool generate) {
+        auto &frames = this->frames();
+        for (size_t i = frames.size(); i > 0; i--) {
+            if (frames[i - 1].graph == this) {
+                Edge &edge = _edges[std::make_pair(frames[i - 1].key, to)];
+                edge.count++;
+                edge.generate = generate;
+                return;
+            }
+        }
+    }
+
+    void writeScope(std::ostream &out, size_t scope, int indent, const std::vector<std::vector<size_t>> &children,
+                    const std::vector<std::vector<NodeKey>> &nodesByScope, std::map<NodeKey, size_t> &numbers,
+                    std::map<NodeKey, size_t> &fanIn, uint64_t maxNanos) const {
+        std::string pad(indent * 4, ' ');
+        const Scope &info = _scopes[scope];
+        out << pad << "subgraph cluster_" << scope << " {" << std::endl;
+        out << pad << "    label=\"" << (info.depth ? "scope depth " + std::to_string(info.depth) : "root container")
+            << (info.mode == RegistryMode::Churn ? " (churn)" : "") << (info.destroyed ? " (destroyed)" : "")
+            << "\\n" << info.container << "\";" << std::endl;
+        if (info.destroyed) {
+            out << pad << "    style=dashed;" << std::endl;
+        }
+
+        for (const auto &key : nodesByScope[scope]) {
+            const Node &node = _nodes.find(key)->second;
+            double share = maxNanos ? static_cast<double>(node.nanos) / maxNanos : 0.0;
+
+            out << pad << "    n" << numbers[key] << " [label=\"" << escape(node.type->name()) << " #" << key.id
+                << (key.generated ? " (generated)" : "");
+            if (node.size) {
+                out << "\\n" << node.size << " B";
+            }
+
+            if (node.constructions) {
+                out << "\\nbuilt " << node.constructions << "x in " << formatNanos(node.nanos);
+            }
+
+            out << "\\nresolved " << node.resolves << "x, fan-in " << fanIn[key] << "\", fillcolor=\"0.000 "
+                << std::fixed << std::setprecision(3) << share * 0.8 << " 1.000\"";
+            out.unsetf(std::ios::floatfield);
+            if (node.unregistered) {
+                out << ", style=\"filled,dashed\"";
+            }
+
+            out << "];" << std::endl;
+        }
+
+        for (size_t child : children[scope]) {
+            writeScope(out, child, indent + 1, children, nodesByScope, numbers, fanIn, maxNanos);
+        }
+
+        out << pad << "}" << std::endl;
+    }
+
+    static std::string escape(const std::string &text) {
+        std::string result;
+        for (char character : text) {
+            if (character == '"' || character == '\\') {
+                result += '\\';
+            }
+
+            result += character;
+        }
+
+        return result;
+    }
+};
+
+/**
+ * Observer that writes a compact binary trace of container operations, for replaying a
+ * production workload offline with the dot_replay tool.  Install it with Observers::add()
+ * for the period to capture:
+ *
+ *     Dot::TraceRecorder recorder("app.trace");
+ *     Dot::Observers::add(&recorder);
+ *
+ * The trace starts with the 8 byte magic "DOTTRACE" and a 32-bit version, followed by
+ * fixed-size Records in native byte order.  A type is announced by a TYPE_NAME record, whose
+ * id is the length of the mangled type name that follows it, before its first use.  Scopes,
+ * including root containers, are announced by a GetScope record before their first use, with
+ * their parent's scope number in the type field and their registry mode in the id.  Forks are
+ * announced as they are created, with FLAG_FORK set and their source's scope number in the
+ * type field, so a replay can fork the source and start out with the same services.
+ * Registrations, unregistrations, gets (with whether they hit) and generates are recorded.
+ * Records are buffered and written under the recorder's mutex.
+ */
+class TraceRecorder : public ContainerObserver {
+public:
+    static const uint32_t VERSION = 2;
+    static const uint8_t TYPE_NAME = 0xff;
+    static const uint32_t NO_SCOPE = 0xffffffff;
+
+    /** Set on gets that found the service and registrations that replaced one. */
+    static const uint8_t FLAG_HIT = 1;
+
+    /** Set on the GetScope record announcing a fork.  Added in version 2. */
+    static const uint8_t FLAG_FORK = 2;
+
+    struct Record {
+        /** An Operation, or TYPE_NAME. */
+        uint8_t operation;
+        uint8_t flags;
+        uint16_t thread;
+        uint32_t type;
+        int32_t id;
+        uint32_t scope;
+
+        /** Nanoseconds since recording started. */
+        uint64_t nanos;
+    };
+
+    static_assert(sizeof(Record) == 24, "trace records are 24 bytes");
+
+    explicit TraceRecorder(std::ostream &out) :
+            _out(&out) {
+        start();
+    }
+
+    explicit TraceRecorder(const std::string &path) :
+            _file(new std::ofstream(path.c_str(), std::ios::binary | std::ios::trunc)),
+            _out(_file.get()) {
+        start();
+    }
+
+    virtual ~TraceRecorder() {
+        flush();
+    }
+
+    /**
+     * Returns false if the trace can't be written.
+     */
+    bool good() const {
+        std::lock_guard<std::mutex> locker(_mutex);
+        return static_cast<bool>(*_out);
+    }
+
+    /**
+     * Writes out the buffered records.
+     */
+    void flush() {
+        std::lock_guard<std::mutex> locker(_mutex);
+        write();
+        _out->flush();
+    }
+
+    /**
+     * Returns the number of records written, including scope announcements.
+     */
+    uint64_t records() const {
+        std::lock_guard<std::mutex> locker(_mutex);
+        return _records;
+    }
+
+    virtual void onRegister(const ContainerEvent &event) {
+        std::lock_guard<std::mutex> locker(_mutex);
+        add(Operation::RegisterService, event, event.container, event.overwritten);
+    }
+
+    virtual void onUnregister(const ContainerEvent &event) {
+        std::lock_guard<std::mutex> locker(_mutex);
+        add(Operation::UnregisterService, event, event.container, false);
+    }
+
+    virtual void onFactoryEnd(const ContainerEvent &event) {
+        // Factory registrations are recorded by onRegister.
+        if (event.operation == Operation::Generate) {
+            std::lock_guard<std::mutex> locker(_mutex);
+            add(Operation::Generate, event, event.container, false);
+        }
+    }
+
+    virtual void onResolve(const ContainerEvent &event) {
+        std::lock_guard<std::mutex> locker(_mutex);
+        add(Operation::Get, event, event.container, event.hit);
+    }
+
+    virtual void onScopeCreate(const Container &scope, const Container & /* parent */) {
+        std::lock_guard<std::mutex> locker(_mutex);
+        scopeNumber(&scope);
+    }
+
+    virtual void onFork(const Container &fork, const Container &source) {
+        std::lock_guard<std::mutex> locker(_mutex);
+        announce(&fork, scopeNumber(&source), FLAG_FORK);
+    }
+
+    virtual void onScopeDestroy(const Container &scope) {
+        std::lock_guard<std::mutex> locker(_mutex);
+        auto live = _scopes.find(&scope);
+        if (live != _scopes.end()) {
+            Record record = Record();
+            record.operation = static_cast<uint8_t>(Operation::DestroyScope);
+            record.thread = static_cast<uint16_t>(threadNumber());
+            record.scope = live->second;
+            record.nanos = monotonicNanos() - _start;
+            append(record);
+            _scopes.erase(live);
+        }
+    }
+
+    /**
+     * Reads a trace, returning the mangled type names by type number and the operation
+     * records in order.  Returns false if the stream isn't a trace of this or an earlier
+     * version or a type name is corrupt.  Operation records aren't checked; see dot_replay for that.
+     */
+    static bool read(std::istream &in, std::vector<std::string> &types, std::vector<Record> &records) {
+        char magic[8];
+        uint32_t version = 0;
+        if (!in.read(magic, sizeof(magic)) || std::memcmp(magic, "DOTTRACE", sizeof(magic)) != 0 ||
+                !in.read(reinterpret_cast<char *>(&version), sizeof(version)) || version == 0 ||
+                version > VERSION) {
+            return false;
+        }
+
+        Record record;
+        while (in.read(reinterpret_cast<char *>(&record), sizeof(record))) {
+            if (record.operation != TYPE_NAME) {
+                records.push_back(record);
+                continue;
+            }
+
+            if (record.id < 0 || record.type >= DOT_MAX_TYPES) {
+                return false;
+            }
+
+            // Read the name in pieces, so a corrupt length runs into the end of the stream
+            // rather than allocating all of it up front.
+            std::string name;
+            for (size_t left = static_cast<size_t>(record.id); left > 0;) {
+                char piece[4096];
+                size_t size = std::min(left, sizeof(piece));
+                if (!in.read(piece, size)) {
+                    return false;
+                }
+
+                name.append(piece, size);
+                left -= size;
+            }
+
+            if (types.size() <= record.type) {
+                types.resize(record.type + 1);
+            }
+
+            types[record.type] = name;
+        }
+
+        return true;
+    }
+
+    static bool read(const std::string &path, std::vector<std::string> &types, std::vector<Record> &records) {
+        std::ifstream in(path.c_str(), std::ios::binary);
+        return read(in, types, records);
+    }
+
+private:
+    static const size_t BUFFER_SIZE = 64 * 1024;
+
+    mutable std::mutex _mutex;
+    std::unique_ptr<std::ofstream> _file;
+    std::ostream *_out;
+    std::string _buffer;
+    uint64_t _start;
+    uint64_t _records = 0;
+    std::map<const Container *, uint32_t> _scopes;
+    uint32_t _nextScope = 0;
+    std::vector<bool> _announced;
+
+    void start() {
+        _start = monotonicNanos();
+        _buffer.reserve(BUFFER_SIZE);
+        uint32_t version = VERSION;
+        _buffer.append("DOTTRACE", 8);
+        _buffer.append(reinterpret_cast<const char *>(&version), sizeof(version));
+    }
+
+    void append(const Record &record) {
+        _buffer.append(reinterpret_cast<const char *>(&record), sizeof(record));
+        if (record.operation != TYPE_NAME) {
+            _records++;
+        }
+
+        if (_buffer.size() >= BUFFER_SIZE) {
+            write();
+        }
+    }
+
+    void write() {
+        _out->write(_buffer.data(), static_cast<std::streamsize>(_buffer.size()));
+        _buffer.clear();
+    }
+
+    void add(Operation operation, const ContainerEvent &event, const Container *container, bool flag) {
+        uint32_t slot = event.type->slot;
+        if (_announced.size() <= slot) {
+            _announced.resize(slot + 1);
+        }
+
+        if (!_announced[slot]) {
+            std::string name = event.type->info->name();
+            Record record = Record();
+            record.operation = TYPE_NAME;
+            record.type = slot;
+            record.id = static_cast<int32_t>(name.size());
+            append(record);
+            _buffer.append(name);
+            _announced[slot] = true;
+        }
+
+        Record record = Record();
+        record.operation = static_cast<uint8_t>(operation);
+        record.flags = flag ? FLAG_HIT : 0;
+        record.thread = static_cast<uint16_t>(threadNumber());
+        record.type = slot;
+        record.id = event.id;
+        record.scope = scopeNumber(container);
+        record.nanos = monotonicNanos() - _start;
+        append(record);
+    }
+
+    uint32_t scopeNumber(const Container *container) {
+        auto live = _scopes.find(container);
+        if (live != _scopes.end()) {
+            return live->second;
+        }
+
+        return announce(container, container->getParent() ? scopeNumber(container->getParent()) : NO_SCOPE, 0);
+    }
+
+    /**
+     * Numbers a scope and writes its GetScope record, naming its parent or, for a fork, its
+     * source.
+     */
+    uint32_t announce(const Container *container, uint32_t origin, uint8_t flags) {
+        Record record = Record();
+        record.operation = static_cast<uint8_t>(Operation::GetScope);
+        record.flags = flags;
+        record.thread = static_cast<uint16_t>(threadNumber());
+        record.type = origin;
+        record.id = static_cast<int32_t>(container->getRegistryMode());
+        record.scope = _nextScope++;
+        record.nanos = monotonicNanos() - _start;
+        append(record);
+
+        _scopes[container] = record.scope;
+        return record.scope;
+    }
+};
+
+class AppContainer : public Container {
+public:
+    static std::shared_ptr<AppContainer> getInstance() {
+        static auto injector = publish(std::shared_ptr<AppContainer>(new AppContainer));
+        return injector;
+    }
+
+    /**
+     * Returns the app container without touching its reference count.  After the first call
+     * this is a single load of a constant-initialized pointer, so it stays cheap however many
+     * threads call it.  The app container lives until static destruction.
+     */
+    static AppContainer &instance() {
+        AppContainer *injector = pointer().load(std::memory_order_acquire);
+        if (injector) {
+            return *injector;
+        }
+
+        return *getInstance();
+    }
+
+    /**
+     * Returns a shared_ptr to the app container that doesn't share ownership of it, so that
+     * copying and destroying it writes no reference count.  Its use_count() is 0 and weak
+     * pointers taken from it are expired.  Pass it to ContainerAware to opt in to that.
+     */
+    static std::shared_ptr<Container> unowned() {
+        return std::shared_ptr<Container>(std::shared_ptr<Container>(), &instance());
+    }
+
+    virtual ~AppContainer() {
+
+    }
+
+private:
+    AppContainer() {
+
+    }
+
+    AppContainer(AppContainer const&) = delete;
+    void operator =(AppContainer const&) = delete;
+
+    static std::atomic<AppContainer *> &pointer() {
+        static std::atomic<AppContainer *> injector(nullptr);
+        return injector;
+    }
+
+    static std::shared_ptr<AppContainer> publish(std::shared_ptr<AppContainer> injector) {
+        pointer().store(injector.get(), std::memory_order_release);
+        return injector;
+    }
+
+};
+
+/**
+ * The current scope of the calling thread: the container the request being handled resolves
+ * from.  Set it with a ScopeGuard on entry to a request, carry it into executor jobs with
+ * bind(), and across co_await with ScopedPromise.  Reading it is a single thread-local load.
+ */
+class CurrentScope {
+public:
+    struct Context {
+        Container *scope;
+
+        /** The shared_ptr the scope was set from, so that it can be carried elsewhere. */
+        const std::shared_ptr<Container> *owner;
+    };
+
+    static Context &context() {
+        static thread_local Context context = { nullptr, nullptr };
+        return context;
+    }
+
+    /**
+     * Returns the current scope as a shared_ptr, to keep it alive beyond the caller.  This is
+     * the app container if no scope is set.
+     */
+    static std::shared_ptr<Container> share() {
+        const Context &current = context();
+        if (current.owner) {
+            return *current.owner;
+        }
+
+        return AppContainer::getInstance();
+    }
+};
+
+/**
+ * Returns the current scope of the calling thread, or the app container if none is set.
+ */
+inline Container &current() {
+    Container *scope = CurrentScope::context().scope;
+    return scope ? *scope : static_cast<Container &>(AppContainer::instance());
+}
+
+/**
+ * Makes a scope current for the lifetime of the guard, then restores the previous one.  Guards
+ * nest, and must be destroyed on the thread that created them, so don't hold one across a
+ * co_await; use ScopedPromise for coroutines.
  */
-class BaseFactory {
+class ScopeGuard {
 public:
-    virtual ~BaseFactory() { }
+    explicit ScopeGuard(std::shared_ptr<Container> scope) :
+            _scope(std::move(scope)),
+            _previous(CurrentScope::context()) {
+        CurrentScope::context() = CurrentScope::Context { _scope.get(), &_scope };
+    }
+
+    ~ScopeGuard() {
+        CurrentScope::context() = _previous;
+    }
+
+    ScopeGuard(const ScopeGuard &) = delete;
+    void operator =(const ScopeGuard &) = delete;
+
+private:
+    std::shared_ptr<Container> _scope;
+    CurrentScope::Context _previous;
 };
 
 /**
- * Base exception class used for catching container exceptions.
+ * A function bound to a scope by bind().  Calling it makes the scope current for the call.
  */
-class ContainerException : public std::runtime_error {
+template<typename Function>
+class ScopedFunction {
 public:
-    ContainerException(const std::string &what) :
-            std::runtime_error(what) {
-        
+    ScopedFunction(std::shared_ptr<Container> scope, Function function) :
+            _scope(std::move(scope)),
+            _function(std::move(function)) {
+
+    }
+
+    template<typename... Arguments>
+    auto operator()(Arguments &&... arguments) -> decltype(std::declval<Function &>()(std::forward<Arguments>(arguments)...)) {
+        ScopeGuard guard(_scope);
+        return _function(std::forward<Arguments>(arguments)...);
     }
+
+private:
+    std::shared_ptr<Container> _scope;
+    Function _function;
 };
 
 /**
- * Abstract factory object, used for generating objects of the specified types using
- * a given configuration.
+ * Binds a job to the current scope, for handing it to an executor or another thread.  The
+ * job keeps the scope alive until it is destroyed.
  */
-template<typename Type, typename Config>
-class Factory : public BaseFactory {
-public:
-    /**
-     * Generates an object of the specified Type using the config object passed in.
-     */
-    virtual Type* generate(const Config &config) = 0;
+template<typename Function>
+ScopedFunction<typename std::decay<Function>::type> bind(Function &&function) {
+    return ScopedFunction<typename std::decay<Function>::type>(CurrentScope::share(), std::forward<Function>(function));
+}
 
-    /**
-     * Returns object-specific type info for the factory of the current type.
-     */
-    static std::type_index getTypeInfo() {
-        return std::type_index(typeid(Type));
+#if defined(__cpp_impl_coroutine)
+class ScopedPromise;
+
+/**
+ * Returns the awaiter co_await would use for an awaitable.
+ */
+template<typename Awaitable>
+decltype(auto) awaiterOf(Awaitable &&awaitable) noexcept {
+    if constexpr (requires { std::forward<Awaitable>(awaitable).operator co_await(); }) {
+        return std::forward<Awaitable>(awaitable).operator co_await();
+    } else if constexpr (requires { operator co_await(std::forward<Awaitable>(awaitable)); }) {
+        return operator co_await(std::forward<Awaitable>(awaitable));
+    } else {
+        return std::forward<Awaitable>(awaitable);
     }
-};
+}
 
 /**
- * Basic version of a factory.  This uses the EmptyConfig configuration type
- * and will create an object using the default constructor.
+ * Awaiter wrapper used by ScopedPromise.  Makes the coroutine's scope current whenever it
+ * resumes, and puts back the thread's previous scope whenever it suspends.
  */
-template<typename Type>
-class BasicFactory : public Factory<Type, EmptyConfig> {
+template<typename Awaiter>
+class ScopedAwaiter {
 public:
-    virtual Type *generate(const EmptyConfig &config)  {
-        return new Type;
-    };
-};
+    ScopedAwaiter(Awaiter &&awaiter, ScopedPromise &promise) :
+            _awaiter(std::forward<Awaiter>(awaiter)),
+            _promise(promise) {
 
-template<typename Type, typename Config>
-class LambdaFactory : public Factory<Type, Config> {
-public:
-    LambdaFactory(std::function<Type *(const Config &config)> lambda) :
-            _lambda(lambda) {
+    }
 
+    bool await_ready() noexcept(noexcept(std::declval<Awaiter &>().await_ready())) {
+        return _awaiter.await_ready();
     }
 
-    virtual Type *generate(const Config &config)  {
-        return _lambda(config);
-    };
+    template<typename Promise>
+    decltype(auto) await_suspend(std::coroutine_handle<Promise> handle)
+            noexcept(noexcept(std::declval<Awaiter &>().await_suspend(handle)));
+
+    decltype(auto) await_resume() noexcept(noexcept(std::declval<Awaiter &>().await_resume()));
 
 private:
-    std::function<Type *(const Config &config)> _lambda;
+    // Awaiters of rvalue awaitables are moved in, since initial_suspend() and final_suspend()
+    // return the wrapper past the end of the awaitable's full expression.
+    typename std::conditional<std::is_rvalue_reference<Awaiter>::value,
+            typename std::remove_reference<Awaiter>::type, Awaiter>::type _awaiter;
+    ScopedPromise &_promise;
 };
 
 /**
+ * Mixin for the promise type of a coroutine task that carries the current scope.  The task
+ * takes the scope that is current where it is created, and makes it current again every time
+ * it resumes, on whatever thread, so current() and DOT_INJECT resolve per request across
+ * co_await:
  *
+ *     struct Task {
+ *         struct promise_type : Dot::ScopedPromise {
+ *             Task get_return_object();
+ *             void return_void() { }
+ *             void unhandled_exception() { }
+ *         };
+ *     };
+ *
+ * It starts tasks suspended and suspends them at the end.  A promise that needs other initial
+ * or final awaiters should wrap them with scoped(), as await_transform() does for every
+ * co_await in the body.
  */
-class Container : public std::enable_shared_from_this<Container> {
-    class BaseObjectContainer {
-    public:
-        virtual ~BaseObjectContainer() { }
-    };
-
-    template<typename Type>
-    class ObjectContainer : public BaseObjectContainer {
-    public:
-        virtual ~ObjectContainer() { }
-        std::shared_ptr<Type> object;
-    };
-
+class ScopedPromise {
 public:
-    Container() :
-            _factories(std::make_shared<std::map<std::type_index, std::shared_ptr<BaseFactory>>>()) {
+    ScopedPromise() :
+            _scope(CurrentScope::share()),
+            _previous(),
+            _inside(false) {
+
     }
 
-    virtual ~Container() {
+    template<typename Awaitable>
+    auto scoped(Awaitable &&awaitable) noexcept {
+        using Awaiter = decltype(awaiterOf(std::forward<Awaitable>(awaitable)));
+        return ScopedAwaiter<Awaiter>(awaiterOf(std::forward<Awaitable>(awaitable)), *this);
+    }
 
+    template<typename Awaitable>
+    auto await_transform(Awaitable &&awaitable) noexcept {
+        return scoped(std::forward<Awaitable>(awaitable));
     }
 
-    std::shared_ptr<Container> getScope() {
-        return std::shared_ptr<Container>(new Container(shared_from_this()));
+    auto initial_suspend() noexcept {
+        return scoped(std::suspend_always());
     }
 
-    template<typename Type>
-    void registerService(Type* instance, int id = 0, bool allowOverwrite = false) throw(ContainerException) {
-        std::lock_guard<std::recursive_mutex> locker(_mutex);
+    auto final_suspend() noexcept {
+        return scoped(std::suspend_always());
+    }
 
-        std::type_index type = typeid(Type);
-        std::string typeName(type.name());
+    const std::shared_ptr<Container> &scope() const {
+        return _scope;
+    }
 
-        // Check if the given ID already exists.
-        if(!allowOverwrite && _objects.count(type) && _objects[type].count(id)) {
-            std::string message = "Service object for type \"" + typeName + "\" with id \"" + std::to_string(id) + "\" already exists in injector.";
-            throw ContainerException(message.data());
+    void enter() noexcept {
+        if (!_inside) {
+            _previous = CurrentScope::context();
+            _inside = true;
         }
 
-        std::shared_ptr<Type> object(instance);
-        auto container = std::make_shared<ObjectContainer<Type>>();
-        container->object = object;
+        CurrentScope::context() = CurrentScope::Context { _scope.get(), &_scope };
+    }
 
-        _objects[type][id] = container;
+    void leave() noexcept {
+        if (_inside) {
+            CurrentScope::context() = _previous;
+            _inside = false;
+        }
     }
 
-    template<typename Type, typename Config>
-    void registerService(Config config = EmptyConfig(), int id = 0, bool allowOverwrite = false) throw(ContainerException) {
-        std::lock_guard<std::recursive_mutex> locker(_mutex);
+private:
+    std::shared_ptr<Container> _scope;
+    CurrentScope::Context _previous;
+    bool _inside;
+};
 
-        std::type_index type = typeid(Type);
-        std::string typeName(type.name());
+template<typename Awaiter>
+template<typename Promise>
+decltype(auto) ScopedAwaiter<Awaiter>::await_suspend(std::coroutine_handle<Promise> handle)
+        noexcept(noexcept(std::declval<Awaiter &>().await_suspend(handle))) {
+    _promise.leave();
+    return _awaiter.await_suspend(handle);
+}
 
-        // Check if the given type exists.
-        if (!_factories->count(type)) {
-            std::string message = "Factory for type \"" + typeName + "\" does not exist in injector.";
-            throw ContainerException(message.data());
-        }
+template<typename Awaiter>
+decltype(auto) ScopedAwaiter<Awaiter>::await_resume() noexcept(noexcept(std::declval<Awaiter &>().await_resume())) {
+    _promise.enter();
+    return _awaiter.await_resume();
+}
+#endif
 
-        // Check if the given ID already exists.
-        if(!allowOverwrite && _objects.count(type) && _objects[type].count(id)) {
-            std::string message = "Service object for type \"" + typeName + "\" with id \"" + std::to_string(id) + "\" already exists in injector.";
-            throw ContainerException(message.data());
-        }
+class ContainerAware {
+public:
+    ContainerAware() :
+            _container(AppContainer::getInstance()) {
 
-        // Fetch the factory and attempt to cast it.
-        auto factory = (*_factories)[type];
-        auto castFactory = std::dynamic_pointer_cast<Factory<Type, Config>>(factory);
-        if (!castFactory) {
-            std::string message = "Invalid cast when fetching factory for type \"" + typeName + "\".";
-            throw ContainerException(message.data());
-        }
+    }
 
-        // Generate the actual object to store.
-        auto object = std::shared_ptr<Type>(castFactory->generate(config));
-        auto container = std::make_shared<ObjectContainer<Type>>();
-        container->object = object;
+    ContainerAware(ContainerAware *other) :
+            _container(other->_container) {
 
-        _objects[type][id] = container;
     }
 
-    template<typename Type>
-    void registerService(int id = 0, bool allowOverwrite = false) throw(ContainerException) {
-        registerService<Type>(EmptyConfig(), id, allowOverwrite);
-    }
+    ContainerAware(std::shared_ptr<Container> container) :
+            _container(container) {
 
-    template<typename Factory>
-    void registerFactory() throw(ContainerException) {
-        std::lock_guard<std::recursive_mutex> locker(_mutex);
+    }
 
-        std::type_index type = Factory::getTypeInfo();
-        std::string typeName(type.name());
-        
-        if (_factories->count(type)) {
-            std::string message = "Factory for type \"" + typeName + "\" already exists in injector.";
-            throw ContainerException(message.data());
-        }
+    void setContainer(std::shared_ptr<Container> container) {
+        _container = container;
+    }
 
-        (*_factories)[type] = std::make_shared<Factory>();
+    std::shared_ptr<Container> getContainer() {
+        return _container;
     }
 
-    template<typename Type, typename Config>
-    void registerFactory(std::function<Type *(const Config &)> generator) {
-        std::lock_guard<std::recursive_mutex> locker(_mutex);
+protected:
+    std::shared_ptr<Container> _container;
 
-        std::type_index type = typeid(Type);
-        std::string typeName(type.name());
+    void makeScope() {
+        _container = _container->getScope();
+    }
 
-        if (_factories->count(type)) {
-            std::string message = "Factory for type \"" + typeName + "\" already exists in injector.";
-            throw ContainerException(message.data());
-        }
+};
 
-        (*_factories)[type] = std::make_shared<LambdaFactory<Type, Config>>(generator);
-    };
+/**
+ * A ContainerAware that fits in a single pointer, for large numbers of small objects.  The
+ * handle is a tagged pointer: either a borrowed Container, with no reference counting at all,
+ * or (after makeScope() or when given a shared_ptr) an owning anchor holding the scope alive.
+ * A borrowed container must outlive the object; the app container always does.  Copies of an
+ * object that owns its scope share the scope, as do objects constructed from a pointer to it.
+ */
+class CompactContainerAware {
+public:
+    CompactContainerAware() :
+            _handle(borrow(AppContainer::instance())) {
 
-    template<typename Type>
-    std::shared_ptr<Type> get(int id = 0) throw(ContainerException) {
-        std::lock_guard<std::recursive_mutex> locker(_mutex);
+    }
 
-        std::type_index type = typeid(Type);
-        std::string typeName(type.name());
+    explicit CompactContainerAware(Container &container) :
+            _handle(borrow(container)) {
 
-        if (!_objects.count(type) || !_objects[type].count(id)) {
-            if (_parent) {
-                return _parent->get<Type>(id);
-            } else {
-                std::string message = "Service object for type \"" + typeName + "\" with id \"" + std::to_string(id) +
-                                      "\" doesn't exist in injector.";
-                throw ContainerException(message.data());
-            }
-        }
+    }
 
-        // Attempt to properly cast the container to the given type.
-        auto container = _objects[type][id];
-        auto castContainer = std::dynamic_pointer_cast<ObjectContainer<Type>>(container);
-        if (!castContainer) {
-            std::string message = "Invalid object cast during injector get.";
-            throw ContainerException(message.data());
-        }
+    /**
+     * Shares the other object's scope if it owns one, like ContainerAware, and otherwise
+     * borrows its container.
+     */
+    CompactContainerAware(const CompactContainerAware *other) :
+            _handle(other->_handle) {
+        retain();
+    }
 
-        return castContainer->object;
-    };
+    CompactContainerAware(std::shared_ptr<Container> container) :
+            _handle(own(std::move(container))) {
 
-    template<typename Type, typename Config>
-    std::shared_ptr<Type> generate(Config config) throw(ContainerException) {
-        std::lock_guard<std::recursive_mutex> locker(_mutex);
+    }
 
-        std::type_index type = typeid(Type);
-        std::string typeName(type.name());
+    CompactContainerAware(const CompactContainerAware &other) :
+            _handle(other._handle) {
+        retain();
+    }
 
-        // Check for a factory.
-        if (!_factories->count(type)) {
-            auto type = typeid(Type).name();
-            throw ContainerException("Factory for type \"" + typeName + "\" does not exist in injector.");
-        }
+    CompactContainerAware(CompactContainerAware &&other) :
+            _handle(other._handle) {
+        other._handle = borrow(AppContainer::instance());
+    }
 
-        auto factory = (*_factories)[type];
-        auto castFactory = std::dynamic_pointer_cast<Factory<Type, Config>>(factory);
-        if (!castFactory) {
-            auto type = typeid(Type).name();
-            throw ContainerException("Invalid cast when fetching factory for type \"" + typeName + "\".");
+    CompactContainerAware &operator =(const CompactContainerAware &other) {
+        if (this != &other) {
+            other.retain();
+            release();
+            _handle = other._handle;
         }
 
-        // Generate the object.
-        return std::shared_ptr<Type>(castFactory->generate(config));
-    };
-
-    template<typename Type>
-    void unregisterService(int id = 0) throw(ContainerException) {
-        std::lock_guard<std::recursive_mutex> locker(_mutex);
-
-        std::type_index type = typeid(Type);
-        std::string typeName(type.name());
+        return *this;
+    }
 
-        if (!_objects.count(type) || !_objects[type].count(id)) {
-            std::string message = "Service object for type \"" + typeName + "\" with id \"" + std::to_string(id) + "\" doesn't exist in injector.";
-            throw ContainerException(message.data());
+    CompactContainerAware &operator =(CompactContainerAware &&other) {
+        if (this != &other) {
+            release();
+            _handle = other._handle;
+            other._handle = borrow(AppContainer::instance());
         }
 
-        _objects[type].erase(id);
+        return *this;
     }
 
-private:
-    std::shared_ptr<std::map<std::type_index, std::shared_ptr<BaseFactory>>> _factories;
-    std::map<std::type_index, std::map<int, std::shared_ptr<BaseObjectContainer>>> _objects;
-    std::shared_ptr<Container> _parent;
-    std::recursive_mutex _mutex;
+    ~CompactContainerAware() {
+        release();
+    }
 
-    Container(std::shared_ptr<Container> parent) :
-            _parent(parent) {
-        std::lock_guard<std::recursive_mutex> locker(_parent->_mutex);
-        _factories = _parent->_factories;
+    void setContainer(std::shared_ptr<Container> container) {
+        uintptr_t handle = own(std::move(container));
+        release();
+        _handle = handle;
     }
 
     /**
-     * Check if this container
+     * Borrows the given container, which must outlive this object.  Passing the scope this
+     * object owns keeps it owned.
      */
-    template<typename Type>
-    bool contains(int id) {
-        if (_objects.count(typeid(Type)) && _objects[typeid(Type)].count(id)) {
-            return true;
-        } else if (_parent) {
-            return _parent->contains<Type>(id);
+    void setContainer(Container &container) {
+        if (&container == &this->container()) {
+            return;
         }
 
-        return false;
+        uintptr_t handle = borrow(container);
+        release();
+        _handle = handle;
     }
 
-};
+    /**
+     * Returns the container.  For a borrowed container the shared_ptr doesn't share
+     * ownership, so no reference count is written.
+     */
+    std::shared_ptr<Container> getContainer() const {
+        if (owning()) {
+            return anchor()->container;
+        }
 
-class AppContainer : public Container {
-public:
-    static std::shared_ptr<AppContainer> getInstance() {
-        static auto injector = std::shared_ptr<AppContainer>(new AppContainer);
-        return injector;
+        return std::shared_ptr<Container>(std::shared_ptr<Container>(), &container());
     }
 
-    virtual ~AppContainer() {
-
+    Container &container() const {
+        return owning() ? *anchor()->container : *reinterpret_cast<Container *>(_handle);
     }
 
-private:
-    AppContainer() {
+protected:
+    void makeScope() {
+        setContainer(container().getScope());
+    }
 
+    void makeScope(RegistryMode mode) {
+        setContainer(container().getScope(mode));
     }
 
-    AppContainer(AppContainer const&) = delete;
-    void operator =(AppContainer const&) = delete;
+private:
+    static const uintptr_t OWNING = 1;
 
-};
+    /**
+     * Holds an owned scope.  Copies of an object share its anchor, so copying one costs an
+     * increment rather than an allocation.
+     */
+    struct Anchor : public RefCounted {
+        explicit Anchor(std::shared_ptr<Container> container) :
+                container(std::move(container)) {
 
-class ContainerAware {
-public:
-    ContainerAware() :
-            _container(AppContainer::getInstance()) {
+        }
 
-    }
+        std::shared_ptr<Container> container;
+    };
 
-    ContainerAware(ContainerAware *other) :
-            _container(other->_container) {
+    uintptr_t _handle;
 
+    static uintptr_t borrow(Container &container) {
+        return reinterpret_cast<uintptr_t>(&container);
     }
 
-    ContainerAware(std::shared_ptr<Container> container) :
-            _container(container) {
-
+    static uintptr_t own(std::shared_ptr<Container> container) {
+        Anchor *anchor = new Anchor(std::move(container));
+        anchor->retain();
+        return reinterpret_cast<uintptr_t>(anchor) | OWNING;
     }
 
-    void setContainer(std::shared_ptr<Container> container) {
-        _container = container;
+    bool owning() const {
+        return (_handle & OWNING) != 0;
     }
 
-    std::shared_ptr<Container> getContainer() {
-        return _container;
+    Anchor *anchor() const {
+        return reinterpret_cast<Anchor *>(_handle & ~OWNING);
     }
 
-protected:
-    std::shared_ptr<Container> _container;
-
-    void makeScope() {
-        _container = _container->getScope();
+    void retain() const {
+        if (owning()) {
+            anchor()->retain();
+        }
     }
 
+    void release() {
+        if (owning() && anchor()->release()) {
+            delete anchor();
+        }
+    }
 };
 
+static_assert(sizeof(CompactContainerAware) == sizeof(void *), "CompactContainerAware is a single pointer");
+
 }
 
 #endif //DTECT_IT_COMMON_INJECTOR_H
@@ -1,4 +1,7 @@
 #include <iostream>
+#include <sstream>
+#include <algorithm>
+#include <thread>
 #include "dot.h"
 
 // Test convenience functions.
@@ -29,6 +32,8 @@ public:
 
 // Specify a factory for creating new int objects.
 class NumberFactory : public Dot::Factory<int, NumberConfig> {
+    using Dot::Factory<int, NumberConfig>::generate;
+
     virtual int *generate(const NumberConfig &config) {
         return new int(config.initialValue);
     }
@@ -36,6 +41,8 @@ class NumberFactory : public Dot::Factory<int, NumberConfig> {
 
 // Specify a factory for creating new int objects.
 class StringFactory : public Dot::Factory<std::string, StringConfig> {
+    using Dot::Factory<std::string, StringConfig>::generate;
+
     virtual std::string *generate(const StringConfig &config) {
         return new std::string(config.initialValue);
     }
@@ -72,6 +79,14 @@ bool testFactory() {
     ASSERT_EQ(*(container->get<int>(NUMBER_OTHER)) == 2);
     ASSERT_EQ(*(container->get<char>()) == 3);
 
+    // The config defaults to an EmptyConfig when its type is given explicitly.
+    auto explicitEmpty = makeContainer();
+    explicitEmpty->registerFactory<char, Dot::EmptyConfig>([](const Dot::EmptyConfig & /* config */) {
+        return new char(4);
+    });
+    explicitEmpty->registerService<char, Dot::EmptyConfig>();
+    ASSERT_EQ(*(explicitEmpty->get<char>()) == 4);
+
     return true;
 }
 
@@ -242,6 +257,1384 @@ bool testContainerAware() {
     return true;
 }
 
+bool testChurnRegistry() {
+    auto container = std::make_shared<Dot::Container>(Dot::RegistryMode::Churn);
+
+    // Register and unregister enough services to force slot reuse and compaction.
+    for (int round = 0; round < 8; round++) {
+        for (int id = 0; id < 1000; id++) {
+            container->registerService(new int(round * 1000 + id), id);
+        }
+
+        for (int id = 0; id < 1000; id++) {
+            ASSERT_EQ(*(container->get<int>(id)) == round * 1000 + id);
+        }
+
+        for (int id = 0; id < 1000; id += 2) {
+            container->unregisterService<int>(id);
+        }
+
+        for (int id = 1; id < 1000; id += 2) {
+            container->unregisterService<int>(id);
+        }
+    }
+
+    ASSERT_EQ(container->size() == 0);
+    ASSERT_EXCEPT(
+        container->get<int>(0);
+    )
+
+    // Types with the same id are kept apart.
+    container->registerService(new int(1), 7);
+    container->registerService(new char(2), 7);
+    container->compact();
+    ASSERT_EQ(*(container->get<int>(7)) == 1);
+    ASSERT_EQ(*(container->get<char>(7)) == 2);
+
+    // Scopes inherit the registry mode.
+    auto scope = container->getScope();
+    ASSERT_EQ(scope->getRegistryMode() == Dot::RegistryMode::Churn);
+    ASSERT_EQ(*(scope->get<int>(7)) == 1);
+
+    return true;
+}
+
+class StatsProbe {
+};
+
+bool testStats() {
+    auto container = makeContainer();
+    container->registerFactory<StatsProbe, Dot::EmptyConfig>([](const Dot::EmptyConfig & /* config */) {
+        return new StatsProbe;
+    });
+
+    container->registerService<StatsProbe>();
+    auto scope = container->getScope()->getScope();
+    scope->get<StatsProbe>();
+    container->get<StatsProbe>();
+    scope->generate<StatsProbe>(Dot::EmptyConfig());
+    ASSERT_EXCEPT(
+        scope->get<StatsProbe>(NUMBER_OTHER);
+    )
+    container->unregisterService<StatsProbe>();
+
+    Dot::TypeStats probe = Dot::TypeStats();
+    for (const auto &stats : Dot::Stats::snapshot()) {
+        if (stats.type == "StatsProbe") {
+            probe = stats;
+        }
+    }
+
+#ifndef DOT_DISABLE_STATS
+    ASSERT_EQ(probe.resolves == 3);
+    ASSERT_EQ(probe.parentFallthroughs == 2);
+    ASSERT_EQ(probe.parentDepthTotal == 4);
+    ASSERT_EQ(probe.parentDepthMax == 2);
+    ASSERT_EQ(probe.misses == 1);
+    ASSERT_EQ(probe.generates == 2);
+    ASSERT_EQ(probe.registrations == 1);
+    ASSERT_EQ(probe.unregistrations == 1);
+
+    std::string text;
+    Dot::Stats::writePrometheus([&text](const std::string &output) {
+        text = output;
+    });
+    ASSERT_EQ(text.find("# TYPE dot_resolve_total counter") != std::string::npos);
+    ASSERT_EQ(text.find("dot_resolve_total{type=\"StatsProbe\"} 3") != std::string::npos);
+#endif
+
+    return true;
+}
+
+bool testLockProfiler() {
+    Dot::LatencyHistogram histogram;
+    for (uint64_t value = 1; value <= 1000; value++) {
+        histogram.record(value * 1000);
+    }
+
+    // Bucketing keeps percentiles within about 6% of the exact value.
+    ASSERT_EQ(histogram.count() == 1000);
+    ASSERT_EQ(histogram.max() == 1000000);
+    ASSERT_EQ(histogram.percentile(0.5) >= 500000 && histogram.percentile(0.5) <= 530000);
+    ASSERT_EQ(histogram.percentile(0.99) >= 990000 && histogram.percentile(0.99) <= 1000000);
+
+#ifndef DOT_DISABLE_LOCK_PROFILING
+    auto container = makeContainer();
+    container->registerService(new int(1));
+
+    Dot::LockProfiler::start();
+    auto scope = container->getScope();
+    scope->get<int>();
+    scope->registerService(new char(2));
+    scope->size();
+    Dot::LockProfiler::stop();
+
+    // Not recorded once stopped.
+    scope->get<int>();
+
+    ASSERT_EQ(Dot::LockProfiler::holdHistogram(Dot::Operation::Get).count() == 1);
+    ASSERT_EQ(Dot::LockProfiler::holdHistogram(Dot::Operation::RegisterService).count() == 1);
+    ASSERT_EQ(Dot::LockProfiler::holdHistogram(Dot::Operation::GetScope).count() == 1);
+    ASSERT_EQ(Dot::LockProfiler::holdHistogram(Dot::Operation::Maintenance).count() == 1);
+
+    std::ostringstream report;
+    Dot::LockProfiler::report(report);
+    ASSERT_EQ(report.str().find("get (parent)") != std::string::npos);
+    ASSERT_EQ(report.str().find("Top contended types") != std::string::npos);
+#endif
+
+    return true;
+}
+
+bool testStartupProfiler() {
+#ifndef DOT_DISABLE_STARTUP_PROFILER
+    auto container = makeContainer();
+    std::weak_ptr<Dot::Container> weak = container;
+
+    container->registerService(new char(1));
+    container->registerFactory<NumberFactory>();
+    container->registerFactory<std::string, StringConfig>([weak](const StringConfig &config) {
+        // Resolve and generate other services from inside the factory.
+        auto container = weak.lock();
+        container->get<char>();
+        container->generate<int>(NumberConfig { 1 });
+        return new std::string(config.initialValue);
+    });
+
+    Dot::StartupProfiler::start();
+    container->registerService<std::string>(StringConfig { "Test" });
+    Dot::StartupProfiler::stop();
+    container->generate<int>(NumberConfig { 2 });
+
+    ASSERT_EQ(Dot::StartupProfiler::invocations() == 2);
+
+    std::ostringstream report;
+    Dot::StartupProfiler::writeReport(report);
+    ASSERT_EQ(report.str().find("Critical path") != std::string::npos);
+    ASSERT_EQ(report.str().find("generate int") != std::string::npos);
+
+    std::ostringstream trace;
+    Dot::StartupProfiler::writeChromeTrace(trace);
+    ASSERT_EQ(trace.str().find("\"traceEvents\"") != std::string::npos);
+    ASSERT_EQ(trace.str().find("\"name\":\"char\",\"cat\":\"get\"") != std::string::npos);
+#endif
+
+    return true;
+}
+
+bool testGenerateLatency() {
+#ifndef DOT_DISABLE_GENERATE_LATENCY
+    auto container = makeContainer();
+    container->registerFactory<NumberFactory>();
+
+    Dot::GenerateLatency::enable();
+    for (int i = 0; i < 100; i++) {
+        container->generate<int>(NumberConfig { i });
+    }
+    Dot::GenerateLatency::disable();
+    container->generate<int>(NumberConfig { 0 });
+
+    auto histogram = Dot::GenerateLatency::histogram<int, NumberConfig>();
+    ASSERT_EQ(histogram.count() == 100);
+    ASSERT_EQ(histogram.percentile(0.5) <= histogram.percentile(0.999));
+    ASSERT_EQ(histogram.percentile(0.999) <= histogram.max());
+
+    // Reading with reset drains the histograms.
+    bool found = false;
+    for (const auto &latency : Dot::GenerateLatency::snapshot(true)) {
+        if (latency.type == "int" && latency.config == "NumberConfig") {
+            found = latency.count == 100;
+        }
+    }
+
+    ASSERT_EQ(found);
+    ASSERT_EQ((Dot::GenerateLatency::histogram<int, NumberConfig>().count() == 0));
+#endif
+
+    return true;
+}
+
+class CountingObserver : public Dot::ContainerObserver {
+public:
+    int registered = 0;
+    int overwritten = 0;
+    int unregistered = 0;
+    int factories = 0;
+    int hits = 0;
+    int misses = 0;
+    int maxDepth = 0;
+    int scopes = 0;
+
+    virtual void onRegister(const Dot::ContainerEvent &event) {
+        registered++;
+        overwritten += event.overwritten;
+    }
+
+    virtual void onUnregister(const Dot::ContainerEvent & /* event */) {
+        unregistered++;
+    }
+
+    virtual void onFactoryEnd(const Dot::ContainerEvent & /* event */) {
+        factories++;
+    }
+
+    virtual void onResolve(const Dot::ContainerEvent &event) {
+        event.hit ? hits++ : misses++;
+        maxDepth = std::max(maxDepth, event.depth);
+    }
+
+    virtual void onScopeCreate(const Dot::Container & /* scope */, const Dot::Container & /* parent */) {
+        scopes++;
+    }
+
+    virtual void onFork(const Dot::Container & /* fork */, const Dot::Container & /* source */) {
+        scopes++;
+    }
+
+    virtual void onScopeDestroy(const Dot::Container & /* scope */) {
+        scopes--;
+    }
+};
+
+bool testObservers() {
+#ifndef DOT_DISABLE_OBSERVERS
+    auto container = makeContainer();
+    container->registerFactory<NumberFactory>();
+
+    CountingObserver observer;
+    Dot::Observers::add(&observer);
+    {
+        auto scope = container->getScope();
+        ASSERT_EQ(observer.scopes == 1);
+        ASSERT_EQ(scope->getDepth() == 1);
+
+        container->registerService(new int(1));
+        container->registerService<int>(NumberConfig { 2 }, 0, true);
+        scope->get<int>();
+        ASSERT_EXCEPT(
+            scope->get<char>();
+        )
+        container->unregisterService<int>();
+    }
+    Dot::Observers::remove(&observer);
+    container->registerService(new int(1));
+
+    ASSERT_EQ(observer.scopes == 0);
+    ASSERT_EQ(observer.registered == 2);
+    ASSERT_EQ(observer.overwritten == 1);
+    ASSERT_EQ(observer.unregistered == 1);
+    ASSERT_EQ(observer.factories == 1);
+    ASSERT_EQ(observer.hits == 1);
+    ASSERT_EQ(observer.misses == 1);
+    ASSERT_EQ(observer.maxDepth == 1);
+
+    // Replaced observer lists are freed while another thread keeps raising events.
+    std::atomic<bool> done(false);
+    std::thread resolver([&container, &done]() {
+        while (!done.load()) {
+            container->get<int>();
+        }
+    });
+
+    Dot::ContainerObserver noop;
+    for (int i = 0; i < 1000; i++) {
+        Dot::Observers::add(&noop);
+        Dot::Observers::remove(&noop);
+    }
+
+    done.store(true);
+    resolver.join();
+    ASSERT_EQ(!Dot::Observers::active());
+#endif
+
+    return true;
+}
+
+bool testFlightRecorder() {
+#ifndef DOT_DISABLE_FLIGHT_RECORDER
+    auto container = makeContainer();
+    container->registerService(new int(1), 7);
+    container->registerService(new int(2), 7, true);
+    ASSERT_EXCEPT(
+        container->get<char>(9);
+    )
+
+    // Earlier containers may have lived at the same address, so only keep the records after
+    // the last destroyScope for it.
+    auto records = Dot::FlightRecorder::entries();
+    std::vector<Dot::FlightRecorder::Record> ours;
+    for (const auto &record : records) {
+        if (record.container != container.get()) {
+            continue;
+        } else if (record.operation == Dot::Operation::DestroyScope) {
+            ours.clear();
+        } else {
+            ours.push_back(record);
+        }
+    }
+
+    ASSERT_EQ(ours.size() == 3);
+    ASSERT_EQ(ours[0].operation == Dot::Operation::RegisterService);
+    ASSERT_EQ(ours[0].outcome == Dot::FlightRecorder::Outcome::Ok);
+    ASSERT_EQ(ours[1].outcome == Dot::FlightRecorder::Outcome::Overwritten);
+    ASSERT_EQ(*ours[1].type == typeid(int));
+    ASSERT_EQ(ours[1].id == 7);
+    ASSERT_EQ(ours[2].operation == Dot::Operation::Get);
+    ASSERT_EQ(ours[2].outcome == Dot::FlightRecorder::Outcome::NotFound);
+    ASSERT_EQ(ours[2].id == 9);
+    ASSERT_EQ(ours[0].nanosAgo >= ours[2].nanosAgo);
+
+    std::ostringstream out;
+    Dot::FlightRecorder::dump(out);
+    ASSERT_EQ(out.str().find("overwritten") != std::string::npos);
+    ASSERT_EQ(out.str().find("not found") != std::string::npos);
+
+#if defined(DOT_POSIX)
+    ASSERT_EQ(!Dot::FlightRecorder::dumpOnSignal(0, "/dev/null"));
+    ASSERT_EQ(!Dot::FlightRecorder::dumpOnSignal(NSIG, "/dev/null"));
+    ASSERT_EQ(Dot::FlightRecorder::dumpOnSignal(SIGUSR2, "/dev/null"));
+    raise(SIGUSR2);
+    signal(SIGUSR2, SIG_DFL);
+#endif
+#endif
+
+    return true;
+}
+
+bool testDependencyGraph() {
+#ifndef DOT_DISABLE_OBSERVERS
+    auto container = makeContainer();
+    auto scope = container->getScope();
+    std::weak_ptr<Dot::Container> weak = scope;
+
+    container->registerService(new char(1));
+    container->registerFactory<NumberFactory>();
+    container->registerFactory<std::string, StringConfig>([weak](const StringConfig &config) {
+        auto scope = weak.lock();
+        scope->get<char>();
+        scope->generate<int>(NumberConfig { 1 });
+        return new std::string(config.initialValue);
+    });
+
+    Dot::DependencyGraph graph;
+    Dot::Observers::add(&graph);
+    scope->registerService<std::string>(StringConfig { "Test" }, 3);
+    scope->get<char>();
+    Dot::Observers::remove(&graph);
+
+    std::ostringstream out;
+    graph.writeDot(out);
+    std::string dot = out.str();
+
+    // The root container holds char and the scope holds the string, which resolved char and
+    // generated an int.
+    ASSERT_EQ(dot.find("digraph services {") == 0);
+    ASSERT_EQ(dot.find("subgraph cluster_0") < dot.find("subgraph cluster_1"));
+    ASSERT_EQ(dot.find("char #0\\nresolved 2x, fan-in 1") != std::string::npos);
+    ASSERT_EQ(dot.find("#3\\n" + std::to_string(sizeof(std::string)) + " B\\nbuilt 1x") != std::string::npos);
+    ASSERT_EQ(dot.find("int #0 (generated)") != std::string::npos);
+    ASSERT_EQ(dot.find("[label=\"1x\"]") != std::string::npos);
+    ASSERT_EQ(dot.find("[label=\"generate 1x\", style=dashed]") != std::string::npos);
+#endif
+
+    return true;
+}
+
+class Payload {
+public:
+    Payload() {
+        live++;
+    }
+
+    ~Payload() {
+        live--;
+    }
+
+    static int live;
+    char data[256];
+};
+
+int Payload::live = 0;
+
+bool testLeakCheck() {
+#ifndef DOT_DISABLE_LEAK_CHECK
+    auto container = makeContainer();
+    std::vector<Dot::LeakCheck::Report> reports;
+    Dot::LeakCheck::setHandler([&reports](const Dot::LeakCheck::Report &report) {
+        reports.push_back(report);
+    });
+    Dot::LeakCheck::enable(true);
+
+    // A long-running request loop in which every 100th request keeps its payload past the
+    // end of its scope.  Only those payloads should stay alive and be reported.
+    std::vector<std::shared_ptr<Payload>> kept;
+    for (int request = 0; request < 10000; request++) {
+        auto scope = container->getScope();
+        scope->registerService(new Payload, request);
+        auto payload = scope->get<Payload>(request);
+        if (request % 100 == 0) {
+            kept.push_back(payload);
+        }
+
+        ASSERT_EQ(Payload::live <= static_cast<int>(kept.size()) + 1);
+    }
+
+    Dot::LeakCheck::disable();
+    Dot::LeakCheck::setHandler(Dot::LeakCheck::Handler());
+
+    ASSERT_EQ(Payload::live == 100);
+    ASSERT_EQ(reports.size() == 100);
+    ASSERT_EQ(reports[1].depth == 1);
+    ASSERT_EQ(reports[1].services.size() == 1);
+    ASSERT_EQ(reports[1].services[0].type.find("Payload") != std::string::npos);
+    ASSERT_EQ(reports[1].services[0].id == 100);
+    ASSERT_EQ(reports[1].services[0].references == 1);
+#if defined(DOT_BACKTRACE)
+    ASSERT_EQ(reports[1].services[0].sites.size() == 1);
+    ASSERT_EQ(reports[1].services[0].sites[0].find("1x ") == 0);
+#endif
+
+    kept.clear();
+    ASSERT_EQ(Payload::live == 0);
+
+    // Forks only report what they don't share with a live container, and the last one to go
+    // reports the rest.
+    reports.clear();
+    Dot::LeakCheck::setHandler([&reports](const Dot::LeakCheck::Report &report) {
+        reports.push_back(report);
+    });
+    Dot::LeakCheck::enable(true);
+    {
+        auto source = container->getScope();
+        source->registerService(new Payload, 1);
+        auto shared = source->get<Payload>(1);
+        auto fork = source->fork();
+        fork->registerService(new Payload, 2);
+        auto own = fork->get<Payload>(2);
+        fork.reset();
+        ASSERT_EQ(reports.size() == 1 && reports[0].services.size() == 1 && reports[0].services[0].id == 2);
+
+        source.reset();
+        ASSERT_EQ(reports.size() == 2 && reports[1].services.size() == 1 && reports[1].services[0].id == 1);
+    }
+
+    Dot::LeakCheck::disable();
+    Dot::LeakCheck::setHandler(Dot::LeakCheck::Handler());
+    ASSERT_EQ(Payload::live == 0);
+#endif
+
+    return true;
+}
+
+class Blob {
+public:
+    Blob(size_t size) :
+            data(size) {
+
+    }
+
+    std::vector<char> data;
+};
+
+namespace Dot {
+
+template<>
+struct ServiceSize<Blob> {
+    static size_t of(const Blob &blob) {
+        return sizeof(Blob) + blob.data.capacity();
+    }
+};
+
+}
+
+bool testMemoryUsage() {
+    auto container = makeContainer();
+    container->registerFactory<NumberFactory>();
+    for (int i = 0; i < 3; i++) {
+        container->registerService(new int(i), i);
+    }
+    container->registerService(new Blob(1000));
+
+    auto usage = container->memoryUsage();
+    ASSERT_EQ(usage.count == 4);
+    ASSERT_EQ(usage.services == 3 * sizeof(int) + sizeof(Blob) + 1000);
+    ASSERT_EQ(usage.factories > 0);
+    ASSERT_EQ(usage.registry > 0 && usage.wrappers > 0);
+    ASSERT_EQ(usage.types.size() == 2);
+    ASSERT_EQ(*usage.types[0].type == typeid(Blob));
+    ASSERT_EQ(usage.types[1].count == 3);
+
+    // Scopes only account for their own services.
+    for (auto mode : { Dot::RegistryMode::Ordered, Dot::RegistryMode::Churn }) {
+        auto scope = container->getScope(mode);
+        auto empty = scope->memoryUsage();
+        ASSERT_EQ(empty.count == 0 && empty.services == 0 && empty.factories == 0);
+        ASSERT_EQ(empty.container > 0);
+
+        scope->registerService(new int(1));
+        auto used = scope->memoryUsage();
+        ASSERT_EQ(used.count == 1 && used.services == sizeof(int));
+        ASSERT_EQ(used.overhead() > empty.overhead());
+    }
+
+    std::ostringstream out;
+    usage.write(out);
+    ASSERT_EQ(out.str().find("Blob") != std::string::npos);
+
+    return true;
+}
+
+bool testTraceRecorder() {
+#ifndef DOT_DISABLE_OBSERVERS
+    auto container = makeContainer();
+    container->registerFactory<NumberFactory>();
+
+    std::stringstream trace;
+    {
+        Dot::TraceRecorder recorder(trace);
+        Dot::Observers::add(&recorder);
+        {
+            auto scope = container->getScope(Dot::RegistryMode::Churn);
+            scope->registerService(new char(1), 4);
+            scope->get<char>(4);
+            ASSERT_EXCEPT(
+                scope->get<char>(5);
+            )
+            container->generate<int>(NumberConfig { 1 });
+            scope->unregisterService<char>(4);
+        }
+        Dot::Observers::remove(&recorder);
+        ASSERT_EQ(recorder.records() == 8);
+    }
+
+    std::vector<std::string> types;
+    std::vector<Dot::TraceRecorder::Record> records;
+    ASSERT_EQ(Dot::TraceRecorder::read(trace, types, records));
+
+    // The root and the scope are announced before their first use.
+    std::vector<Dot::Operation> operations;
+    for (const auto &record : records) {
+        operations.push_back(static_cast<Dot::Operation>(record.operation));
+    }
+
+    std::vector<Dot::Operation> expected = {
+            Dot::Operation::GetScope, Dot::Operation::GetScope, Dot::Operation::RegisterService,
+            Dot::Operation::Get, Dot::Operation::Get, Dot::Operation::Generate,
+            Dot::Operation::UnregisterService, Dot::Operation::DestroyScope
+    };
+    ASSERT_EQ(operations == expected);
+    ASSERT_EQ(records[0].type == Dot::TraceRecorder::NO_SCOPE);
+    ASSERT_EQ(records[1].type == records[0].scope);
+    ASSERT_EQ(records[1].id == static_cast<int>(Dot::RegistryMode::Churn));
+    ASSERT_EQ(records[3].flags == Dot::TraceRecorder::FLAG_HIT && records[4].flags == 0);
+    ASSERT_EQ(records[4].id == 5 && records[4].scope == records[1].scope);
+    ASSERT_EQ(records[5].scope == records[0].scope);
+    ASSERT_EQ(types[records[2].type] == typeid(char).name());
+
+    // A type name whose length is negative or runs past the end of the trace is rejected.
+    for (int32_t length : { -1, 1 << 30 }) {
+        std::string corrupt = trace.str().substr(0, 12);
+        Dot::TraceRecorder::Record name = Dot::TraceRecorder::Record();
+        name.operation = Dot::TraceRecorder::TYPE_NAME;
+        name.id = length;
+        corrupt.append(reinterpret_cast<const char *>(&name), sizeof(name));
+        corrupt.append("abc");
+
+        std::istringstream in(corrupt);
+        ASSERT_EQ(!Dot::TraceRecorder::read(in, types, records));
+    }
+    ASSERT_EQ(types[records[5].type] == typeid(int).name());
+    ASSERT_EQ(records[7].nanos >= records[2].nanos);
+
+    // A fork is announced with its source, so replaying it by forking the source finds the
+    // services the fork shares with it.  Forks of root containers are announced too.
+    std::stringstream forkTrace;
+    {
+        Dot::TraceRecorder recorder(forkTrace);
+        Dot::Observers::add(&recorder);
+        {
+            auto root = makeContainer();
+            root->registerService(new char(1), 1);
+            auto scope = root->getScope();
+            scope->registerService(new char(2), 2);
+            auto task = scope->fork();
+            task->get<char>(1);
+            task->get<char>(2);
+            auto sibling = root->fork();
+            sibling->get<char>(1);
+        }
+        Dot::Observers::remove(&recorder);
+    }
+
+    types.clear();
+    records.clear();
+    ASSERT_EQ(Dot::TraceRecorder::read(forkTrace, types, records));
+
+    std::vector<std::shared_ptr<Dot::Container>> replayed;
+    int forks = 0;
+    int hits = 0;
+    for (const auto &record : records) {
+        auto operation = static_cast<Dot::Operation>(record.operation);
+        if (operation == Dot::Operation::GetScope) {
+            ASSERT_EQ(record.scope == replayed.size());
+            if (record.flags & Dot::TraceRecorder::FLAG_FORK) {
+                replayed.push_back(replayed[record.type]->fork());
+                forks++;
+            } else if (record.type == Dot::TraceRecorder::NO_SCOPE) {
+                replayed.push_back(makeContainer());
+            } else {
+                replayed.push_back(replayed[record.type]->getScope());
+            }
+        } else if (operation == Dot::Operation::RegisterService) {
+            replayed[record.scope]->registerService(new char(0), record.id);
+        } else if (operation == Dot::Operation::Get) {
+            ASSERT_EQ(record.flags == Dot::TraceRecorder::FLAG_HIT);
+            replayed[record.scope]->get<char>(record.id);
+            hits++;
+        }
+    }
+
+    ASSERT_EQ(replayed.size() == 4 && forks == 2 && hits == 3);
+#endif
+
+    return true;
+}
+
+class InjectedItem {
+public:
+    InjectedItem(std::shared_ptr<Dot::Container> container) {
+        DOT_INJECT_FROM(char, first, container);
+        DOT_INJECT_ID_FROM(char, second, 2, container);
+    }
+
+    std::shared_ptr<char> first;
+    std::shared_ptr<char> second;
+};
+
+class InjectedGlobal {
+public:
+    InjectedGlobal() {
+        DOT_INJECT(StatsProbe, probe);
+        DOT_INJECT_ID(StatsProbe, 3, other);
+    }
+
+    std::shared_ptr<StatsProbe> probe;
+    std::shared_ptr<StatsProbe> other;
+};
+
+bool testInjectMacros() {
+    auto container = makeContainer();
+    container->registerService(new char('a'));
+    container->registerService(new char('b'), 2);
+
+    InjectedItem item(container);
+    ASSERT_EQ(*item.first == 'a' && *item.second == 'b');
+    ASSERT_EQ(InjectedItem(container).first == item.first);
+
+    // Changes to the container, or to a scope in between, are picked up.
+    container->registerService(new char('c'), 0, true);
+    ASSERT_EQ(*InjectedItem(container).first == 'c');
+
+    auto scope = container->getScope();
+    ASSERT_EQ(*InjectedItem(scope).first == 'c');
+    scope->registerService(new char('d'));
+    ASSERT_EQ(*InjectedItem(scope).first == 'd');
+    ASSERT_EQ(*InjectedItem(scope).second == 'b');
+    ASSERT_EQ(*InjectedItem(container).first == 'c');
+
+    container->unregisterService<char>(2);
+    ASSERT_EXCEPT(
+        InjectedItem item(scope);
+    )
+
+    // A new container doesn't see the old one's cached services.
+    auto other = makeContainer();
+    other->registerService(new char('e'));
+    other->registerService(new char('f'), 2);
+    ASSERT_EQ(*InjectedItem(other).first == 'e');
+
+    auto app = Dot::AppContainer::getInstance();
+    app->registerService(new StatsProbe);
+    app->registerService(new StatsProbe, 3);
+    InjectedGlobal global;
+    ASSERT_EQ(global.probe && global.other && global.probe != global.other);
+    ASSERT_EQ(InjectedGlobal().probe == global.probe);
+    app->unregisterService<StatsProbe>();
+    app->unregisterService<StatsProbe>(3);
+
+    return true;
+}
+
+bool testAppInstance() {
+    Dot::AppContainer &app = Dot::AppContainer::instance();
+    ASSERT_EQ(&app == Dot::AppContainer::getInstance().get());
+
+    // The unowned handle points at the app container without sharing ownership.
+    auto unowned = Dot::AppContainer::unowned();
+    ASSERT_EQ(unowned.get() == &app && unowned.use_count() == 0);
+
+    class Handler : public Dot::ContainerAware {
+    public:
+        Handler() {
+            makeScope();
+        }
+    };
+
+    Handler handler;
+    ASSERT_EQ(handler.getContainer()->getParent() == &app);
+
+    // By default ContainerAware shares ownership of the app container; unowned() opts out.
+    std::weak_ptr<Dot::Container> weak = Dot::ContainerAware().getContainer();
+    ASSERT_EQ(weak.lock().get() == &app);
+    ASSERT_EQ(Dot::ContainerAware(unowned).getContainer().use_count() == 0);
+
+    return true;
+}
+
+bool testCompactContainerAware() {
+    class Item : public Dot::CompactContainerAware {
+    public:
+        Item() {
+
+        }
+
+        Item(Item *parent) :
+                Dot::CompactContainerAware(parent) {
+            makeScope();
+        }
+    };
+
+    ASSERT_EQ(sizeof(Item) == sizeof(void *));
+
+    // Borrowed by default, from the app container.
+    Item plain;
+    ASSERT_EQ(&plain.container() == &Dot::AppContainer::instance());
+    ASSERT_EQ(plain.getContainer().use_count() == 0);
+
+    std::weak_ptr<Dot::Container> scope;
+    {
+        Item scoped(&plain);
+        scope = scoped.getContainer();
+        ASSERT_EQ(scope.lock()->getParent() == &Dot::AppContainer::instance());
+        scoped.container().registerService(new int(5));
+
+        // Copies share the scope and keep it alive.
+        Item copy(scoped);
+        Item moved(std::move(scoped));
+        ASSERT_EQ(&copy.container() == &moved.container());
+        ASSERT_EQ(*copy.getContainer()->get<int>() == 5);
+        ASSERT_EQ(&scoped.container() == &Dot::AppContainer::instance());
+
+        plain = copy;
+        ASSERT_EQ(plain.getContainer() == scope.lock());
+    }
+    ASSERT_EQ(!scope.expired());
+
+    // Setting the scope it owns keeps it owned.
+    plain.setContainer(plain.container());
+    ASSERT_EQ(!scope.expired() && plain.getContainer() == scope.lock());
+    plain.container().registerService(new int(6), 1);
+    ASSERT_EQ(*plain.container().get<int>(1) == 6);
+
+    plain.setContainer(Dot::AppContainer::instance());
+    ASSERT_EQ(scope.expired());
+
+    // A child of an owning object shares its scope rather than borrowing it.
+    {
+        Dot::CompactContainerAware child;
+        {
+            Item owner(&plain);
+            scope = owner.getContainer();
+            child = Dot::CompactContainerAware(&owner);
+            ASSERT_EQ(&child.container() == &owner.container());
+        }
+        ASSERT_EQ(!scope.expired());
+        ASSERT_EQ(child.getContainer() == scope.lock());
+    }
+    ASSERT_EQ(scope.expired());
+
+    auto container = makeContainer();
+    Dot::CompactContainerAware borrowed(*container);
+    ASSERT_EQ(borrowed.getContainer().get() == container.get());
+
+    return true;
+}
+
+class Counted : public Dot::RefCounted {
+public:
+    Counted(int value) :
+            value(value) {
+        live++;
+    }
+
+    ~Counted() {
+        live--;
+    }
+
+    int value;
+    static int live;
+};
+
+int Counted::live = 0;
+
+class CountedFactory : public Dot::Factory<Counted, int> {
+public:
+    using Dot::Factory<Counted, int>::generate;
+
+    virtual Counted *generate(const int &value) {
+        return new Counted(value);
+    }
+};
+
+// Keeps its own count rather than deriving from RefCounted.
+class Handle {
+public:
+    Handle() :
+            references(0) {
+        live++;
+    }
+
+    ~Handle() {
+        live--;
+    }
+
+    mutable int references;
+    static int live;
+};
+
+int Handle::live = 0;
+
+namespace Dot {
+
+template<>
+struct Intrusive<Handle> {
+    static const bool value = true;
+
+    static void retain(const Handle *handle) {
+        handle->references++;
+    }
+
+    static void release(const Handle *handle) {
+        if (--handle->references == 0) {
+            delete handle;
+        }
+    }
+
+    static long useCount(const Handle *handle) {
+        return handle->references;
+    }
+};
+
+}
+
+bool testIntrusive() {
+    static_assert(sizeof(Dot::ServicePtr<Counted>) == sizeof(void *), "intrusive pointer is a single word");
+    static_assert(std::is_same<Dot::ServicePtr<int>, std::shared_ptr<int>>::value, "other types keep shared_ptr");
+
+    auto container = makeContainer();
+    container->registerFactory<CountedFactory>();
+    container->registerService<Counted, int>(7);
+    container->registerService(new Counted(8), 1);
+    ASSERT_EQ(Counted::live == 2);
+
+    Dot::IntrusivePtr<Counted> counted = container->get<Counted>();
+    ASSERT_EQ(counted->value == 7 && counted.use_count() == 2);
+    ASSERT_EQ(container->get<Counted>(1)->value == 8);
+
+    // Scopes hand out the same object rather than a new control block around it.
+    auto scope = container->getScope();
+    ASSERT_EQ(scope->get<Counted>() == counted);
+    ASSERT_EQ(counted.use_count() == 2);
+
+    {
+        auto generated = container->generate<Counted>(9);
+        ASSERT_EQ(generated.use_count() == 1 && Counted::live == 3);
+    }
+    ASSERT_EQ(Counted::live == 2);
+
+    // Unregistering drops the container's reference; the last handle deletes the service.
+    container->unregisterService<Counted>();
+    ASSERT_EQ(counted.use_count() == 1 && Counted::live == 2);
+    counted.reset();
+    ASSERT_EQ(Counted::live == 1);
+
+    DOT_INJECT_ID_FROM(Counted, Dot::ServicePtr<Counted> injected, 1, container);
+    ASSERT_EQ(injected->value == 8 && injected.use_count() == 2);
+
+    container->registerService(new Handle());
+    ASSERT_EQ(container->get<Handle>().use_count() == 2 && Handle::live == 1);
+    container->unregisterService<Handle>();
+    ASSERT_EQ(Handle::live == 0);
+
+    injected.reset();
+    container.reset();
+    scope.reset();
+    ASSERT_EQ(Counted::live == 0);
+
+    return true;
+}
+
+// Keeps destroyed objects for reuse instead of deleting them.
+class PooledFactory : public Dot::Factory<Counted, int> {
+public:
+    using Dot::Factory<Counted, int>::generate;
+
+    virtual ~PooledFactory() {
+        for (auto object : pool) {
+            delete object;
+        }
+    }
+
+    virtual Counted *generate(const int &value) {
+        if (pool.empty()) {
+            return new Counted(value);
+        }
+
+        Counted *object = pool.back();
+        pool.pop_back();
+        object->value = value;
+        return object;
+    }
+
+    virtual void destroy(Counted *object) {
+        pool.push_back(object);
+    }
+
+    std::vector<Counted *> pool;
+};
+
+bool testGenerateUnique() {
+    auto container = makeContainer();
+    container->registerFactory<NumberFactory>();
+    {
+        Dot::UniquePtr<int> number = container->generateUnique<int>(NumberConfig { 4 });
+        ASSERT_EQ(*number == 4);
+    }
+    ASSERT_EXCEPT(container->generateUnique<char>(Dot::EmptyConfig()));
+    ASSERT_EXCEPT(container->generateUnique<int>(Dot::EmptyConfig()));
+
+    // Destroyed objects go back to the factory, which can hand them out again.
+    container->registerFactory<PooledFactory>();
+    Counted *address;
+    {
+        auto first = container->generateUnique<Counted>(1);
+        address = first.get();
+    }
+    ASSERT_EQ(Counted::live == 1);
+
+    auto second = container->generateUnique<Counted>(2);
+    ASSERT_EQ(second.get() == address && second->value == 2);
+
+    // The object keeps its factory alive after the container is gone.
+    container.reset();
+    ASSERT_EQ(Counted::live == 1);
+    second.reset();
+    ASSERT_EQ(Counted::live == 1);
+
+    // Replacing the deleter releases the last reference to the factory and its pool.
+    second = Dot::UniquePtr<Counted>();
+    ASSERT_EQ(Counted::live == 0);
+
+    return true;
+}
+
+// Counts how often it is copied on the way to the service.
+class RouteConfig {
+public:
+    RouteConfig() { }
+
+    RouteConfig(const RouteConfig &other) :
+            routes(other.routes) {
+        copies++;
+    }
+
+    RouteConfig(RouteConfig &&other) = default;
+
+    std::vector<std::string> routes;
+    static int copies;
+};
+
+int RouteConfig::copies = 0;
+
+class Router {
+public:
+    Router(std::vector<std::string> routes) :
+            routes(std::move(routes)) {
+
+    }
+
+    std::vector<std::string> routes;
+};
+
+class RouterFactory : public Dot::MoveFactory<Router, RouteConfig> {
+public:
+    using Dot::MoveFactory<Router, RouteConfig>::generate;
+
+    virtual Router *generate(RouteConfig &&config) {
+        return new Router(std::move(config.routes));
+    }
+};
+
+bool testMoveConfig() {
+    auto container = makeContainer();
+    container->registerFactory<RouterFactory>();
+
+    RouteConfig config;
+    config.routes = { "/a", "/b" };
+    const std::string *first = config.routes.data();
+
+    // An lvalue config is copied once; a moved one reaches the service untouched.
+    container->registerService<Router>(config, 1);
+    ASSERT_EQ(RouteConfig::copies == 1 && config.routes.size() == 2);
+    container->registerService<Router>(std::move(config), 2);
+    ASSERT_EQ(RouteConfig::copies == 1 && container->get<Router>(2)->routes.data() == first);
+
+    RouteConfig generated;
+    generated.routes = { "/c" };
+    ASSERT_EQ(container->generate<Router>(std::move(generated))->routes.size() == 1);
+    ASSERT_EQ(container->generateUnique<Router>(RouteConfig())->routes.empty());
+    ASSERT_EQ(RouteConfig::copies == 1);
+
+    // Factories taking a const reference accept rvalue configs too.
+    container->registerFactory<NumberFactory>();
+    ASSERT_EQ(*container->generate<int>(NumberConfig { 3 }) == 3);
+
+    return true;
+}
+
+// Too large for std::atomic, so stored behind the sequence lock.
+struct Limits {
+    int connections;
+    int requests;
+    double rate;
+};
+
+// Has no default constructor, which the sequence lock's reads must not need.
+struct Window {
+    Window(int64_t start, int64_t length) :
+            start(start),
+            length(length) {
+
+    }
+
+    int64_t start;
+    int64_t length;
+};
+
+bool testValues() {
+    auto container = makeContainer();
+    container->registerValue(std::chrono::milliseconds(250));
+    container->registerValue(Limits { 10, 100, 0.5 }, 1);
+    ASSERT_EQ(container->getValue<std::chrono::milliseconds>().count() == 250);
+    ASSERT_EQ(container->getValue<Limits>(1).requests == 100);
+    ASSERT_EXCEPT(container->registerValue(std::chrono::milliseconds(1)));
+    ASSERT_EXCEPT(container->getValue<Limits>());
+    ASSERT_EXCEPT(container->get<std::chrono::milliseconds>());
+    container->registerValue(Window(5, 10));
+    ASSERT_EQ(container->getValue<Window>().start == 5 && container->getValue<Window>().length == 10);
+
+    // Handles see updates made through the container, and the other way around.
+    auto timeout = container->valueHandle<std::chrono::milliseconds>();
+    auto limits = container->valueHandle<Limits>(1);
+    container->setValue(std::chrono::milliseconds(500));
+    ASSERT_EQ(timeout.get().count() == 500);
+    limits.set(Limits { 20, 200, 0.25 });
+    ASSERT_EQ(container->getValue<Limits>(1).connections == 20 && container->getValue<Limits>(1).rate == 0.25);
+
+    // Scopes read and update the value registered in their parent; overwriting stores in place.
+    auto scope = container->getScope();
+    scope->setValue(std::chrono::milliseconds(750));
+    ASSERT_EQ(timeout.get().count() == 750);
+    container->registerValue(std::chrono::milliseconds(900), 0, true);
+    ASSERT_EQ(timeout.get().count() == 900 && scope->getValue<std::chrono::milliseconds>().count() == 900);
+
+    // A handle outlives its value.
+    container->unregisterService<std::chrono::milliseconds>();
+    ASSERT_EXCEPT(container->getValue<std::chrono::milliseconds>());
+    ASSERT_EQ(timeout.get().count() == 900);
+
+    // Concurrent writers never leave a reader with a torn value.
+    limits.set(Limits { 0, 0, 0 });
+    std::atomic<bool> done(false);
+    std::vector<std::thread> writers;
+    for (int i = 0; i < 2; i++) {
+        writers.push_back(std::thread([&limits, &done]() {
+            for (int n = 0; !done; n++) {
+                limits.set(Limits { n, n, static_cast<double>(n) });
+            }
+        }));
+    }
+
+    bool consistent = true;
+    for (int i = 0; i < 100000; i++) {
+        Limits value = limits.get();
+        consistent = consistent && value.connections == value.requests && value.rate == value.connections;
+    }
+
+    done = true;
+    for (auto &writer : writers) {
+        writer.join();
+    }
+    ASSERT_EQ(consistent);
+
+    return true;
+}
+
+bool testFreeze() {
+    auto container = makeContainer();
+    container->registerService(new int(1));
+    container->registerService(new int(2), 2);
+    container->registerService(new Counted(3));
+    container->registerValue(std::chrono::seconds(5));
+    ASSERT_EQ(&container->getRef<int>(2) == container->get<int>(2).get());
+
+    container->freeze();
+    ASSERT_EQ(container->isFrozen());
+    ASSERT_EXCEPT(container->registerService(new int(3), 3));
+    ASSERT_EXCEPT(container->unregisterService<int>());
+    ASSERT_EXCEPT(container->registerValue(std::chrono::seconds(6), 0, true));
+
+    // References come from the frozen index without touching the reference counts.
+    auto shared = container->get<int>();
+    long count = shared.use_count();
+    int &first = container->getRef<int>();
+    ASSERT_EQ(&first == shared.get() && shared.use_count() == count);
+    ASSERT_EQ(container->getRef<int>(2) == 2 && container->getRef<Counted>().value == 3);
+    ASSERT_EQ(container->get<Counted>().use_count() == 2);
+    ASSERT_EXCEPT(container->getRef<int>(9));
+    ASSERT_EXCEPT(container->getRef<std::chrono::seconds>());
+
+    // Values can still be set, and scopes of a frozen container work as usual.
+    container->setValue(std::chrono::seconds(7));
+    ASSERT_EQ(container->getValue<std::chrono::seconds>().count() == 7);
+    auto scope = container->getScope();
+    scope->registerService(new int(4), 4);
+    ASSERT_EQ(scope->getRef<int>(4) == 4 && scope->getRef<int>(2) == 2);
+
+    scope->freeze();
+    ASSERT_EQ(scope->getRef<int>(4) == 4 && &scope->getRef<int>() == &first);
+
+    return true;
+}
+
+class RequestHandler {
+public:
+    RequestHandler() {
+        DOT_INJECT(Router, router);
+    }
+
+    std::shared_ptr<Router> router;
+};
+
+bool testCurrentScope() {
+    ASSERT_EQ(&Dot::current() == &Dot::AppContainer::instance());
+
+    auto container = makeContainer();
+    container->registerService(new Router({ "/root" }));
+    auto request = container->getScope();
+    request->registerService(new Router({ "/request" }), 0);
+    {
+        Dot::ScopeGuard guard(container);
+        ASSERT_EQ(&Dot::current() == container.get());
+        ASSERT_EQ(RequestHandler().router->routes[0] == "/root");
+
+        {
+            Dot::ScopeGuard nested(request);
+            ASSERT_EQ(&Dot::current() == request.get());
+            ASSERT_EQ(RequestHandler().router->routes[0] == "/request");
+        }
+        ASSERT_EQ(&Dot::current() == container.get());
+
+        // A bound job runs in the scope it was bound in, on any thread, and keeps it alive.
+        std::weak_ptr<Dot::Container> weak = request;
+        std::function<std::string()> job;
+        {
+            Dot::ScopeGuard nested(request);
+            job = Dot::bind([]() {
+                return RequestHandler().router->routes[0];
+            });
+        }
+        request.reset();
+        ASSERT_EQ(!weak.expired());
+
+        std::string route;
+        std::thread worker([&job, &route]() {
+            route = job();
+            job = nullptr;
+        });
+        worker.join();
+        ASSERT_EQ(route == "/request" && weak.expired());
+        ASSERT_EQ(&Dot::current() == container.get());
+    }
+    ASSERT_EQ(&Dot::current() == &Dot::AppContainer::instance());
+
+    return true;
+}
+
+#if defined(__cpp_impl_coroutine)
+struct ScopedTask {
+    struct promise_type : Dot::ScopedPromise {
+        ScopedTask get_return_object() {
+            return ScopedTask { std::coroutine_handle<promise_type>::from_promise(*this) };
+        }
+
+        void return_void() { }
+        void unhandled_exception() { }
+    };
+
+    std::coroutine_handle<promise_type> handle;
+};
+
+// Suspends the coroutine and leaves it for another thread to resume.
+struct Handoff {
+    std::coroutine_handle<> *parked;
+
+    bool await_ready() { return false; }
+    void await_suspend(std::coroutine_handle<> handle) { *parked = handle; }
+    void await_resume() { }
+};
+
+ScopedTask scopedRequest(std::coroutine_handle<> *parked, std::vector<std::string> *routes) {
+    routes->push_back(RequestHandler().router->routes[0]);
+    co_await Handoff { parked };
+    routes->push_back(RequestHandler().router->routes[0]);
+}
+
+bool testScopedCoroutine() {
+    auto container = makeContainer();
+    container->registerService(new Router({ "/coroutine" }));
+
+    std::coroutine_handle<> parked;
+    std::vector<std::string> routes;
+    ScopedTask task;
+    {
+        Dot::ScopeGuard guard(container);
+        task = scopedRequest(&parked, &routes);
+    }
+
+    // Each resumption happens on a thread with no scope of its own.
+    std::thread([&task]() { task.handle.resume(); }).join();
+    Dot::Container *after = nullptr;
+    std::thread([&parked, &after]() {
+        parked.resume();
+        after = &Dot::current();
+    }).join();
+
+    ASSERT_EQ(routes.size() == 2 && routes[0] == "/coroutine" && routes[1] == "/coroutine");
+    ASSERT_EQ(task.handle.done() && after == &Dot::AppContainer::instance());
+    task.handle.destroy();
+
+    return true;
+}
+#endif
+
+bool testFork() {
+    auto container = makeContainer();
+    auto request = container->getScope();
+    request->registerService(new Router({ "/request" }));
+    request->registerService(new int(1));
+    request->registerService(new int(2), 2);
+    request->registerValue(std::chrono::seconds(5));
+
+    auto task = request->fork();
+    ASSERT_EQ(task->getParent() == container.get() && task->getDepth() == request->getDepth());
+    ASSERT_EQ(task->size() == 4 && task->get<Router>() == request->get<Router>());
+
+    // Changes on either side stay private to it.
+    task->registerService(new Router({ "/task" }), 0, true);
+    task->unregisterService<int>(2);
+    task->registerValue(std::chrono::seconds(6), 0, true);
+    request->registerService(new int(3), 3);
+    ASSERT_EQ(task->get<Router>()->routes[0] == "/task" && request->get<Router>()->routes[0] == "/request");
+    ASSERT_EQ(*request->get<int>(2) == 2 && *request->get<int>(3) == 3);
+    ASSERT_EXCEPT(task->get<int>(2));
+    ASSERT_EXCEPT(task->get<int>(3));
+    ASSERT_EQ(task->getValue<std::chrono::seconds>().count() == 6);
+    ASSERT_EQ(request->getValue<std::chrono::seconds>().count() == 5);
+    ASSERT_EQ(task->size() == 3 && request->size() == 5 && task->memoryUsage().count == 3);
+
+    task->registerService(new int(4), 2);
+    ASSERT_EQ(*task->get<int>(2) == 4 && *request->get<int>(2) == 2);
+
+    // Forks of forks, and many forks of a scope that doesn't change in between.
+    auto subtask = task->fork();
+    subtask->unregisterService<Router>();
+    ASSERT_EXCEPT(subtask->get<Router>());
+    ASSERT_EQ(subtask->size() == 3 && *subtask->get<int>(2) == 4);
+    ASSERT_EQ(task->get<Router>()->routes[0] == "/task");
+
+    std::vector<std::shared_ptr<Dot::Container>> tasks;
+    for (int i = 0; i < 64; i++) {
+        tasks.push_back(request->fork());
+        tasks.back()->registerService(new int(i), 9);
+    }
+
+    for (int i = 0; i < 64; i++) {
+        ASSERT_EQ(*tasks[i]->get<int>(9) == i && *tasks[i]->get<int>(3) == 3);
+    }
+
+    ASSERT_EXCEPT(request->get<int>(9));
+
+    // A scope that keeps changing between forks still sees everything it registered.
+    auto churn = container->getScope(Dot::RegistryMode::Churn);
+    for (int i = 0; i < 20; i++) {
+        churn->registerService(new int(i), i);
+        churn->fork();
+    }
+
+    auto last = churn->fork();
+    ASSERT_EQ(last->size() == 20 && *last->get<int>(0) == 0 && *last->get<int>(19) == 19);
+
+    // Setting a value a fork inherited gives the container a copy of its own, while handles
+    // taken before the fork keep writing to the shared one.
+    auto settings = container->getScope();
+    settings->registerValue(std::chrono::seconds(5));
+    auto before = settings->valueHandle<std::chrono::seconds>();
+    auto worker = settings->fork();
+    auto idle = settings->fork();
+    worker->setValue(std::chrono::seconds(6));
+    settings->setValue(std::chrono::seconds(7));
+    worker->valueHandle<std::chrono::seconds>().set(std::chrono::seconds(8));
+    ASSERT_EQ(worker->getValue<std::chrono::seconds>().count() == 8);
+    ASSERT_EQ(settings->getValue<std::chrono::seconds>().count() == 7);
+    ASSERT_EQ(idle->getValue<std::chrono::seconds>().count() == 5);
+    before.set(std::chrono::seconds(9));
+    ASSERT_EQ(idle->getValue<std::chrono::seconds>().count() == 9 && settings->getValue<std::chrono::seconds>().count() == 7);
+
+    // Freezing a forked container merges its layers, and its values are then set in place.
+    auto forked = container->getScope();
+    forked->registerValue(std::chrono::seconds(1));
+    auto sibling = forked->fork();
+    forked->freeze();
+    std::atomic<bool> setting(true);
+    std::thread setter([&forked, &setting]() {
+        for (int i = 0; setting; i++) {
+            forked->setValue(std::chrono::seconds(i));
+        }
+    });
+
+    for (int i = 0; i < 10000; i++) {
+        forked->getValue<std::chrono::seconds>();
+    }
+
+    setting = false;
+    setter.join();
+    ASSERT_EQ(forked->size() == 1 && forked->memoryUsage().count == 1);
+    forked->setValue(std::chrono::seconds(2));
+    ASSERT_EQ(forked->getValue<std::chrono::seconds>().count() == 2);
+    ASSERT_EQ(sibling->getValue<std::chrono::seconds>().count() == 2);
+
+    // A frozen container can be forked, and the fork can be changed.
+    container->registerService(new int(7), 7);
+    container->freeze();
+    auto thawed = container->fork();
+    thawed->registerService(new int(8), 8);
+    ASSERT_EQ(!thawed->isFrozen() && *thawed->get<int>(7) == 7 && *thawed->get<int>(8) == 8);
+    ASSERT_EXCEPT(container->get<int>(8));
+
+    return true;
+}
+
 int main() {
     // List of available tests here.
     bool (*tests[])() = {
@@ -250,7 +1643,31 @@ int main() {
         &testErrors,
         &testUnregister,
         &testScope,
-        &testContainerAware
+        &testContainerAware,
+        &testChurnRegistry,
+        &testStats,
+        &testLockProfiler,
+        &testStartupProfiler,
+        &testGenerateLatency,
+        &testObservers,
+        &testFlightRecorder,
+        &testDependencyGraph,
+        &testLeakCheck,
+        &testMemoryUsage,
+        &testTraceRecorder,
+        &testInjectMacros,
+        &testAppInstance,
+        &testCompactContainerAware,
+        &testIntrusive,
+        &testGenerateUnique,
+        &testMoveConfig,
+        &testValues,
+        &testFreeze,
+        &testCurrentScope,
+#if defined(__cpp_impl_coroutine)
+        &testScopedCoroutine,
+#endif
+        &testFork,
     };
 
     // Iterate through all tests.
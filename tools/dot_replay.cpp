@@ -0,0 +1,350 @@
+#include <iostream>
+#include <iomanip>
+#include <thread>
+#include <unordered_map>
+#include "../dot.h"
+#include "../bench/bench.h"
+
+// Replays a trace written by Dot::TraceRecorder against a container configuration of your
+// choice, so lookup structures and locking can be compared on a recorded workload.  The
+// recorded types are mapped onto synthetic service types and each (type, id) pair onto a
+// synthetic id, so the replay makes the same calls in the same scopes without the original
+// classes.  Replay runs as fast as possible, ignoring the recorded timing.
+//
+// Usage: dot_replay <trace> [--mode=recorded|ordered|churn] [--threads=sequential|recorded]
+//                   [--repeat=1] [--latency] [--lock-profile]
+//
+// --threads=recorded replays each recorded thread's operations on a thread of its own.  A
+// thread that reaches an operation on a scope another thread hasn't created yet skips it, and
+// the skips are reported.  --latency times every operation; --lock-profile runs the
+// LockProfiler during the replay and prints its report.
+
+static const int SYNTHETIC_TYPES = 128;
+
+template<int N>
+class Synthetic {
+public:
+    uint64_t value;
+};
+
+struct SyntheticOps {
+    void (*registerService)(Dot::Container &container, int id);
+    bool (*unregisterService)(Dot::Container &container, int id);
+    bool (*get)(Dot::Container &container, int id);
+    void (*generate)(Dot::Container &container);
+    void (*registerFactory)(Dot::Container &container);
+};
+
+template<int N>
+struct SyntheticTable {
+    static void fill(SyntheticOps *table) {
+        SyntheticTable<N - 1>::fill(table);
+        table[N - 1] = SyntheticOps {
+            [](Dot::Container &container, int id) {
+                container.registerService(new Synthetic<N - 1>(), id, true);
+            },
+            [](Dot::Container &container, int id) {
+                try {
+                    container.unregisterService<Synthetic<N - 1>>(id);
+                    return true;
+                } catch (const Dot::ContainerException &) {
+                    return false;
+                }
+            },
+            [](Dot::Container &container, int id) {
+                try {
+                    Bench::doNotOptimize(container.get<Synthetic<N - 1>>(id));
+                    return true;
+                } catch (const Dot::ContainerException &) {
+                    return false;
+                }
+            },
+            [](Dot::Container &container) {
+                Bench::doNotOptimize(container.generate<Synthetic<N - 1>>(Dot::EmptyConfig()));
+            },
+            [](Dot::Container &container) {
+                container.registerFactory<Synthetic<N - 1>, Dot::EmptyConfig>([](const Dot::EmptyConfig &) {
+                    return new Synthetic<N - 1>();
+                });
+            }
+        };
+    }
+};
+
+template<>
+struct SyntheticTable<0> {
+    static void fill(SyntheticOps * /* table */) {
+    }
+};
+
+static SyntheticOps table[SYNTHETIC_TYPES];
+
+/**
+ * A trace record resolved to the synthetic type and id to replay it with.
+ */
+struct Step {
+    /** False for a record that can't be replayed: an unknown operation, scope or mode. */
+    bool valid;
+    Dot::Operation operation;
+    bool hit;
+    uint32_t synthetic;
+    int id;
+    uint32_t scope;
+
+    /** The parent scope, or for a fork the scope it was forked from. */
+    uint32_t parent;
+    bool fork;
+    Dot::RegistryMode mode;
+};
+
+struct Replay {
+    std::vector<std::shared_ptr<Dot::Container>> scopes;
+    std::atomic<uint64_t> mismatches;
+    std::atomic<uint64_t> skipped;
+    bool latency;
+    Dot::LatencyHistogram histograms[Dot::OPERATION_COUNT];
+
+    Replay() :
+            mismatches(0),
+            skipped(0),
+            latency(false) {
+
+    }
+};
+
+/**
+ * Resolves the records into steps.  Scopes are numbered in the order they are announced, so
+ * a record naming a scope that hasn't been announced, or an unknown operation or registry
+ * mode, comes from a truncated or corrupt trace; its step is marked invalid and counted.
+ */
+static std::vector<Step> prepare(const std::vector<Dot::TraceRecorder::Record> &records, const std::string &mode,
+                                 uint32_t &scopeCount, uint64_t &invalid) {
+    std::unordered_map<uint64_t, int> ids;
+    std::vector<int> nextId(SYNTHETIC_TYPES);
+    std::vector<Step> steps;
+    scopeCount = 0;
+    invalid = 0;
+
+    for (const auto &record : records) {
+        Step step = Step();
+        step.operation = static_cast<Dot::Operation>(record.operation);
+        step.hit = (record.flags & Dot::TraceRecorder::FLAG_HIT) != 0;
+        step.scope = record.scope;
+        if (record.operation >= Dot::OPERATION_COUNT) {
+            step.valid = false;
+        } else if (step.operation == Dot::Operation::GetScope && (record.flags & Dot::TraceRecorder::FLAG_FORK)) {
+            // A fork takes its source's registry mode, whatever --mode says.
+            step.parent = record.type;
+            step.fork = true;
+            step.valid = record.scope == scopeCount && record.type < scopeCount;
+            if (step.valid) {
+                scopeCount++;
+            }
+        } else if (step.operation == Dot::Operation::GetScope) {
+            step.parent = record.type;
+            step.mode = mode == "churn" ? Dot::RegistryMode::Churn : mode == "ordered" ? Dot::RegistryMode::Ordered :
+                        static_cast<Dot::RegistryMode>(record.id);
+            step.valid = record.scope == scopeCount &&
+                         (record.type == Dot::TraceRecorder::NO_SCOPE || record.type < scopeCount) &&
+                         (step.mode == Dot::RegistryMode::Ordered || step.mode == Dot::RegistryMode::Churn);
+            if (step.valid) {
+                scopeCount++;
+            }
+        } else {
+            step.valid = record.scope < scopeCount;
+        }
+
+        if (!step.valid) {
+            invalid++;
+        } else if (step.operation != Dot::Operation::GetScope && step.operation != Dot::Operation::DestroyScope) {
+            step.synthetic = record.type % SYNTHETIC_TYPES;
+            uint64_t key = (static_cast<uint64_t>(record.type) << 32) | static_cast<uint32_t>(record.id);
+            auto id = ids.find(key);
+            if (id == ids.end()) {
+                id = ids.insert(std::make_pair(key, nextId[step.synthetic]++)).first;
+            }
+
+            step.id = id->second;
+        }
+
+        steps.push_back(step);
+    }
+
+    return steps;
+}
+
+static void replay(Replay &replay, const std::vector<Step> &steps, bool shared) {
+    for (const auto &step : steps) {
+        if (!step.valid) {
+            continue;
+        }
+
+        uint64_t start = replay.latency ? Bench::now() : 0;
+        if (step.operation == Dot::Operation::GetScope) {
+            std::shared_ptr<Dot::Container> scope;
+            if (step.fork) {
+                auto source = std::atomic_load(&replay.scopes[step.parent]);
+                if (!source) {
+                    replay.skipped++;
+                    continue;
+                }
+
+                scope = source->fork();
+            } else if (step.parent == Dot::TraceRecorder::NO_SCOPE) {
+                scope = std::make_shared<Dot::Container>(step.mode);
+                for (auto &ops : table) {
+                    ops.registerFactory(*scope);
+                }
+            } else {
+                auto parent = std::atomic_load(&replay.scopes[step.parent]);
+                if (!parent) {
+                    replay.skipped++;
+                    continue;
+                }
+
+                scope = parent->getScope(step.mode);
+            }
+
+            std::atomic_store(&replay.scopes[step.scope], scope);
+        } else {
+            auto scope = shared ? std::atomic_load(&replay.scopes[step.scope]) : replay.scopes[step.scope];
+            if (!scope) {
+                replay.skipped++;
+                continue;
+            }
+
+            const SyntheticOps &ops = table[step.synthetic];
+            switch (step.operation) {
+            case Dot::Operation::RegisterService:
+                ops.registerService(*scope, step.id);
+                break;
+            case Dot::Operation::UnregisterService:
+                ops.unregisterService(*scope, step.id);
+                break;
+            case Dot::Operation::Get:
+                if (ops.get(*scope, step.id) != step.hit) {
+                    replay.mismatches++;
+                }
+                break;
+            case Dot::Operation::Generate:
+                ops.generate(*scope);
+                break;
+            case Dot::Operation::DestroyScope:
+                std::atomic_store(&replay.scopes[step.scope], std::shared_ptr<Dot::Container>());
+                break;
+            default:
+                break;
+            }
+        }
+
+        if (replay.latency) {
+            replay.histograms[static_cast<int>(step.operation)].record(Bench::now() - start);
+        }
+    }
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2 || argv[1][0] == '-') {
+        std::cerr << "Usage: dot_replay <trace> [--mode=recorded|ordered|churn] [--threads=sequential|recorded] "
+                  << "[--repeat=1] [--latency] [--lock-profile]" << std::endl;
+        return 2;
+    }
+
+    std::string mode = Bench::arg(argc, argv, "mode", std::string("recorded"));
+    std::string threads = Bench::arg(argc, argv, "threads", std::string("sequential"));
+    uint64_t repeat = Bench::arg(argc, argv, "repeat", 1ULL);
+    bool latency = false;
+    bool lockProfile = false;
+    for (int i = 2; i < argc; i++) {
+        latency = latency || std::string(argv[i]) == "--latency";
+        lockProfile = lockProfile || std::string(argv[i]) == "--lock-profile";
+    }
+
+    std::vector<std::string> types;
+    std::vector<Dot::TraceRecorder::Record> records;
+    if (!Dot::TraceRecorder::read(argv[1], types, records)) {
+        std::cerr << "Not a Dot trace: " << argv[1] << std::endl;
+        return 2;
+    }
+
+    uint32_t scopeCount = 0;
+    uint64_t invalid = 0;
+    std::vector<Step> steps = prepare(records, mode, scopeCount, invalid);
+    if (invalid) {
+        std::cerr << "Skipping " << invalid << " records with an unknown operation, scope or mode" << std::endl;
+    }
+
+    // Split the steps by recorded thread for a parallel replay.
+    std::map<uint16_t, std::vector<Step>> perThread;
+    if (threads == "recorded") {
+        for (size_t i = 0; i < records.size(); i++) {
+            perThread[records[i].thread].push_back(steps[i]);
+        }
+    }
+
+    SyntheticTable<SYNTHETIC_TYPES>::fill(table);
+    std::cout << records.size() << " operations on " << types.size() << " types in " << scopeCount
+              << " scopes, recorded over " << Dot::formatNanos(records.empty() ? 0 : records.back().nanos)
+              << ", mode " << mode << ", " << (perThread.empty() ? "sequential" : std::to_string(perThread.size()) +
+              " threads") << std::endl;
+
+    if (lockProfile) {
+        Dot::LockProfiler::start();
+    }
+
+    std::unique_ptr<Replay> state(new Replay());
+    state->latency = latency;
+    uint64_t start = Bench::now();
+    for (uint64_t round = 0; round < repeat; round++) {
+        state->scopes.assign(scopeCount, nullptr);
+        if (perThread.empty()) {
+            replay(*state, steps, false);
+            continue;
+        }
+
+        std::vector<std::thread> workers;
+        for (const auto &thread : perThread) {
+            const std::vector<Step> &threadSteps = thread.second;
+            workers.push_back(std::thread([&state, &threadSteps]() {
+                replay(*state, threadSteps, true);
+            }));
+        }
+
+        for (auto &worker : workers) {
+            worker.join();
+        }
+    }
+
+    double seconds = (Bench::now() - start) / 1e9;
+    state->scopes.clear();
+    if (lockProfile) {
+        Dot::LockProfiler::stop();
+    }
+
+    std::cout << "replayed " << records.size() * repeat << " operations in " << std::fixed << std::setprecision(3)
+              << seconds << "s (" << std::setprecision(0) << records.size() * repeat / seconds << " ops/sec), "
+              << state->mismatches << " get hit/miss mismatches, " << state->skipped << " skipped" << std::endl;
+
+    if (latency) {
+        std::cout << std::left << std::setw(20) << "operation" << std::right << std::setw(12) << "count"
+                  << std::setw(10) << "mean" << std::setw(10) << "p50" << std::setw(10) << "p99" << std::setw(10)
+                  << "p999" << std::endl;
+        for (int operation = 0; operation < Dot::OPERATION_COUNT; operation++) {
+            const Dot::LatencyHistogram &histogram = state->histograms[operation];
+            if (histogram.count()) {
+                std::cout << std::left << std::setw(20) << Dot::operationName(static_cast<Dot::Operation>(operation))
+                          << std::right << std::setw(12) << histogram.count() << std::setw(10)
+                          << Dot::formatNanos(histogram.mean()) << std::setw(10)
+                          << Dot::formatNanos(histogram.percentile(0.5)) << std::setw(10)
+                          << Dot::formatNanos(histogram.percentile(0.99)) << std::setw(10)
+                          << Dot::formatNanos(histogram.percentile(0.999)) << std::endl;
+            }
+        }
+    }
+
+    if (lockProfile) {
+        Dot::LockProfiler::report(std::cout);
+    }
+
+    return 0;
+}